@@ -1,4 +1,4 @@
-QMAKE_CXXFLAGS += -std=c++11
+QMAKE_CXXFLAGS += -std=c++14
 
 QT += network
 
@@ -7,14 +7,41 @@ HEADERS += ircclient.h \
     calendar.h \
     unvquery.h \
     github.h \
-    config.h
+    config.h \
+    scheduler.h \
+    eventloop.h \
+    ircmessage.h \
+    log.h \
+    metrics.h \
+    ratelimit.h \
+    admin.h \
+    reload.h \
+    linkscan.h \
+    civildate.h \
+    icalendar.h \
+    clock.h \
+    simulation.h \
+    httpclient.h
 
 SOURCES += ircclient.cpp \
     mantis.cpp \
     calendar.cpp \
     unvquery.cpp \
     github.cpp \
-    config.cpp
+    config.cpp \
+    scheduler.cpp \
+    eventloop.cpp \
+    ircmessage.cpp \
+    log.cpp \
+    metrics.cpp \
+    ratelimit.cpp \
+    admin.cpp \
+    reload.cpp \
+    linkscan.cpp \
+    icalendar.cpp \
+    clock.cpp \
+    simulation.cpp \
+    httpclient.cpp
 
 LIBS += -lircclient -pthread -lconfig++ -lcurl
 
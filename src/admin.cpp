@@ -0,0 +1,297 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "admin.h"
+#include "eventloop.h"
+#include "ircclient.h"
+#include "metrics.h"
+#include "reload.h"
+#include "log.h"
+
+using namespace std;
+
+AdminServer::AdminServer(EventLoop *eventLoop, string path, list<IRCClient *> *clients,
+                         ConfigReloader *reloader)
+{
+	sockaddr_un localAddr;
+
+	this->eventLoop = eventLoop;
+	this->clients   = clients;
+	this->reloader  = reloader;
+
+	memset(&localAddr, 0, sizeof(localAddr));
+	localAddr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(localAddr.sun_path))
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Admin socket path " << path << " is too long.");
+		throw -1;
+	}
+
+	strncpy(localAddr.sun_path, path.c_str(), sizeof(localAddr.sun_path) - 1);
+
+	this->listenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (this->listenSock < 0)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to create socket.");
+		throw -2;
+	}
+
+	fcntl(this->listenSock, F_SETFL, O_NONBLOCK);
+
+	// replace a socket left behind by an earlier run
+	unlink(path.c_str());
+
+	if (::bind(this->listenSock, (sockaddr *)&localAddr, sizeof(localAddr)) < 0 ||
+	    listen(this->listenSock, 4) < 0)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to listen on " << path << ".");
+		throw -3;
+	}
+
+	// only the owner may control the bot
+	chmod(path.c_str(), S_IRUSR | S_IWUSR);
+
+	LOG(Log::LEVEL_INFO, NOTICE << "Receiving commands on " << path << ".");
+
+	this->eventLoop->watch(this->listenSock, std::bind(&AdminServer::accept, this));
+}
+
+void AdminServer::accept()
+{
+	int fd;
+
+	while ((fd = ::accept(this->listenSock, NULL, NULL)) >= 0)
+	{
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		this->buffers[fd] = "";
+		this->eventLoop->watch(fd, std::bind(&AdminServer::receive, this, fd));
+	}
+}
+
+void AdminServer::receive(int fd)
+{
+	char    buffer[1024];
+	ssize_t len;
+	size_t  newline;
+	string  &input = this->buffers[fd];
+
+	while ((len = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+	{
+		input.append(buffer, len);
+	}
+
+	// execute every complete line
+	while ((newline = input.find('\n')) != string::npos)
+	{
+		string line     = input.substr(0, newline);
+		string response;
+
+		input.erase(0, newline + 1);
+
+		if (!line.empty() && line[line.size() - 1] == '\r')
+		{
+			line.erase(line.size() - 1);
+		}
+
+		if (line.empty())
+		{
+			continue;
+		}
+
+		LOG(Log::LEVEL_INFO, COMMAND << line);
+
+		response = this->execute(line);
+
+		LOG(Log::LEVEL_INFO, ANSWER << response.substr(0, response.find('\n')));
+
+		if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) < (ssize_t)response.size())
+		{
+			LOG(Log::LEVEL_ERROR, ERROR << "Failed to send admin response.");
+		}
+	}
+
+	if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+	    input.size() > ADMIN_LINE_MAX)
+	{
+		this->close(fd);
+	}
+}
+
+void AdminServer::close(int fd)
+{
+	this->eventLoop->unwatch(fd);
+	this->buffers.erase(fd);
+	::close(fd);
+}
+
+string AdminServer::ok(const string &summary, const string &data)
+{
+	string response = string(ADMIN_OK) + " " + summary + "\n" + data;
+
+	if (!data.empty() && data[data.size() - 1] != '\n')
+	{
+		response += "\n";
+	}
+
+	return response + ADMIN_END "\n";
+}
+
+string AdminServer::err(const string &reason)
+{
+	return string(ADMIN_ERR) + " " + reason + "\n" ADMIN_END "\n";
+}
+
+IRCClient *AdminServer::findClient(const string &network)
+{
+	for (IRCClient *client : *this->clients)
+	{
+		if (client->getNetwork() == network)
+		{
+			return client;
+		}
+	}
+
+	return NULL;
+}
+
+string AdminServer::execute(const string &line)
+{
+	istringstream stream(line);
+	string        command, network, channel, password;
+	IRCClient     *client = NULL;
+
+	stream >> command;
+
+	if (command == "help")
+	{
+		return ok("Available commands.",
+		          "help\n"
+		          "stats\n"
+		          "refresh [network]\n"
+		          "flush\n"
+		          "reload\n"
+		          "join <network> <channel> [password]\n"
+		          "part <network> <channel>\n"
+		          "reconnect <network>\n");
+	}
+
+	if (command == "stats")
+	{
+		string data;
+
+		for (IRCClient *client : *this->clients)
+		{
+			data += "network " + client->status() + "\n";
+		}
+
+		return ok("Statistics.", data + Metric::exportAll());
+	}
+
+	if (command == "flush")
+	{
+		for (IRCClient *client : *this->clients)
+		{
+			client->flushCaches();
+		}
+
+		return ok("Caches flushed.");
+	}
+
+	if (command == "reload")
+	{
+		string changes;
+
+		if (this->reloader->reload(changes))
+		{
+			return ok("Configuration reloaded.", changes);
+		}
+		else
+		{
+			return err(changes.substr(0, changes.find('\n')));
+		}
+	}
+
+	// remaining commands address a network
+	stream >> network;
+
+	if (!network.empty() && !(client = this->findClient(network)))
+	{
+		return err("Unknown network " + network + ".");
+	}
+
+	if (command == "refresh")
+	{
+		for (IRCClient *cursor : *this->clients)
+		{
+			if (!client || cursor == client)
+			{
+				cursor->forceRefresh();
+			}
+		}
+
+		return ok("Refresh scheduled.");
+	}
+
+	if (command == "join" || command == "part" || command == "reconnect")
+	{
+		if (!client)
+		{
+			return err("Missing network.");
+		}
+
+		if (command == "reconnect")
+		{
+			client->reconnect("Reconnect via admin socket.");
+			return ok("Reconnecting to " + network + ".");
+		}
+
+		stream >> channel >> password;
+
+		if (channel.empty())
+		{
+			return err("Missing channel.");
+		}
+
+		if (command == "join")
+		{
+			client->join(channel, password, BROADCAST_ALL);
+			return ok("Joining " + channel + " on " + network + ".");
+		}
+		else
+		{
+			client->leave(channel);
+			return ok("Leaving " + channel + " on " + network + ".");
+		}
+	}
+
+	return err("Unknown command " + command + ", try help.");
+}
@@ -0,0 +1,82 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+class EventLoop;
+class IRCClient;
+class ConfigReloader;
+
+// Maximum length of a command line
+#define ADMIN_LINE_MAX 1024
+
+// Response status lines, data lines follow and a line with a single dot ends a response
+#define ADMIN_OK       "OK"
+#define ADMIN_ERR      "ERR"
+#define ADMIN_END      "."
+
+/**
+ * @brief A control socket in the unix domain, served by the event loop.
+ *
+ * Accepts one command per line and answers each with a status line starting with OK or ERR,
+ * followed by any data lines and terminated by a line containing a single dot.
+ */
+class AdminServer
+{
+public:
+
+	/**
+	 * @param eventLoop Event loop that serves the socket
+	 * @param path      Path of the socket, an existing file is replaced
+	 * @param clients   IRC clients that can be controlled
+	 * @param reloader  Applies configuration changes
+	 */
+	AdminServer(EventLoop *eventLoop, std::string path, std::list<IRCClient *> *clients,
+	            ConfigReloader *reloader);
+
+private:
+
+	EventLoop                  *eventLoop;
+	std::list<IRCClient *>     *clients;
+	ConfigReloader             *reloader;
+	int                        listenSock;
+	std::map<int, std::string> buffers;
+
+	void accept();
+	void receive(int fd);
+	void close(int fd);
+
+	std::string execute(const std::string &line);
+	IRCClient   *findClient(const std::string &network);
+
+	static std::string ok(const std::string &summary, const std::string &data = "");
+	static std::string err(const std::string &reason);
+};
+
+#endif // ADMIN_H
@@ -21,19 +21,44 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <ctime>
 #include <sstream>
-#include <ctime>
+#include <algorithm>
+#include <cstdio>
+#include <fnmatch.h>
 
 #include "calendar.h"
+#include "civildate.h"
+#include "icalendar.h"
+#include "log.h"
 
 using namespace std;
 
-Calendar::timepoint_t Calendar::nextDate(const timepoint_t date, recurrence_t recurrence)
+int64_t Calendar::daysOf(const timepoint_t date)
 {
-	time_t time = chrono::system_clock::to_time_t(date);
-	tm     utc  = *gmtime(&time);
-	int    year = utc.tm_year + 1900;
-	bool   leap = (year % 4 == 0 && (year % 400 == 0 || year % 100 != 0));
+	int64_t seconds = chrono::duration_cast<chrono::seconds>(date.time_since_epoch()).count();
 
+	// round towards the past, so that instants before the epoch fall on the right day
+	return (seconds >= 0 ? seconds : seconds - 86399) / 86400;
+}
+
+Calendar::timepoint_t Calendar::moveToDay(const timepoint_t date, int64_t days)
+{
+	return date + chrono::hours(24 * (days - Calendar::daysOf(date)));
+}
+
+Calendar::timepoint_t Calendar::addMonths(const timepoint_t date, int months)
+{
+	return Calendar::moveToDay(date, CivilDate::addMonths(Calendar::daysOf(date), months));
+}
+
+Calendar::timepoint_t Calendar::firstWeekdayOf(const timepoint_t date, int months)
+{
+	int64_t days = Calendar::daysOf(date);
+
+	return Calendar::moveToDay(date, CivilDate::firstWeekdayOf(days, months, CivilDate::weekdayFromDays(days)));
+}
+
+Calendar::timepoint_t Calendar::nextDate(const timepoint_t date, recurrence_t recurrence)
+{
 	switch (recurrence)
 	{
 		case ONCE:
@@ -52,59 +77,74 @@ Calendar::timepoint_t Calendar::nextDate(const timepoint_t date, recurrence_t re
 			return date + chrono::hours(24 * 7);
 
 		case FIRSTOF:
-		{
-			timepoint_t d = date;
-			time_t      t;
-			tm          u;
+			return Calendar::firstWeekdayOf(date, 1);
 
-			do
-			{
-				d += chrono::hours(24 * 7);
-				t  = chrono::system_clock::to_time_t(d);
-				u  = *gmtime(&t);
-			}
-			while (u.tm_mon == utc.tm_mon);
+		case MONTHLY:
+			return Calendar::addMonths(date, 1);
 
-			return d;
-		}
+		case YEARLY:
+			return Calendar::addMonths(date, 12);
+
+		default:
+			LOG(Log::LEVEL_ERROR, ERROR << "Calendar::nextEvent called with unknown recurrence value.");
+			return date;
+	}
+}
+
+Calendar::timepoint_t Calendar::lastDateBefore(const timepoint_t date, recurrence_t recurrence, const timepoint_t now)
+{
+	duration_t         period;
+	CivilDate::civil_t civil;
+	int                months;
+
+	if (date > now)
+	{
+		return date;
+	}
+
+	switch (recurrence)
+	{
+		case MINUTELY: period = chrono::minutes(1);       break;
+		case HOURLY:   period = chrono::hours(1);         break;
+		case DAILY:    period = chrono::hours(24);        break;
+		case WEEKLY:   period = chrono::hours(24 * 7);    break;
 
+		case FIRSTOF:
 		case MONTHLY:
-			switch (utc.tm_mon + 1)
+		case YEARLY:
+			civil = CivilDate::civilFromDays(Calendar::daysOf(date));
+
+			// stop a month short, the remaining steps are done by nextDate
+			months = CivilDate::monthsBetween(Calendar::daysOf(date), Calendar::daysOf(now)) - 1;
+
+			if (months <= 0)
 			{
-				case 2:
-					if (leap)
-					{
-						return date + chrono::hours(24 * 29);
-					}
-					else
-					{
-						return date + chrono::hours(24 * 28);
-					}
-
-				case 4:
-				case 6:
-				case 9:
-				case 11:
-					return date + chrono::hours(24 * 30);
-
-				default:
-					return date + chrono::hours(24 * 31);
+				return date;
 			}
 
-		case YEARLY:
-	        if (leap)
+			if (recurrence == FIRSTOF)
 			{
-				return date + chrono::hours(24 * 366);
+				return Calendar::firstWeekdayOf(date, months);
 			}
-			else
+
+			// a jump lands where single steps do only if no day spills into the next month
+			if (recurrence == MONTHLY && civil.day <= 28)
 			{
-				return date + chrono::hours(24 * 365);
+				return Calendar::addMonths(date, months);
 			}
 
+			if (recurrence == YEARLY && !(civil.month == 2 && civil.day == 29))
+			{
+				return Calendar::addMonths(date, months - months % 12);
+			}
+
+			return date;
+
 		default:
-			cout << ERROR << "Calendar::nextEvent called with unknown recurrence value.";
 			return date;
 	}
+
+	return date + ((now - date) / period) * period;
 }
 
 string Calendar::recurrenceToString(recurrence_t recurrence)
@@ -118,6 +158,7 @@ string Calendar::recurrenceToString(recurrence_t recurrence)
 		case FIRSTOF:  return "monthly at a fixed weekday";
 		case MONTHLY:  return "monthly";
 		case YEARLY:   return "once a year";
+		case RULE:     return "by rule";
 		default:       return "";
 	}
 }
@@ -133,7 +174,7 @@ Calendar::recurrence_t Calendar::stringToRecurrence(const string str)
 	if (str.find("y")  == 0) return YEARLY;
 	else
 	{
-		cout << ERROR << "Failed to parse recurrence value, using 'once'." << endl;
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to parse recurrence value, using 'once'.");
 		return ONCE;
 	}
 }
@@ -144,11 +185,12 @@ string Calendar::dateToString(const timepoint_t date)
 	const char *weekday[] = {
 	    "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
 
-	time_t time = chrono::system_clock::to_time_t(date);
-	tm     utc  = *gmtime(&time);
+	int64_t            days    = Calendar::daysOf(date);
+	int64_t            seconds = chrono::duration_cast<chrono::seconds>(date.time_since_epoch()).count() - days * 86400;
+	CivilDate::civil_t civil   = CivilDate::civilFromDays(days);
 
-	snprintf(buf, sizeof(buf), "%s, %04u-%02u-%02u, %02u:%02u UTC", weekday[utc.tm_wday],
-	         utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min);
+	snprintf(buf, sizeof(buf), "%s, %04u-%02u-%02u, %02u:%02u UTC", weekday[CivilDate::weekdayFromDays(days)],
+	         (unsigned int)civil.year, civil.month, civil.day, (unsigned int)(seconds / 3600), (unsigned int)(seconds / 60 % 60));
 
 	return string(buf);
 }
@@ -156,18 +198,18 @@ string Calendar::dateToString(const timepoint_t date)
 string Calendar::dateOffsetToString(const timepoint_t date)
 {
 	ostringstream stream;
-	bool          future = (date >= chrono::system_clock::now());
+	bool          future = (date >= this->clock->now());
 	duration_t    offset;
 	int           div, lastDiv, seconds, minutes, hours, days, weeks;
 	int           tokens = 0;
 
 	if (future)
 	{
-		offset = chrono::duration_cast<chrono::seconds>(date - chrono::system_clock::now());
+		offset = chrono::duration_cast<chrono::seconds>(date - this->clock->now());
 	}
 	else
 	{
-		offset = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now() - date);
+		offset = chrono::duration_cast<chrono::seconds>(this->clock->now() - date);
 	}
 
 	// round up one second
@@ -242,14 +284,80 @@ string Calendar::dateOffsetToString(const timepoint_t date)
 	return stream.str();
 }
 
-Calendar::Calendar(bool useColor)
+Calendar::timepoint_t Calendar::dueAt(const event_t *event)
+{
+	if (event->currentWarnCount > 0)
+	{
+		return event->date - event->currentWarn;
+	}
+	else
+	{
+		return event->date;
+	}
+}
+
+bool Calendar::dueLater(const event_t *a, const event_t *b)
+{
+	return Calendar::dueAt(a) > Calendar::dueAt(b);
+}
+
+Calendar::Calendar(Scheduler *scheduler, bool useColor, Clock *clock)
+{
+	this->scheduler = scheduler;
+	this->useColor  = useColor;
+	this->clock     = clock;
+	this->pumpTimer = 0;
+
+	this->journalRecords = 0;
+
+	this->events = vector<event_t *>();
+}
+
+void Calendar::subscribe(subscriber_t subscriber)
+{
+	lock_guard<mutex> guard(this->subscriberLock);
+
+	this->subscribers.push_back(subscriber);
+}
+
+void Calendar::pump()
 {
-	this->useColor = useColor;
+	IRCMessage message(this->pumpEvents());
 
-	this->events = set<event_t *>();
+	if (!message.empty())
+	{
+		lock_guard<mutex> guard(this->subscriberLock);
+
+		for (subscriber_t &subscriber : this->subscribers)
+		{
+			subscriber(message);
+		}
+	}
+
+	this->reschedule();
 }
 
-bool Calendar::addEvent(string input)
+void Calendar::reschedule()
+{
+	lock_guard<mutex> guard(this->lock);
+
+	if (!this->scheduler)
+	{
+		return;
+	}
+
+	// sleep until the next warning or start, if there is any
+	this->scheduler->cancel(this->pumpTimer);
+	this->pumpTimer = 0;
+
+	if (!this->events.empty())
+	{
+		this->pumpTimer = this->scheduler->schedule(Calendar::dueAt(this->events.front()),
+		                                            bind(&Calendar::pump, this));
+	}
+}
+
+bool Calendar::addEvent(string input, bool runtime)
 {
 	istringstream stream(input);
 
@@ -269,9 +377,9 @@ bool Calendar::addEvent(string input)
 	description.erase(0, description.find_first_not_of(" \t"));
 	description.erase(description.find_last_not_of(" \t") + 1);
 
-	if (description.empty())
+	if (stream.fail() || description.empty())
 	{
-		cout << ERROR << "Failed to parse event." << endl;
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to parse event.");
 		return false;
 	}
 
@@ -279,111 +387,400 @@ bool Calendar::addEvent(string input)
 	duration_t   warn       = chrono::seconds(warnSeconds);
 	recurrence_t recurrence = this->stringToRecurrence(recurrenceStr);
 
-	return addEvent(date, warn, warnCount, recurrence, description);
+	return addEvent(date, warn, warnCount, recurrence, description, input, runtime);
 }
 
 bool Calendar::addEvent(timepoint_t date, duration_t warn, unsigned int warnCount,
-                        recurrence_t recurrence, std::string description)
+                        recurrence_t recurrence, std::string description, std::string source, bool runtime,
+                        shared_ptr<RRule> rule)
 {
-	timepoint_t now = chrono::system_clock::now();
+	lock_guard<mutex> guard(this->lock);
+	timepoint_t       now              = this->clock->now();
+	duration_t        currentWarn      = warn;
+	unsigned int      currentWarnCount = warnCount;
+	auto              state            = this->restored.find(source);
+
+	// events that were over before a restart stay over
+	if (!source.empty() && this->done.count(source))
+	{
+		return false;
+	}
 
-	// find next recurring date in the future
-	if (date <= now)
+	if (state != this->restored.end() && state->second.date > now)
 	{
-		if (recurrence != ONCE)
+		// continue where the last run left off
+		date             = state->second.date;
+		currentWarn      = state->second.currentWarn;
+		currentWarnCount = state->second.currentWarnCount;
+	}
+	else
+	{
+		// find next recurring date in the future
+		if (recurrence == RULE)
 		{
-			do
+			if (!rule || !rule->nextAfter(now, date))
 			{
-				date = Calendar::nextDate(date, recurrence);
+				return false;
 			}
-			while(date <= now);
 		}
-		else
+		else if (date <= now)
 		{
-			return false;
+			if (recurrence != ONCE)
+			{
+				date = Calendar::lastDateBefore(date, recurrence, now);
+
+				do
+				{
+					date = Calendar::nextDate(date, recurrence);
+				}
+				while(date <= now);
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		// decrease warn counter for past warnings
+		while (currentWarnCount > 0 && date - currentWarn <= now)
+		{
+			currentWarn /= 2;
+			currentWarnCount--;
 		}
 	}
 
+	if (state != this->restored.end())
+	{
+		this->restored.erase(state);
+	}
+
 	event_t *event = new event_t;
 
 	event->description      = description;
 	event->date             = date;
 	event->warn             = warn;
-	event->currentWarn      = warn;
+	event->currentWarn      = currentWarn;
 	event->warnCount        = warnCount;
-	event->currentWarnCount = warnCount;
+	event->currentWarnCount = currentWarnCount;
 	event->recurrence       = recurrence;
+	event->source           = source;
+	event->runtime          = runtime;
+	event->rule             = rule;
 
-	// decrease warn counter for past warnings
-	while (event->currentWarnCount > 0 && event->date - event->currentWarn <= now)
+	this->events.push_back(event);
+	push_heap(this->events.begin(), this->events.end(), Calendar::dueLater);
+
+	// the new event may be due before the pending wakeup
+	if (this->scheduler && this->events.front() == event)
 	{
-		event->currentWarn /= 2;
-		event->currentWarnCount--;
+		this->scheduler->cancel(this->pumpTimer);
+		this->pumpTimer = this->scheduler->schedule(Calendar::dueAt(event), bind(&Calendar::pump, this));
 	}
 
-	this->events.insert(event);
+	if (runtime)
+	{
+		this->record(JOURNAL_ADDED, source);
+	}
 
 	return true;
 }
 
-int Calendar::numEvents()
+bool Calendar::load(string path)
 {
-	return this->events.size();
+	vector<string> added;
+
+	{
+		lock_guard<mutex> guard(this->lock);
+
+		this->statePath   = path;
+		this->journalPath = path + ".journal";
+
+		// the snapshot is read in one go, then the journal replays the changes made since
+		for (const string &file : {this->statePath, this->journalPath})
+		{
+			ifstream      in(file);
+			ostringstream contents;
+			string        line;
+
+			if (!in)
+			{
+				continue;
+			}
+
+			contents << in.rdbuf();
+
+			istringstream lines(contents.str());
+
+			while (getline(lines, line))
+			{
+				this->replay(line, added);
+
+				if (file == this->journalPath)
+				{
+					this->journalRecords++;
+				}
+			}
+		}
+	}
+
+	// events added at runtime come back, the journal isn't open yet so they aren't recorded again
+	for (const string &definition : added)
+	{
+		this->addEvent(definition, true);
+	}
+
+	lock_guard<mutex> guard(this->lock);
+
+	this->journal.open(this->journalPath, ios::app);
+
+	if (!this->journal)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to open calendar journal " << this->journalPath << ".");
+		return false;
+	}
+
+	LOG(Log::LEVEL_INFO, NOTICE << "Restored calendar state from " << path << ", " << added.size()
+	                            << " events were added at runtime.");
+
+	return true;
 }
 
-string Calendar::listEvents()
+void Calendar::replay(const string &line, vector<string> &added)
 {
-	ostringstream stream;
+	istringstream stream(line.size() > 2 ? line.substr(2) : "");
+	string        text = stream.str();
+	long long     date;
+	int           warn;
+	state_t       state;
 
-	for (event_t *event : this->events)
+	switch (line.empty() ? '\0' : line[0])
 	{
-		stream << B_ON << event->description << B_OFF
-		       << " happens " << this->recurrenceToString(event->recurrence)
-		       << ", next date is " << this->dateToString(event->date)
-		       << " (" << this->dateOffsetToString(event->date) << ")." << endl;
+		case JOURNAL_ADDED:
+			if (find(added.begin(), added.end(), text) == added.end())
+			{
+				added.push_back(text);
+			}
+			break;
+
+		case JOURNAL_STATE:
+			stream >> date >> warn >> state.currentWarnCount;
+			getline(stream >> ws, text);
+
+			if (stream.fail())
+			{
+				LOG(Log::LEVEL_ERROR, ERROR << "Ignoring malformed calendar journal record.");
+				break;
+			}
+
+			state.date              = chrono::system_clock::from_time_t((time_t)date);
+			state.currentWarn       = chrono::seconds(warn);
+			this->restored[text]    = state;
+			break;
+
+		case JOURNAL_DONE:
+			this->done.insert(text);
+			this->restored.erase(text);
+			added.erase(remove(added.begin(), added.end(), text), added.end());
+			break;
+
+		case JOURNAL_REMOVED:
+			this->restored.erase(text);
+			added.erase(remove(added.begin(), added.end(), text), added.end());
+			break;
+
+		default:
+			LOG(Log::LEVEL_ERROR, ERROR << "Ignoring malformed calendar journal record.");
 	}
+}
 
-	return stream.str();
+void Calendar::record(char type, const string &text)
+{
+	if (!this->journal.is_open() || text.empty())
+	{
+		return;
+	}
+
+	// flush every record, a crash should lose as little as possible
+	this->journal << type << " " << text << endl;
+
+	if (++this->journalRecords >= JOURNAL_COMPACT_RECORDS)
+	{
+		this->compact();
+	}
 }
 
-string Calendar::pumpEvents()
+string Calendar::stateToString(const string &source, const state_t &state)
 {
 	ostringstream stream;
-	bool          done, past;
-	event_t       *event;
-	timepoint_t   now = chrono::system_clock::now();
 
-	do
+	stream << (long long)chrono::system_clock::to_time_t(state.date) << " "
+	       << state.currentWarn.count() << " " << state.currentWarnCount << " " << source;
+
+	return stream.str();
+}
+
+void Calendar::recordState(const event_t *event)
+{
+	this->record(JOURNAL_STATE, Calendar::stateToString(event->source,
+	             {event->date, event->currentWarn, event->currentWarnCount}));
+}
+
+void Calendar::compact()
+{
+	string      temporary = this->statePath + ".tmp";
+	ofstream    snapshot(temporary, ios::trunc);
+	timepoint_t now       = this->clock->now();
+
+	for (const string &source : this->done)
 	{
-		done = true;
-		past = false;
+		snapshot << JOURNAL_DONE << " " << source << endl;
+	}
 
-		for (event_t *cursor : this->events)
+	for (const event_t *event : this->events)
+	{
+		if (event->source.empty())
 		{
-			event = cursor;
+			continue;
+		}
 
-			if (event->date <= now)
+		if (event->runtime)
+		{
+			snapshot << JOURNAL_ADDED << " " << event->source << endl;
+		}
+
+		snapshot << JOURNAL_STATE << " " << Calendar::stateToString(event->source,
+		            {event->date, event->currentWarn, event->currentWarnCount}) << endl;
+	}
+
+	// keep the state of configured events that weren't added yet, until it would be ignored anyway
+	for (const auto &state : this->restored)
+	{
+		if (state.second.date > now)
+		{
+			snapshot << JOURNAL_STATE << " " << Calendar::stateToString(state.first, state.second) << endl;
+		}
+	}
+
+	snapshot.close();
+
+	if (snapshot.fail() || rename(temporary.c_str(), this->statePath.c_str()) < 0)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to write calendar snapshot " << this->statePath << ".");
+		return;
+	}
+
+	// everything the journal held is in the snapshot now
+	this->journal.close();
+	this->journal.open(this->journalPath, ios::trunc);
+	this->journalRecords = 0;
+
+	LOG(Log::LEVEL_DEBUG, NOTICE << "Compacted calendar journal into " << this->statePath << ".");
+}
+
+void Calendar::setEditors(vector<string> masks)
+{
+	lock_guard<mutex> guard(this->lock);
+
+	this->editors = masks;
+}
+
+bool Calendar::mayEdit(const char *origin)
+{
+	lock_guard<mutex> guard(this->lock);
+
+	for (const string &mask : this->editors)
+	{
+		if (fnmatch(mask.c_str(), origin, FNM_CASEFOLD) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Calendar::removeEvent(string input)
+{
+	bool removed = false;
+
+	{
+		lock_guard<mutex> guard(this->lock);
+
+		for (auto it = this->events.begin(); it != this->events.end(); )
+		{
+			if (!input.empty() && (*it)->source == input)
 			{
-				done = false;
-				past = true;
-				break;
+				delete *it;
+				it = this->events.erase(it);
+				removed = true;
 			}
-			else if (event->currentWarnCount > 0 && event->date - event->currentWarn <= now)
+			else
 			{
-				done = false;
-				past = false;
-				break;
+				it++;
 			}
 		}
 
-		if (done)
+		if (!removed)
 		{
-			break;
+			return false;
 		}
 
+		// removals are rare, restoring the heap as a whole is good enough
+		make_heap(this->events.begin(), this->events.end(), Calendar::dueLater);
+
+		// forget its state, so that the same definition added again starts over
+		this->restored.erase(input);
+		this->record(JOURNAL_REMOVED, input);
+	}
+
+	// the removed event may have been the next one due
+	this->reschedule();
+
+	return true;
+}
+
+int Calendar::numEvents()
+{
+	lock_guard<mutex> guard(this->lock);
+
+	return this->events.size();
+}
+
+string Calendar::listEvents()
+{
+	lock_guard<mutex>  guard(this->lock);
+	ostringstream      stream;
+	vector<event_t *>  sorted = this->events;
+
+	sort(sorted.begin(), sorted.end(), [](const event_t *a, const event_t *b) { return a->date < b->date; });
+
+	for (event_t *event : sorted)
+	{
+		stream << B_ON << event->description << B_OFF
+		       << " happens " << (event->rule ? event->rule->describe() : this->recurrenceToString(event->recurrence))
+		       << ", next date is " << this->dateToString(event->date)
+		       << " (" << this->dateOffsetToString(event->date) << ")." << endl;
+	}
+
+	return stream.str();
+}
+
+string Calendar::pumpEvents()
+{
+	lock_guard<mutex> guard(this->lock);
+	ostringstream     stream;
+	event_t           *event;
+	timepoint_t       now = this->clock->now();
+
+	// the earliest event is on top, handle it until nothing is due anymore
+	while (!this->events.empty() && Calendar::dueAt(this->events.front()) <= now)
+	{
+		pop_heap(this->events.begin(), this->events.end(), Calendar::dueLater);
+		event = this->events.back();
+
 		stream << B_ON << event->description << B_OFF;
 
-		if (past)
+		if (event->date <= now)
 		{
 			if (chrono::duration_cast<chrono::seconds>(now - event->date).count() >= 60)
 			{
@@ -396,16 +793,29 @@ string Calendar::pumpEvents()
 
 			stream << endl;
 
-			if (event->recurrence != ONCE)
+			// rules produce their own dates and may run out of them
+			if (event->recurrence == RULE ? event->rule->nextAfter(event->date, event->date) : event->recurrence != ONCE)
 			{
-				event->date             = this->nextDate(event->date, event->recurrence);
+				if (event->recurrence != RULE)
+				{
+					event->date = this->nextDate(event->date, event->recurrence);
+				}
+
 				event->currentWarn      = event->warn;
 				event->currentWarnCount = event->warnCount;
 			}
 			else
 			{
-				this->events.erase(event);
-				//delete event;
+				this->events.pop_back();
+
+				if (!event->source.empty())
+				{
+					this->done.insert(event->source);
+					this->record(JOURNAL_DONE, event->source);
+				}
+
+				delete event;
+				continue;
 			}
 		}
 		else
@@ -415,8 +825,24 @@ string Calendar::pumpEvents()
 			event->currentWarn /= 2;
 			event->currentWarnCount--;
 		}
+
+		// put the event back at its new position
+		push_heap(this->events.begin(), this->events.end(), Calendar::dueLater);
+
+		this->recordState(event);
 	}
-	while (true);
 
 	return stream.str();
 }
+
+Calendar::timepoint_t Calendar::nextDue()
+{
+	lock_guard<mutex> guard(this->lock);
+
+	if (this->events.empty())
+	{
+		return timepoint_t::max();
+	}
+
+	return Calendar::dueAt(this->events.front());
+}
@@ -24,10 +24,41 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <iostream>
 #include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <vector>
 
 #include "common.h"
-
+#include "clock.h"
+#include "ircmessage.h"
+#include "scheduler.h"
+
+class RRule;
+
+// Journal records, one per line: an event added at runtime, the state of an event after it was
+// announced, an event that is over and an event that was removed, which may be added again
+#define JOURNAL_ADDED           'A'
+#define JOURNAL_STATE           'S'
+#define JOURNAL_DONE            'D'
+#define JOURNAL_REMOVED         'R'
+
+// Number of journal records after which the journal is compacted into the snapshot
+#define JOURNAL_COMPACT_RECORDS 256
+
+/**
+ * @brief Keeps the events of all networks and announces them when they are due.
+ *
+ * There is one instance per process. It wakes up on the scheduler when the next warning or start
+ * is due, renders the announcement once and hands it to every subscriber.
+ *
+ * Announcements and events added at runtime can be recorded in a journal, so that after a restart
+ * warnings aren't repeated or skipped and finished events don't come back.
+ */
 class Calendar
 {
 public:
@@ -41,25 +72,82 @@ public:
 		WEEKLY,
 		FIRSTOF,
 		MONTHLY,
-		YEARLY
+		YEARLY,
+		RULE    // follows an iCalendar recurrence rule
 	} recurrence_t;
 
 	typedef std::chrono::time_point<std::chrono::system_clock> timepoint_t;
 	typedef std::chrono::duration<int>                         duration_t;
 
-	Calendar(bool useColor);
-
-	bool addEvent(std::string input);
-
+	typedef std::function<void(const IRCMessage &message)> subscriber_t;
+
+	/**
+	 * @param scheduler Scheduler that runs the announcements, NULL if pumpEvents is called by hand
+	 * @param useColor  Whether to use BB style codes in announcements
+	 * @param clock     Clock that decides when events are due
+	 */
+	Calendar(Scheduler *scheduler, bool useColor, Clock *clock = Clock::system());
+
+	/**
+	 * @brief Registers a receiver for announcements, it is called on the scheduler thread.
+	 */
+	void subscribe(subscriber_t subscriber);
+
+	/**
+	 * @param input   Definition of the form "<start> <warn seconds> <warn count> <period> <description>"
+	 * @param runtime Whether the event was added at runtime rather than by configuration, such events
+	 *                are kept in the journal
+	 */
+	bool addEvent(std::string input, bool runtime = false);
+
+	/**
+	 * @param rule Recurrence rule for events that recur by RULE, the first occurrence after now is used
+	 */
 	bool addEvent(timepoint_t date, duration_t warn, unsigned int warnCount, recurrence_t recurrence,
-	              std::string description);
+	              std::string description, std::string source = "", bool runtime = false,
+	              std::shared_ptr<RRule> rule = nullptr);
+
+	/**
+	 * @brief Restores the state kept in a snapshot and its journal and records further changes. Call
+	 *        it before adding configured events so that they continue where they left off.
+	 * @param path Path to the snapshot, the journal is kept next to it
+	 * @return Whether the journal could be opened.
+	 */
+	bool load(std::string path);
+
+	/**
+	 * @param masks Hostmasks of users that may add events, with wildcards
+	 */
+	void setEditors(std::vector<std::string> masks);
+
+	/**
+	 * @param origin Full origin of a user, as in nick!user@host
+	 */
+	bool mayEdit(const char *origin);
+
+	/**
+	 * @brief Removes the events that were added from a textual definition.
+	 * @param input The definition that was passed to addEvent
+	 * @return Whether an event was removed.
+	 */
+	bool removeEvent(std::string input);
 
 	int  numEvents();
 
 	std::string listEvents();
 
+	/**
+	 * @brief Advances the events that are due and returns their announcements.
+	 */
 	std::string pumpEvents();
 
+	/**
+	 * @brief Returns the next instant at which pumpEvents has something to announce, in constant
+	 *        time.
+	 * @return timepoint_t::max() if there are no events.
+	 */
+	timepoint_t nextDue();
+
 private:
 
 	typedef struct date_s
@@ -71,16 +159,67 @@ private:
 		unsigned int warnCount;
 		unsigned int currentWarnCount;
 		recurrence_t recurrence;
+		std::string  source;
+		bool         runtime;
+		std::shared_ptr<RRule> rule;
 	} event_t;
 
-	std::set<event_t *> events;
-	bool                useColor;
+	typedef struct state_s
+	{
+		timepoint_t  date;
+		duration_t   currentWarn;
+		unsigned int currentWarnCount;
+	} state_t;
+
+	// a min-heap ordered by the instant at which an event needs attention next
+	std::vector<event_t *>    events;
+	bool                      useColor;
+	Clock                     *clock;
+	std::mutex                lock;
+
+	// announcements
+	Scheduler                 *scheduler;
+	Scheduler::handle_t       pumpTimer;
+	std::vector<subscriber_t> subscribers;
+	std::mutex                subscriberLock;
+
+	void pump();
+	void reschedule();
+
+	// persistence, guarded by lock
+	std::string                    statePath;
+	std::string                    journalPath;
+	std::ofstream                  journal;
+	unsigned int                   journalRecords;
+	std::map<std::string, state_t> restored;
+	std::set<std::string>          done;
+	std::vector<std::string>       editors;
+
+	void replay(const std::string &line, std::vector<std::string> &added);
+	void record(char type, const std::string &text);
+	void recordState(const event_t *event);
+	static std::string stateToString(const std::string &source, const state_t &state);
+	void compact();
+
+	static timepoint_t  dueAt(const event_t *event);
+	static bool         dueLater(const event_t *a, const event_t *b);
 
 	static std::string  recurrenceToString(recurrence_t recurrence);
 	static recurrence_t stringToRecurrence(const std::string str);
 	static std::string  dateToString(const timepoint_t date);
 	std::string         dateOffsetToString(const timepoint_t date);
 	static timepoint_t  nextDate(const timepoint_t date, recurrence_t recurrence);
+	static int64_t      daysOf(const timepoint_t date);
+	static timepoint_t  moveToDay(const timepoint_t date, int64_t days);
+	static timepoint_t  addMonths(const timepoint_t date, int months);
+	static timepoint_t  firstWeekdayOf(const timepoint_t date, int months);
+
+	/**
+	 * @brief Skips ahead in constant time to a date of the recurrence that lies at most a few
+	 *        steps of nextDate before a given instant.
+	 * @return The date itself if it isn't before the instant or the recurrence can't skip.
+	 */
+	static timepoint_t  lastDateBefore(const timepoint_t date, recurrence_t recurrence, const timepoint_t now);
 };
 
 #endif // CALENDAR_H
@@ -0,0 +1,135 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#ifndef CIVILDATE_H
+#define CIVILDATE_H
+
+#include <cstdint>
+
+#include "common.h"
+
+/**
+ * @brief Conversions between days since 1970-01-01 and dates of the proleptic Gregorian calendar.
+ *
+ * Unlike gmtime this keeps no shared state, so it can be used from any thread, and everything can
+ * be evaluated at compile time. Days before the epoch are negative.
+ */
+class CivilDate
+{
+public:
+
+	typedef struct civil_s
+	{
+		int64_t      year;
+		unsigned int month; // 1 to 12
+		unsigned int day;   // 1 to 31
+	} civil_t;
+
+	static constexpr bool isLeap(int64_t year)
+	{
+		return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+	}
+
+	static constexpr unsigned int lastDayOfMonth(int64_t year, unsigned int month)
+	{
+		return month == 2 ? (isLeap(year) ? 29 : 28) :
+		       (month == 4 || month == 6 || month == 9 || month == 11) ? 30 : 31;
+	}
+
+	/**
+	 * @brief Days that are past the end of the month spill into the following months.
+	 */
+	static constexpr int64_t daysFromCivil(int64_t year, unsigned int month, unsigned int day)
+	{
+		// count years from March on, so that leap days end a year
+		year -= (month <= 2);
+
+		const int64_t      era = (year >= 0 ? year : year - 399) / 400;
+		const unsigned int yoe = (unsigned int)(year - era * 400);
+		const unsigned int doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+		const unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+		return era * 146097 + (int64_t)doe - 719468;
+	}
+
+	static constexpr civil_t civilFromDays(int64_t days)
+	{
+		days += 719468;
+
+		const int64_t      era   = (days >= 0 ? days : days - 146096) / 146097;
+		const unsigned int doe   = (unsigned int)(days - era * 146097);
+		const unsigned int yoe   = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		const unsigned int doy   = doe - (365 * yoe + yoe / 4 - yoe / 100);
+		const unsigned int mp    = (5 * doy + 2) / 153;
+		const unsigned int month = mp < 10 ? mp + 3 : mp - 9;
+
+		return {(int64_t)yoe + era * 400 + (month <= 2), month, doy - (153 * mp + 2) / 5 + 1};
+	}
+
+	/**
+	 * @return 0 for Sunday up to 6 for Saturday.
+	 */
+	static constexpr unsigned int weekdayFromDays(int64_t days)
+	{
+		// 1970-01-01 was a Thursday
+		return (unsigned int)(days >= -4 ? (days + 4) % 7 : (days + 5) % 7 + 6);
+	}
+
+	/**
+	 * @brief Moves a date by whole months, keeping the day of month. Days past the end of the
+	 *        target month spill into the next one.
+	 */
+	static constexpr int64_t addMonths(int64_t days, int64_t months)
+	{
+		const civil_t civil = civilFromDays(days);
+		const int64_t index = civil.year * 12 + (civil.month - 1) + months;
+		const int64_t year  = (index >= 0 ? index : index - 11) / 12;
+
+		return daysFromCivil(year, (unsigned int)(index - year * 12) + 1, 1) + civil.day - 1;
+	}
+
+	/**
+	 * @return The first day with a given weekday in the month of a date, moved by whole months.
+	 */
+	static constexpr int64_t firstWeekdayOf(int64_t days, int64_t months, unsigned int weekday)
+	{
+		const int64_t first = addMonths(days - civilFromDays(days).day + 1, months);
+
+		return first + (weekday + 7 - weekdayFromDays(first)) % 7;
+	}
+
+	/**
+	 * @return Number of month boundaries between two dates, negative if the second is earlier.
+	 */
+	static constexpr int64_t monthsBetween(int64_t from, int64_t to)
+	{
+		const civil_t a = civilFromDays(from), b = civilFromDays(to);
+
+		return (b.year - a.year) * 12 + (int64_t)b.month - (int64_t)a.month;
+	}
+};
+
+static_assert(CivilDate::daysFromCivil(1970, 1, 1) == 0, "The epoch is day zero.");
+static_assert(CivilDate::daysFromCivil(2000, 3, 1) == 11017, "Leap days are counted.");
+static_assert(CivilDate::weekdayFromDays(0) == 4, "The epoch was a Thursday.");
+
+#endif // CIVILDATE_H
@@ -0,0 +1,68 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#include "clock.h"
+
+using namespace std;
+
+time_t Clock::time()
+{
+	return chrono::system_clock::to_time_t(this->now());
+}
+
+Clock *Clock::system()
+{
+	static SystemClock clock;
+
+	return &clock;
+}
+
+Clock::timepoint_t SystemClock::now()
+{
+	return chrono::system_clock::now();
+}
+
+VirtualClock::VirtualClock(timepoint_t start)
+{
+	this->current = start;
+}
+
+Clock::timepoint_t VirtualClock::now()
+{
+	lock_guard<mutex> guard(this->lock);
+
+	return this->current;
+}
+
+void VirtualClock::set(timepoint_t time)
+{
+	lock_guard<mutex> guard(this->lock);
+
+	this->current = time;
+}
+
+void VirtualClock::advance(chrono::seconds duration)
+{
+	lock_guard<mutex> guard(this->lock);
+
+	this->current += duration;
+}
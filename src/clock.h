@@ -0,0 +1,90 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <chrono>
+#include <ctime>
+#include <mutex>
+
+#include "common.h"
+
+/**
+ * @brief Source of the wall clock time for modules that schedule by it.
+ *
+ * Modules use the system clock unless they are given another one, so that a simulation can move
+ * time forward as fast as it likes.
+ */
+class Clock
+{
+public:
+
+	typedef std::chrono::time_point<std::chrono::system_clock> timepoint_t;
+
+	virtual ~Clock() {}
+
+	virtual timepoint_t now() = 0;
+
+	/**
+	 * @return The current time in seconds since the epoch, like time(NULL).
+	 */
+	time_t time();
+
+	/**
+	 * @return The clock shared by everything that runs in real time.
+	 */
+	static Clock *system();
+};
+
+class SystemClock : public Clock
+{
+public:
+
+	timepoint_t now();
+};
+
+/**
+ * @brief A clock that only moves when told to.
+ */
+class VirtualClock : public Clock
+{
+public:
+
+	/**
+	 * @param start Initial time
+	 */
+	VirtualClock(timepoint_t start);
+
+	timepoint_t now();
+
+	void set(timepoint_t time);
+
+	void advance(std::chrono::seconds duration);
+
+private:
+
+	timepoint_t current;
+	std::mutex  lock;
+};
+
+#endif // CLOCK_H
@@ -19,9 +19,12 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 ====================================================================
 */
 
+#include <sstream>
+
 #include "libconfig.h++"
 
 #include "config.h"
+#include "ircclient.h"
 
 using namespace std;
 using namespace libconfig;
@@ -31,15 +34,183 @@ MantisConfig::MantisConfig(string path)
 	this->parser = new Config();
 	this->path   = path;
 
-	this->reparse();
+	try
+	{
+		this->parser->readFile(path.c_str());
+
+		const Setting &root = this->parser->getRoot();
+
+		// irc servers
+		{
+			const Setting &servers = root["irc"]["servers"];
+
+			for (int serverNum = 0; serverNum < servers.getLength(); serverNum++)
+			{
+				const Setting &cfg      = servers[serverNum];
+				const Setting &channels = cfg["channels"];
+
+				server_t server;
+				int      port = cfg["port"];
+
+				server.host     = (const char *)cfg["host"];
+				server.port     = port;
+				server.password = (const char *)cfg["password"];
+				server.nick     = (const char *)cfg["nick"];
+
+				// channels can be spread over several connections
+				if (cfg.exists("connections"))
+				{
+					int connections = cfg["connections"];
+					server.connections = MAX(connections, 1);
+				}
+				else
+				{
+					server.connections = 1;
+				}
+
+				for (int chanNum = 0; chanNum < channels.getLength(); chanNum++)
+				{
+					server.channels.push_back(MantisConfig::parseChannel(channels[chanNum]));
+				}
+
+				this->servers.push_back(server);
+			}
+		}
+
+		// unvanquished query module
+		{
+			const Setting &cfg = root["unvquery"];
+
+			int port     = cfg["port"];
+			int protocol = cfg["protocol"];
+
+			this->unvQuery.master   = (const char *)cfg["master"];
+			this->unvQuery.port     = port;
+			this->unvQuery.protocol = protocol;
+		}
+
+		// calendar module
+		{
+			const Setting &events = root["calendar"]["events"];
+
+			for (int eventNum = 0; eventNum < events.getLength(); eventNum++)
+			{
+				const Setting &event = events[eventNum];
+
+				int    start       = event["start"];
+				int    warnTime    = event["warnTime"];
+				int    warnCount   = event["warnCount"];
+				string period      = event["period"];
+				string description = event["description"];
+
+				ostringstream stream;
+
+				stream << start << " " << warnTime << " " << warnCount << " " << period << " " << description;
+
+				this->events.push_back(stream.str());
+			}
+
+			if (root["calendar"].exists("imports"))
+			{
+				const Setting &imports = root["calendar"]["imports"];
+
+				for (int importNum = 0; importNum < imports.getLength(); importNum++)
+				{
+					const Setting &cfg = imports[importNum];
+
+					import_t import;
+					int      warnTime  = cfg["warnTime"];
+					int      warnCount = cfg["warnCount"];
+
+					import.file      = (const char *)cfg["file"];
+					import.warnTime  = warnTime;
+					import.warnCount = MAX(warnCount, 0);
+
+					this->imports.push_back(import);
+				}
+			}
+		}
+
+		// GitHub query module
+		{
+			const Setting &cfg = root["github"];
+
+			this->gitHub.owner      = (const char *)cfg["owner"];
+			this->gitHub.repository = (const char *)cfg["repository"];
+
+			if (cfg.exists("token"))
+			{
+				this->gitHub.token = (const char *)cfg["token"];
+			}
+		}
+	}
+	catch (...)
+	{
+		delete this->parser;
+		throw;
+	}
+}
+
+MantisConfig::~MantisConfig()
+{
+	delete this->parser;
 }
 
-void MantisConfig::reparse()
+MantisConfig::channel_t MantisConfig::parseChannel(const Setting &cfg)
 {
-	this->parser->readFile(path.c_str());
+	channel_t channel;
+
+	channel.name     = (const char *)cfg["name"];
+	channel.password = (const char *)cfg["password"];
+
+	if (cfg.exists("noBroadcasts") && (bool)cfg["noBroadcasts"])
+	{
+		channel.broadcastFlags = BROADCAST_NONE;
+	}
+	else
+	{
+		channel.broadcastFlags = BROADCAST_ALL;
+
+		if (cfg.exists("noPlayerPeekBroadcasts") && (bool)cfg["noPlayerPeekBroadcasts"])
+		{
+			channel.broadcastFlags &= ~BROADCAST_PLAYERPEEK;
+		}
+
+		if (cfg.exists("noEventBroadcasts") && (bool)cfg["noEventBroadcasts"])
+		{
+			channel.broadcastFlags &= ~BROADCAST_EVENT;
+		}
+	}
+
+	return channel;
 }
 
 libconfig::Setting &MantisConfig::getRoot() const
 {
 	return this->parser->getRoot();
 }
+
+const vector<MantisConfig::server_t> &MantisConfig::getServers() const
+{
+	return this->servers;
+}
+
+const MantisConfig::unvQuery_t &MantisConfig::getUnvQuery() const
+{
+	return this->unvQuery;
+}
+
+const MantisConfig::gitHub_t &MantisConfig::getGitHub() const
+{
+	return this->gitHub;
+}
+
+const vector<string> &MantisConfig::getEvents() const
+{
+	return this->events;
+}
+
+const vector<MantisConfig::import_t> &MantisConfig::getImports() const
+{
+	return this->imports;
+}
@@ -23,31 +23,85 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #define CONFIGPARSER_H
 
 #include <iostream>
+#include <vector>
 
 #include "libconfig.h++"
 
 /**
  * @brief A simple wrapper to libconfig.
+ *
+ * The settings that can be reloaded at runtime are parsed into plain structures when the file is
+ * read and never change afterwards, a reload creates a new instance to compare with.
  */
 class MantisConfig
 {
 public:
 
+	typedef struct channel_s
+	{
+		std::string name;
+		std::string password;
+		int         broadcastFlags;
+	} channel_t;
+
+	typedef struct server_s
+	{
+		std::string            host;
+		unsigned short         port;
+		std::string            password;
+		std::string            nick;
+		unsigned int           connections;
+		std::vector<channel_t> channels;
+	} server_t;
+
+	typedef struct unvQuery_s
+	{
+		std::string    master;
+		unsigned short port;
+		unsigned short protocol;
+	} unvQuery_t;
+
+	typedef struct gitHub_s
+	{
+		std::string owner;
+		std::string repository;
+		std::string token;
+	} gitHub_t;
+
+	typedef struct import_s
+	{
+		std::string  file;
+		int          warnTime;
+		unsigned int warnCount;
+	} import_t;
+
 	/**
 	 * @param path Path to config file.
+	 * @throws libconfig::ConfigException if the file can't be read or lacks a setting.
 	 */
 	MantisConfig(std::string path);
 
-	/**
-	 * @brief Reread the config file.
-	 */
-	void reparse();
+	~MantisConfig();
 
 	/**
 	 * @brief Get the root configuration node.
 	 */
 	libconfig::Setting &getRoot() const;
 
+	const std::vector<server_t>    &getServers() const;
+	const unvQuery_t               &getUnvQuery() const;
+	const gitHub_t                 &getGitHub() const;
+
+	/**
+	 * @return Calendar events in the format understood by Calendar::addEvent.
+	 */
+	const std::vector<std::string> &getEvents() const;
+
+	/**
+	 * @return iCalendar files to read calendar events from.
+	 */
+	const std::vector<import_t>    &getImports() const;
+
 private:
 
 	/**
@@ -59,6 +113,14 @@ private:
 	 * @brief Path to config file.
 	 */
 	std::string path;
+
+	std::vector<server_t>    servers;
+	unvQuery_t               unvQuery;
+	gitHub_t                 gitHub;
+	std::vector<std::string> events;
+	std::vector<import_t>    imports;
+
+	static channel_t parseChannel(const libconfig::Setting &channel);
 };
 
 #endif // CONFIGPARSER_H
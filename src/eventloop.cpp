@@ -0,0 +1,188 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include <chrono>
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include "eventloop.h"
+#include "ircclient.h"
+#include "log.h"
+
+using namespace std;
+
+EventLoop::EventLoop()
+{
+	if (pipe(this->wakePipe) < 0)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to create event loop pipe.");
+		throw -1;
+	}
+
+	fcntl(this->wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(this->wakePipe[1], F_SETFL, O_NONBLOCK);
+}
+
+void EventLoop::addClient(IRCClient *client)
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->clients.insert(client);
+	}
+
+	this->wake();
+}
+
+void EventLoop::watch(int fd, handler_t handler)
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->descriptors[fd] = handler;
+	}
+
+	this->wake();
+}
+
+void EventLoop::unwatch(int fd)
+{
+	lock_guard<mutex> guard(this->lock);
+	this->descriptors.erase(fd);
+}
+
+bool EventLoop::watching(int fd)
+{
+	lock_guard<mutex> guard(this->lock);
+
+	// an earlier handler of the same round may have stopped watching
+	return this->descriptors.count(fd) > 0;
+}
+
+void EventLoop::wake()
+{
+	char byte = 0;
+
+	// a full pipe means a wakeup is pending anyway
+	if (write(this->wakePipe[1], &byte, 1) < 0 && errno != EAGAIN)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to wake event loop.");
+	}
+}
+
+void EventLoop::run()
+{
+	vector<IRCClient *> active;
+	map<int, handler_t> watched;
+	char                drain[64];
+
+	while (true)
+	{
+		fd_set                 in, out;
+		int                    maxfd    = this->wakePipe[0];
+		IRCClient::timepoint_t deadline = IRCClient::timepoint_t::max();
+		timeval                timeout, *timeoutPtr = NULL;
+
+		// take a snapshot of the clients, dropping those that have quit for good
+		{
+			lock_guard<mutex> guard(this->lock);
+
+			for (auto it = this->clients.begin(); it != this->clients.end(); )
+			{
+				if ((*it)->finished())
+				{
+					it = this->clients.erase(it);
+				}
+				else
+				{
+					it++;
+				}
+			}
+
+			active.assign(this->clients.begin(), this->clients.end());
+			watched = this->descriptors;
+		}
+
+		if (active.empty())
+		{
+			break;
+		}
+
+		FD_ZERO(&in);
+		FD_ZERO(&out);
+		FD_SET(this->wakePipe[0], &in);
+
+		for (auto &descriptor : watched)
+		{
+			FD_SET(descriptor.first, &in);
+			maxfd = MAX(maxfd, descriptor.first);
+		}
+
+		for (IRCClient *client : active)
+		{
+			client->addDescriptors(&in, &out, &maxfd, &deadline);
+		}
+
+		// sleep until there is network activity, a wakeup or a client wants to reconnect
+		if (deadline != IRCClient::timepoint_t::max())
+		{
+			auto wait = chrono::duration_cast<chrono::microseconds>(deadline - chrono::system_clock::now());
+
+			if (wait.count() < 0)
+			{
+				wait = chrono::microseconds(0);
+			}
+
+			timeout.tv_sec  = wait.count() / 1000000;
+			timeout.tv_usec = wait.count() % 1000000;
+			timeoutPtr      = &timeout;
+		}
+
+		if (select(maxfd + 1, &in, &out, NULL, timeoutPtr) < 0)
+		{
+			if (errno != EINTR)
+			{
+				LOG(Log::LEVEL_ERROR, ERROR << "Event loop select failed.");
+			}
+
+			continue;
+		}
+
+		if (FD_ISSET(this->wakePipe[0], &in))
+		{
+			while (read(this->wakePipe[0], drain, sizeof(drain)) > 0);
+		}
+
+		for (auto &descriptor : watched)
+		{
+			if (FD_ISSET(descriptor.first, &in) && this->watching(descriptor.first))
+			{
+				descriptor.second();
+			}
+		}
+
+		for (IRCClient *client : active)
+		{
+			client->processDescriptors(&in, &out);
+		}
+	}
+}
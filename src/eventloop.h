@@ -0,0 +1,86 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <functional>
+#include <mutex>
+#include <set>
+#include <map>
+
+#include "common.h"
+
+class IRCClient;
+
+/**
+ * @brief A select based reactor that drives the sessions of all IRC clients from a single thread.
+ */
+class EventLoop
+{
+public:
+
+	typedef std::function<void()> handler_t;
+
+	EventLoop();
+
+	/**
+	 * @brief Adds a client, its session will be driven by the loop from now on.
+	 * @param client An IRCClient instance
+	 */
+	void addClient(IRCClient *client);
+
+	/**
+	 * @brief Calls a handler on the loop thread whenever a descriptor becomes readable.
+	 * @param fd      File descriptor, should be non-blocking
+	 * @param handler Handler, may call watch and unwatch itself
+	 */
+	void watch(int fd, handler_t handler);
+
+	/**
+	 * @brief Stops watching a descriptor.
+	 */
+	void unwatch(int fd);
+
+	/**
+	 * @brief Interrupts a pending select so that the loop picks up changes made by other threads,
+	 *        such as new outgoing messages.
+	 */
+	void wake();
+
+	/**
+	 * @brief Runs the loop in the calling thread until every client has quit.
+	 */
+	void run();
+
+private:
+
+	std::set<IRCClient *>    clients;
+	std::map<int, handler_t> descriptors;
+	std::mutex               lock;
+
+	// self-pipe used to interrupt select
+	int                      wakePipe[2];
+
+	bool watching(int fd);
+};
+
+#endif // EVENTLOOP_H
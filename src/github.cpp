@@ -22,86 +22,461 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #include <sstream>
 #include <regex>
 #include <algorithm>
-#include <curl/curl.h>
+#include <climits>
+#include <cstdlib>
+#include <cctype>
+#include <memory>
 
 #include "github.h"
+#include "metrics.h"
+#include "log.h"
 
 using namespace std;
 
-GitHubQuery::GitHubQuery(string owner, string repo, bool useColor)
-	: owner(owner), repo(repo), useColor(useColor)
-{}
+static Histogram lookupDuration("mantis_github_lookup_seconds", "",
+                                "Duration of GitHub API lookups.");
+static Counter   lookupFailures("mantis_github_lookup_failures_total", "",
+                                "GitHub API lookups that failed on the transport level.");
+static Counter   cacheHits("mantis_github_cache_lookups_total", "result=\"hit\"",
+                           "Lookups of issues and commits by how the cache answered them.");
+static Counter   cacheMisses("mantis_github_cache_lookups_total", "result=\"miss\"",
+                             "Lookups of issues and commits by how the cache answered them.");
+static Counter   cacheCoalesced("mantis_github_cache_lookups_total", "result=\"coalesced\"",
+                                "Lookups of issues and commits by how the cache answered them.");
+static Counter   lookupsDegraded("mantis_github_lookups_degraded_total", "",
+                                 "Lookups answered from stale cache or left unverified due to the rate limit.");
+static Gauge     rateLimitRemaining("mantis_github_ratelimit_remaining", "",
+                                    "Requests left in the current GitHub rate limit window.");
+static Counter   cacheRevalidated("mantis_github_cache_revalidations_total", "",
+                                  "Expired lookups that GitHub confirmed as unchanged.");
 
-string GitHubQuery::linkIssue(int issue, bool verbose)
+GitHubQuery::GitHubQuery(HTTPClient *http, Scheduler *scheduler, string owner, string repo, string token, bool useColor)
+	: http(http), scheduler(scheduler), remaining(-1), outstanding(0), exhausted(false), token(token), owner(owner), repo(repo),
+	  useColor(useColor), commitFilter(GITHUB_FILTER_BITS, GITHUB_FILTER_HASHES), maxIssue(0)
+{
+	// one refresh for all clients, so the shared quota isn't spent once per network
+	if (scheduler)
+		scheduler->post(bind(&GitHubQuery::refresh, this));
+}
+
+void GitHubQuery::linkIssue(int issue, bool verbose, linkHandler_t handler)
 {
-	ostringstream stream;
 	ostringstream stringIssue;
 
 	if (issue <= 0 || issue == INT_MAX)
-		return verbose ? "Invalid issue number." : "";
+		return handler(verbose ? "Invalid issue number." : "");
 
 	stringIssue << issue;
 
-	if (!exists("issues", stringIssue.str()))
-		return verbose ? "Issue doesn't exist." : "";
+	exists("issues", stringIssue.str(), verbose, [this, issue, verbose, handler](answer_t answer)
+	{
+		ostringstream stream;
+
+		if (answer == LOOKUP_MISSING)
+			return handler(verbose ? "Issue doesn't exist." : "");
+
+		if (answer == LOOKUP_EXISTS)
+		{
+			lock_guard<mutex> guard(this->filterLock);
+			this->maxIssue = MAX(this->maxIssue, (unsigned int)issue);
+		}
+
+		stream << "Issue " << B_ON << "#" << issue << B_OFF << ": https://github.com/" << owner << "/"
+		       << repo << "/issues/" << issue;
 
-	stream << "Issue " << B_ON << "#" << issue << B_OFF << ": https://github.com/" << owner << "/"
-	       << repo << "/issues/" << issue;
+		if (answer == LOOKUP_UNKNOWN)
+			stream << " (unverified)";
 
-	return stream.str();
+		handler(stream.str());
+	});
 }
 
-string GitHubQuery::linkCommit(string hash, bool verbose)
+void GitHubQuery::linkCommit(string hash, bool verbose, linkHandler_t handler)
 {
-	ostringstream stream;
-	string        shortHash;
-	regex         commitRE("[0-9a-fA-F]{7,40}");
+	string shortHash;
+	regex  commitRE("[0-9a-fA-F]{7,40}");
 
 	if (!regex_match(hash.begin(), hash.end(), commitRE))
-		return verbose ? "Invalid commit hash." : "";
+		return handler(verbose ? "Invalid commit hash." : "");
 
 	std::transform(hash.begin(), hash.end(), hash.begin(), ::tolower);
 	shortHash = hash.substr(0, 7);
 
-	if (!exists("commits", hash))
-		return verbose ? "Commit doesn't exist." : "";
+	exists("commits", hash, verbose, [this, hash, shortHash, verbose, handler](answer_t answer)
+	{
+		ostringstream stream;
+
+		if (answer == LOOKUP_MISSING)
+			return handler(verbose ? "Commit doesn't exist." : "");
+
+		if (answer == LOOKUP_EXISTS)
+		{
+			lock_guard<mutex> guard(this->filterLock);
+			this->commitFilter.add(hash.c_str(), LINKSCAN_HASH_MIN);
+		}
+
+		stream << "Commit " << B_ON << shortHash << B_OFF << ": https://github.com/" << owner << "/"
+		       << repo << "/commit/" << shortHash;
+
+		if (answer == LOOKUP_UNKNOWN)
+			stream << " (unverified)";
+
+		handler(stream.str());
+	});
+}
+
+bool GitHubQuery::admit(bool interactive)
+{
+	chrono::system_clock::time_point now = chrono::system_clock::now();
+
+	lock_guard<mutex> guard(this->budgetLock);
+
+	if (now < this->blockedUntil)
+		return false;
+
+	// a new window starts with an unknown budget
+	if (this->remaining >= 0 && now >= this->resetAt)
+	{
+		this->remaining = -1;
+		this->exhausted = false;
+	}
+
+	// requests in flight are already spent
+	if (this->remaining >= 0)
+	{
+		int available = this->remaining - (int)this->outstanding;
+
+		if (available <= (interactive ? 0 : GITHUB_RESERVE_INTERACTIVE))
+			return false;
+	}
+
+	this->outstanding++;
+
+	return true;
+}
+
+void GitHubQuery::account(const HTTPClient::response_t &response)
+{
+	chrono::system_clock::time_point now = chrono::system_clock::now();
+
+	auto remainingHeader  = response.headers.find("x-ratelimit-remaining");
+	auto resetHeader      = response.headers.find("x-ratelimit-reset");
+	auto retryAfterHeader = response.headers.find("retry-after");
+
+	lock_guard<mutex> guard(this->budgetLock);
+
+	this->outstanding--;
+
+	if (!response.ok)
+		return;
+
+	if (remainingHeader != response.headers.end() && resetHeader != response.headers.end())
+	{
+		this->remaining = atoi(remainingHeader->second.c_str());
+		this->resetAt   = chrono::system_clock::from_time_t(strtoll(resetHeader->second.c_str(), NULL, 10));
+
+		rateLimitRemaining.set(this->remaining);
+	}
+
+	// secondary limits only say how long to wait
+	if (retryAfterHeader != response.headers.end())
+		this->blockedUntil = now + chrono::seconds(atoi(retryAfterHeader->second.c_str()));
+	else if ((response.status == 403 || response.status == 429) && this->remaining == 0)
+		this->blockedUntil = this->resetAt;
+
+	if (this->remaining == 0 && !this->exhausted)
+	{
+		auto wait = chrono::duration_cast<chrono::seconds>(this->resetAt - now).count();
+
+		LOG(Log::LEVEL_INFO, NOTICE << "GitHub rate limit exhausted, links are unverified for the next "
+		                            << MAX(wait, 0) << " seconds.");
+	}
+
+	this->exhausted = (this->remaining == 0);
+}
+
+void GitHubQuery::fetch(string resource, vector<string> headers, HTTPClient::handler_t handler)
+{
+	ostringstream stream;
+
+	Histogram::timepoint_t start = Histogram::now();
+
+	stream << "https://api.github.com/repos/" << owner << "/" << repo << "/" << resource;
+
+	headers.push_back("Accept: application/vnd.github+json");
+
+	if (!token.empty())
+		headers.push_back("Authorization: Bearer " + token);
+
+	http->get(stream.str(), headers, chrono::steady_clock::now() + chrono::milliseconds(GITHUB_TIMEOUT_MS),
+	          [this, start, handler](const HTTPClient::response_t &response)
+	{
+		if (response.ok)
+			lookupDuration.observeSince(start);
+		else
+			lookupFailures.inc();
+
+		account(response);
+		handler(response);
+	});
+}
+
+void GitHubQuery::fetch(string resource, bodyHandler_t handler)
+{
+	// background work, so it leaves the reserve to interactive lookups
+	if (!admit(false))
+		return handler(false, "");
+
+	fetch(resource, {}, [handler](const HTTPClient::response_t &response)
+	{
+		handler(response.ok && response.status == 200, response.body);
+	});
+}
+
+void GitHubQuery::exists(string category, string resource, bool interactive, existsHandler_t handler)
+{
+	vector<string> headers;
+	bool           answered = false;
+	answer_t       answer   = LOOKUP_UNKNOWN;
+
+	resource = category + "/" + resource;
+
+	{
+		lock_guard<mutex> guard(this->lookupLock);
+		auto              it = this->lookups.find(resource);
+
+		if (it == this->lookups.end())
+		{
+			lookup_t lookup;
+
+			lookup.known    = false;
+			lookup.exists   = false;
+			lookup.inFlight = false;
+
+			this->recency.push_front(resource);
+			lookup.position = this->recency.begin();
+
+			it = this->lookups.emplace(resource, lookup).first;
+		}
+		else
+		{
+			this->recency.splice(this->recency.begin(), this->recency, it->second.position);
+		}
+
+		lookup_t &lookup = it->second;
+
+		// share the request that is already under way
+		if (lookup.inFlight)
+		{
+			lookup.waiting.push_back(handler);
+			cacheCoalesced.inc();
+			return;
+		}
+
+		if (lookup.known && chrono::steady_clock::now() < lookup.expires)
+		{
+			answered = true;
+			answer   = lookup.exists ? LOOKUP_EXISTS : LOOKUP_MISSING;
+			cacheHits.inc();
+		}
+		else if (!admit(interactive))
+		{
+			// out of budget, an expired answer is still better than none
+			answered = true;
+			answer   = lookup.known ? (lookup.exists ? LOOKUP_EXISTS : LOOKUP_MISSING) : LOOKUP_UNKNOWN;
+			lookupsDegraded.inc();
+
+			if (!lookup.known)
+			{
+				this->recency.erase(lookup.position);
+				this->lookups.erase(it);
+			}
+		}
+		else
+		{
+			// an expired answer is revalidated, which is cheap if it didn't change
+			if (lookup.known && !lookup.etag.empty())
+				headers.push_back("If-None-Match: " + lookup.etag);
+
+			lookup.inFlight = true;
+			lookup.waiting.push_back(handler);
+			cacheMisses.inc();
+
+			evictLookups();
+		}
+	}
+
+	if (answered)
+		return handler(answer);
+
+	fetch(resource, headers, [this, resource](const HTTPClient::response_t &response)
+	{
+		finishLookup(resource, response);
+	});
+}
+
+void GitHubQuery::finishLookup(string resource, const HTTPClient::response_t &response)
+{
+	vector<existsHandler_t> waiting;
+	answer_t                answer;
+
+	{
+		lock_guard<mutex>     guard(this->lookupLock);
+		lookup_t              &lookup = this->lookups.at(resource);
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+		// only definite answers are cached, a failure or an exceeded rate limit keeps the
+		// previous one if there is any
+		if (response.ok && response.status == 304 && lookup.known)
+		{
+			cacheRevalidated.inc();
+		}
+		else if (response.ok && (response.status == 200 || response.status == 404))
+		{
+			auto etag = response.headers.find("etag");
+
+			lookup.known  = true;
+			lookup.exists = (response.status == 200);
+			lookup.etag   = (etag != response.headers.end() ? etag->second : "");
+		}
+
+		if (response.ok && (response.status == 304 || response.status == 200 || response.status == 404))
+			lookup.expires = now + chrono::seconds(lookup.exists ? GITHUB_CACHE_TTL_S : GITHUB_CACHE_MISSING_S);
+
+		answer          = lookup.known ? (lookup.exists ? LOOKUP_EXISTS : LOOKUP_MISSING) : LOOKUP_UNKNOWN;
+		lookup.inFlight = false;
+		waiting.swap(lookup.waiting);
+
+		if (!lookup.known)
+		{
+			this->recency.erase(lookup.position);
+			this->lookups.erase(resource);
+		}
+	}
+
+	for (existsHandler_t &handler : waiting)
+		handler(answer);
+}
+
+void GitHubQuery::evictLookups()
+{
+	// drop the least recently used answers, lookups in flight have to stay
+	for (auto it = this->recency.end(); this->lookups.size() > GITHUB_CACHE_SIZE && it != this->recency.begin(); )
+	{
+		it--;
 
-	stream << "Commit " << B_ON << shortHash << B_OFF << ": https://github.com/" << owner << "/"
-	       << repo << "/commit/" << shortHash;
+		if (this->lookups.at(*it).inFlight)
+			continue;
 
-	return stream.str();
+		this->lookups.erase(*it);
+		it = this->recency.erase(it);
+	}
 }
 
-size_t GitHubQuery::curlWriteToStream(char *input, size_t size, size_t count, void *ostringstreamPtr)
+void GitHubQuery::flushCache()
 {
-	if (ostringstreamPtr)
+	lock_guard<mutex> guard(this->lookupLock);
+
+	for (auto it = this->recency.begin(); it != this->recency.end(); )
 	{
-		ostringstream &oss    = *static_cast<ostringstream*>(ostringstreamPtr);
-		streamsize    written = size * count;
-		if (oss.write(input, written)) return written;
+		if (this->lookups.at(*it).inFlight)
+		{
+			it++;
+			continue;
+		}
+
+		this->lookups.erase(*it);
+		it = this->recency.erase(it);
 	}
+}
+
+void GitHubQuery::commitPrefix(const char *hash, char *prefix)
+{
+	for (int i = 0; i < LINKSCAN_HASH_MIN; i++)
+		prefix[i] = tolower(hash[i]);
+}
+
+void GitHubQuery::refresh()
+{
+	refreshFilters([this](bool ok)
+	{
+		if (!ok)
+			LOG(Log::LEVEL_ERROR, ERROR << "Failed to fetch recent issues and commits from GitHub.");
+
+		scheduler->schedule(chrono::seconds(GITHUB_REFRESH_PERIOD_S), bind(&GitHubQuery::refresh, this));
+	});
+}
+
+void GitHubQuery::refreshFilters(refreshHandler_t handler)
+{
+	// the newest issue or pull request carries the highest number
+	fetch("issues?state=all&per_page=1", [this, handler](bool ok, const string &response)
+	{
+		size_t       pos;
+		unsigned int newest = 0;
+
+		if (!ok)
+			return handler(false);
+
+		if ((pos = response.find("\"number\"")) != string::npos &&
+		    (pos = response.find_first_of("0123456789", pos)) != string::npos)
+			newest = strtoul(response.c_str() + pos, NULL, 10);
+
+		refreshCommits(1, newest, make_shared<BloomFilter>(GITHUB_FILTER_BITS, GITHUB_FILTER_HASHES), handler);
+	});
+}
+
+void GitHubQuery::refreshCommits(int page, unsigned int newest, shared_ptr<BloomFilter> commits,
+                                 refreshHandler_t handler)
+{
+	ostringstream resource;
+
+	resource << "commits?per_page=100&page=" << page;
 
-	return 0;
+	// remember the prefixes of recent commits, parents and trees included
+	fetch(resource.str(), [this, page, newest, commits, handler](bool ok, const string &response)
+	{
+		if (!ok)
+			return handler(false);
+
+		for (size_t pos = response.find("\"sha\""); pos != string::npos; pos = response.find("\"sha\"", pos + 1))
+		{
+			size_t hash = response.find('"', response.find(':', pos));
+
+			if (hash != string::npos && hash + LINKSCAN_HASH_MAX < response.size())
+				commits->add(response.c_str() + hash + 1, LINKSCAN_HASH_MIN);
+		}
+
+		if (page < GITHUB_COMMIT_PAGES)
+			return refreshCommits(page + 1, newest, commits, handler);
+
+		{
+			lock_guard<mutex> guard(this->filterLock);
+			this->maxIssue     = MAX(this->maxIssue, newest);
+			this->commitFilter = *commits;
+		}
+
+		handler(true);
+	});
 }
 
-bool GitHubQuery::exists(string category, string resource)
+bool GitHubQuery::mightBeIssue(unsigned int issue)
 {
-	ostringstream stream, response;
-	CURL          *curl = curl_easy_init();
+	lock_guard<mutex> guard(this->filterLock);
 
-	if (!curl) return false;
+	return issue > 0 && issue <= this->maxIssue;
+}
 
-	stream << "https://api.github.com/repos/" << owner << "/" << repo << "/" << category << "/"
-	       << resource;
+bool GitHubQuery::mightBeCommit(const char *hash, size_t length)
+{
+	char prefix[LINKSCAN_HASH_MIN];
 
-	curl_easy_setopt(curl, CURLOPT_URL, stream.str().c_str());
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &curlWriteToStream);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response);
-	curl_easy_setopt(curl, CURLOPT_USERAGENT, "mantisbot");
+	if (length < LINKSCAN_HASH_MIN)
+		return false;
 
-	if(curl_easy_perform(curl) != CURLE_OK) return false;
+	commitPrefix(hash, prefix);
 
-	curl_easy_cleanup(curl);
+	lock_guard<mutex> guard(this->filterLock);
 
-	return (response.str().find("Not Found") == string::npos);
+	return this->commitFilter.mightContain(prefix, LINKSCAN_HASH_MIN);
 }
@@ -23,28 +23,162 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #define GITHUBQUERY_H
 
 #include <iostream>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "common.h"
+#include "linkscan.h"
+#include "httpclient.h"
+#include "scheduler.h"
+
+// Prefilters for passive link detection
+#define GITHUB_FILTER_BITS      (1 << 14)
+#define GITHUB_FILTER_HASHES    4
+#define GITHUB_COMMIT_PAGES     3
+#define GITHUB_REFRESH_PERIOD_S 3600
+
+// Time after which a request to the API is given up
+#define GITHUB_TIMEOUT_MS       10000
+
+// Lookup cache: number of entries, and how long answers are trusted before they are revalidated.
+// Issues and commits rarely disappear, but a missing issue may be opened any moment.
+#define GITHUB_CACHE_SIZE       1024
+#define GITHUB_CACHE_TTL_S      3600
+#define GITHUB_CACHE_MISSING_S  300
+
+// Requests of the rate limit that are kept for interactive lookups, passive detection and the
+// prefilter refresh stop when only these are left
+#define GITHUB_RESERVE_INTERACTIVE 10
 
 class GitHubQuery
 {
 public:
 
-	GitHubQuery(std::string owner, std::string repo, bool useColor);
-
-	std::string linkIssue(int issue, bool verbose);
-	std::string linkCommit(std::string hash, bool verbose);
+	typedef std::function<void(const std::string &response)> linkHandler_t;
+	typedef std::function<void(bool ok)>                     refreshHandler_t;
+
+	/**
+	 * @param http      Client that runs the requests, it may be shared
+	 * @param scheduler Times the periodic prefilter refresh, NULL to refresh by hand
+	 * @param owner     Owner of the repository
+	 * @param repo      Name of the repository
+	 * @param token     Access token, which raises the rate limit, or an empty string
+	 * @param useColor  Whether to use BB style codes in responses
+	 */
+	GitHubQuery(HTTPClient *http, Scheduler *scheduler, std::string owner, std::string repo, std::string token, bool useColor);
+
+	/**
+	 * @brief Looks up an issue or commit without waiting for the answer. Verbose lookups are
+	 *        requested by users and may use the requests kept back from passive detection. If the
+	 *        rate limit or an outage prevents the lookup, a cached answer or an unverified link
+	 *        is given instead.
+	 * @param handler Receives the link, or why there is none if verbose and an empty string
+	 *                otherwise. It is called on the request thread of the HTTP client.
+	 */
+	void linkIssue(int issue, bool verbose, linkHandler_t handler);
+	void linkCommit(std::string hash, bool verbose, linkHandler_t handler);
+
+	/**
+	 * @brief Fetches the newest issue number and the recent commits, which are used to decide
+	 *        whether a passive lookup is worth it, without waiting for the answers.
+	 * @param handler Receives whether both could be fetched, otherwise the previous state is kept.
+	 *                It is called on the request thread of the HTTP client.
+	 */
+	void refreshFilters(refreshHandler_t handler);
+
+	/**
+	 * @return Whether the issue number isn't higher than the newest known issue.
+	 */
+	bool mightBeIssue(unsigned int issue);
+
+	/**
+	 * @return Whether the hash starts like one of the recent commits.
+	 */
+	bool mightBeCommit(const char *hash, size_t length);
+
+	/**
+	 * @brief Forgets all cached lookups, lookups in flight still complete.
+	 */
+	void flushCache();
 
 private:
 
-	static size_t curlWriteToStream(char *input, size_t size, size_t count, void *ostringstreamPtr);
-	bool exists(std::string category, std::string resource);
+	typedef enum
+	{
+		LOOKUP_MISSING,
+		LOOKUP_EXISTS,
+		LOOKUP_UNKNOWN
+	} answer_t;
+
+	typedef std::function<void(answer_t answer)> existsHandler_t;
+
+	typedef std::function<void(bool ok, const std::string &body)> bodyHandler_t;
+
+	void fetch(std::string resource, std::vector<std::string> headers, HTTPClient::handler_t handler);
+	void fetch(std::string resource, bodyHandler_t handler);
+	void exists(std::string category, std::string resource, bool interactive, existsHandler_t handler);
+
+	typedef struct lookup_s
+	{
+		bool                                 known;
+		bool                                 exists;
+		std::string                          etag;
+		std::chrono::steady_clock::time_point expires;
+
+		// callers waiting for the request in flight, if any
+		bool                                 inFlight;
+		std::vector<existsHandler_t>         waiting;
+
+		// position in the recency list
+		std::list<std::string>::iterator     position;
+	} lookup_t;
+
+	HTTPClient  *http;
+	Scheduler   *scheduler;
+
+	// refreshes the prefilters and schedules the next refresh
+	void refresh();
+	void refreshCommits(int page, unsigned int newest, std::shared_ptr<BloomFilter> commits,
+	                    refreshHandler_t handler);
+
+	// answers of lookups by resource, the recency list has the most recent one first
+	std::unordered_map<std::string, lookup_t> lookups;
+	std::list<std::string>                    recency;
+	std::mutex                                lookupLock;
+
+	void finishLookup(std::string resource, const HTTPClient::response_t &response);
+	void evictLookups();
+
+	// rate limit as last reported by the API, a remaining count of -1 means unknown
+	int                                   remaining;
+	unsigned int                          outstanding;
+	std::chrono::system_clock::time_point resetAt;
+	std::chrono::system_clock::time_point blockedUntil;
+	bool                                  exhausted;
+	std::mutex                            budgetLock;
+
+	bool admit(bool interactive);
+	void account(const HTTPClient::response_t &response);
+
+	std::string token;
 
 	std::string owner;
 	std::string repo;
 
 	bool useColor;
 
+	// prefilters, refreshed on the request thread of the HTTP client and read on the event loop
+	BloomFilter  commitFilter;
+	unsigned int maxIssue;
+	std::mutex   filterLock;
+
+	static void commitPrefix(const char *hash, char *prefix);
+
 };
 
 #endif // GITHUBQUERY_H
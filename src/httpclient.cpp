@@ -0,0 +1,312 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <future>
+
+#include "httpclient.h"
+#include "metrics.h"
+
+using namespace std;
+
+static Gauge   requestsInFlight("mantis_http_requests_in_flight", "",
+                                "HTTP requests that are queued or running.");
+static Counter connectionsOpened("mantis_http_connections_total", "",
+                                 "Connections opened for HTTP requests, reused ones aren't counted.");
+
+HTTPClient::HTTPClient(string userAgent)
+{
+	this->userAgent = userAgent;
+	this->run       = true;
+
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	this->multi = curl_multi_init();
+	this->share = curl_share_init();
+
+	if (!this->multi || !this->share)
+	{
+		throw -1;
+	}
+
+	// requests to the same host wait for a connection that they can be multiplexed over
+	curl_multi_setopt(this->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(this->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)HTTP_MAX_HOST_CONNECTIONS);
+
+	// the share is only used on the request thread, so it needs no locking
+	curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	this->worker = new thread(&HTTPClient::work, this);
+}
+
+HTTPClient::~HTTPClient()
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->run = false;
+	}
+
+	curl_multi_wakeup(this->multi);
+
+	this->worker->join();
+	delete this->worker;
+
+	// whatever didn't finish fails
+	for (request_t *request : this->queued)
+	{
+		this->finish(request);
+	}
+
+	while (!this->active.empty())
+	{
+		this->finish(*this->active.begin());
+	}
+
+	for (CURL *easy : this->idle)
+	{
+		curl_easy_cleanup(easy);
+	}
+
+	curl_multi_cleanup(this->multi);
+	curl_share_cleanup(this->share);
+}
+
+void HTTPClient::get(string url, vector<string> headers, timepoint_t deadline, handler_t handler)
+{
+	request_t *request = new request_t;
+
+	request->url             = url;
+	request->headers         = NULL;
+	request->deadline        = deadline;
+	request->handler         = handler;
+	request->response.ok     = false;
+	request->response.status = 0;
+	request->easy            = NULL;
+
+	for (const string &header : headers)
+	{
+		request->headers = curl_slist_append(request->headers, header.c_str());
+	}
+
+	requestsInFlight.add(1);
+
+	{
+		lock_guard<mutex> guard(this->lock);
+
+		if (this->run)
+		{
+			this->queued.push_back(request);
+			request = NULL;
+		}
+	}
+
+	if (request)
+	{
+		this->finish(request);
+		return;
+	}
+
+	curl_multi_wakeup(this->multi);
+}
+
+HTTPClient::response_t HTTPClient::get(string url, vector<string> headers, chrono::milliseconds timeout)
+{
+	promise<response_t> result;
+	future<response_t>  response = result.get_future();
+
+	this->get(url, headers, chrono::steady_clock::now() + timeout,
+	          [&result](const response_t &response) { result.set_value(response); });
+
+	return response.get();
+}
+
+void HTTPClient::work()
+{
+	vector<request_t *> queued;
+	CURLMsg             *message;
+	request_t           *request;
+	int                 running, left;
+	long                timeout;
+
+	for (;;)
+	{
+		{
+			lock_guard<mutex> guard(this->lock);
+
+			if (!this->run)
+			{
+				break;
+			}
+
+			queued.swap(this->queued);
+		}
+
+		for (request_t *next : queued)
+		{
+			this->start(next);
+		}
+
+		queued.clear();
+
+		curl_multi_perform(this->multi, &running);
+
+		while ((message = curl_multi_info_read(this->multi, &left)))
+		{
+			if (message->msg == CURLMSG_DONE)
+			{
+				curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+
+				request->response.ok = (message->data.result == CURLE_OK);
+
+				this->finish(request);
+			}
+		}
+
+		// sleep until a transfer needs attention or a request is queued, without pending
+		// transfers only the wakeup of get or the destructor ends the wait
+		curl_multi_timeout(this->multi, &timeout);
+		curl_multi_poll(this->multi, NULL, 0, (timeout < 0 || timeout > INT_MAX) ? INT_MAX : (int)timeout, NULL);
+	}
+}
+
+void HTTPClient::start(request_t *request)
+{
+	long timeout = chrono::duration_cast<chrono::milliseconds>(request->deadline - chrono::steady_clock::now()).count();
+	CURL *easy;
+
+	if (timeout <= 0)
+	{
+		this->finish(request);
+		return;
+	}
+
+	// handles of finished requests are reused, they keep their buffers
+	if (this->idle.empty())
+	{
+		easy = curl_easy_init();
+	}
+	else
+	{
+		easy = this->idle.back();
+		this->idle.pop_back();
+	}
+
+	if (!easy)
+	{
+		this->finish(request);
+		return;
+	}
+
+	curl_easy_setopt(easy, CURLOPT_URL, request->url.c_str());
+	curl_easy_setopt(easy, CURLOPT_HTTPHEADER, request->headers);
+	curl_easy_setopt(easy, CURLOPT_USERAGENT, this->userAgent.c_str());
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &HTTPClient::writeBody);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, (void *)request);
+	curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, &HTTPClient::writeHeader);
+	curl_easy_setopt(easy, CURLOPT_HEADERDATA, (void *)request);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, (void *)request);
+	curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, timeout);
+	curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+	curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(easy, CURLOPT_DNS_CACHE_TIMEOUT, (long)HTTP_DNS_CACHE_S);
+	curl_easy_setopt(easy, CURLOPT_SHARE, this->share);
+
+	request->easy = easy;
+
+	curl_multi_add_handle(this->multi, easy);
+	this->active.insert(request);
+}
+
+void HTTPClient::finish(request_t *request)
+{
+	long connections = 0;
+
+	if (request->easy)
+	{
+		curl_easy_getinfo(request->easy, CURLINFO_RESPONSE_CODE, &request->response.status);
+		curl_easy_getinfo(request->easy, CURLINFO_NUM_CONNECTS, &connections);
+		curl_multi_remove_handle(this->multi, request->easy);
+
+		if (this->idle.size() < HTTP_MAX_IDLE_HANDLES)
+		{
+			curl_easy_reset(request->easy);
+			this->idle.push_back(request->easy);
+		}
+		else
+		{
+			curl_easy_cleanup(request->easy);
+		}
+
+		this->active.erase(request);
+	}
+
+	connectionsOpened.inc(connections);
+	requestsInFlight.add(-1);
+
+	curl_slist_free_all(request->headers);
+
+	request->handler(request->response);
+
+	delete request;
+}
+
+size_t HTTPClient::writeBody(char *input, size_t size, size_t count, void *requestPtr)
+{
+	request_t *request = static_cast<request_t *>(requestPtr);
+
+	request->response.body.append(input, size * count);
+
+	return size * count;
+}
+
+size_t HTTPClient::writeHeader(char *input, size_t size, size_t count, void *requestPtr)
+{
+	request_t *request = static_cast<request_t *>(requestPtr);
+	string    line(input, size * count);
+	size_t    colon    = line.find(':');
+
+	// a new status line starts the headers of another response, like after a redirect
+	if (line.compare(0, 5, "HTTP/") == 0)
+	{
+		request->response.headers.clear();
+	}
+	else if (colon != string::npos)
+	{
+		string name  = line.substr(0, colon);
+		string value = line.substr(colon + 1);
+
+		transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+		value.erase(0, value.find_first_not_of(" \t"));
+		value.erase(value.find_last_not_of(" \t\r\n") + 1);
+
+		request->response.headers[name] = value;
+	}
+
+	return size * count;
+}
@@ -0,0 +1,132 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "common.h"
+
+// Connections kept open to a single host, requests are multiplexed over them with HTTP/2
+#define HTTP_MAX_HOST_CONNECTIONS 4
+
+// Easy handles kept for reuse once their request is done
+#define HTTP_MAX_IDLE_HANDLES     8
+
+// Seconds that resolved host names are remembered
+#define HTTP_DNS_CACHE_S          300
+
+/**
+ * @brief Runs HTTP requests concurrently on a thread of its own.
+ *
+ * Requests are driven by the curl multi interface, so connections, TLS sessions and resolved names
+ * are kept between requests and HTTP/2 requests to the same host share a connection. After the
+ * first request a lookup costs a single round trip instead of a full handshake.
+ */
+class HTTPClient
+{
+public:
+
+	typedef std::chrono::steady_clock::time_point timepoint_t;
+
+	typedef struct response_s
+	{
+		// whether an answer arrived at all, the status tells whether it is a good one
+		bool                               ok;
+		long                               status;
+
+		// header names are in lower case
+		std::map<std::string, std::string> headers;
+		std::string                        body;
+	} response_t;
+
+	typedef std::function<void(const response_t &response)> handler_t;
+
+	/**
+	 * @brief Starts the request thread.
+	 * @param userAgent Value of the User-Agent header
+	 */
+	HTTPClient(std::string userAgent);
+
+	/**
+	 * @brief Stops the request thread, pending requests are completed as failed.
+	 */
+	~HTTPClient();
+
+	/**
+	 * @brief Queues a GET request.
+	 * @param url      Address of the resource
+	 * @param headers  Additional request headers, like "Accept: application/json"
+	 * @param deadline Time at which the request is given up
+	 * @param handler  Receives the response on the request thread, exactly once
+	 */
+	void get(std::string url, std::vector<std::string> headers, timepoint_t deadline, handler_t handler);
+
+	/**
+	 * @brief Like the asynchronous get, but waits for the response. Must not be called from a
+	 *        handler.
+	 */
+	response_t get(std::string url, std::vector<std::string> headers, std::chrono::milliseconds timeout);
+
+private:
+
+	typedef struct request_s
+	{
+		std::string       url;
+		struct curl_slist *headers;
+		timepoint_t       deadline;
+		handler_t         handler;
+		response_t        response;
+		CURL              *easy;
+	} request_t;
+
+	std::string             userAgent;
+	CURLM                   *multi;
+	CURLSH                  *share;
+	std::vector<CURL *>     idle;
+	std::set<request_t *>   active;
+
+	// requests handed over to the thread, guarded by lock
+	std::vector<request_t *> queued;
+	bool                     run;
+	std::mutex               lock;
+	std::thread              *worker;
+
+	void work();
+	void start(request_t *request);
+	void finish(request_t *request);
+
+	static size_t writeBody(char *input, size_t size, size_t count, void *requestPtr);
+	static size_t writeHeader(char *input, size_t size, size_t count, void *requestPtr);
+};
+
+#endif // HTTPCLIENT_H
@@ -0,0 +1,711 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "icalendar.h"
+#include "civildate.h"
+#include "log.h"
+
+using namespace std;
+
+RRule::RRule(string rule, timepoint_t start)
+{
+	istringstream stream;
+	string        part;
+	string        weekStart    = "MO";
+	bool          hasFrequency = false;
+
+	this->interval  = 1;
+	this->count     = 0;
+	this->hasUntil  = false;
+	this->month     = 0;
+	this->startDay  = RRule::daysOf(start);
+	this->timeOfDay = chrono::duration_cast<chrono::seconds>(start.time_since_epoch()) - chrono::hours(24 * this->startDay);
+
+	CivilDate::civil_t civil = CivilDate::civilFromDays(this->startDay);
+
+	transform(rule.begin(), rule.end(), rule.begin(), ::toupper);
+	stream.str(rule);
+
+	while (getline(stream, part, ';'))
+	{
+		size_t         separator = part.find('=');
+		string         name      = part.substr(0, separator);
+		string         value     = separator == string::npos ? "" : part.substr(separator + 1);
+		istringstream  values(value);
+		string         item;
+		int            number;
+
+		if (separator == string::npos || value.empty())
+		{
+			throw -1;
+		}
+
+		if (name == "FREQ")
+		{
+			if      (value == "DAILY")   this->frequency = DAILY;
+			else if (value == "WEEKLY")  this->frequency = WEEKLY;
+			else if (value == "MONTHLY") this->frequency = MONTHLY;
+			else if (value == "YEARLY")  this->frequency = YEARLY;
+			else                         throw -2;
+
+			hasFrequency = true;
+		}
+		else if (name == "INTERVAL" || name == "COUNT" || name == "BYMONTH")
+		{
+			values >> number;
+
+			if (values.fail() || !values.eof() || number < 1 || (name == "BYMONTH" && number > 12))
+			{
+				// only a single month is supported
+				throw (name == "BYMONTH" && value.find(',') != string::npos) ? -2 : -1;
+			}
+
+			if      (name == "INTERVAL") this->interval = number;
+			else if (name == "COUNT")    this->count    = number;
+			else                         this->month    = number;
+		}
+		else if (name == "UNTIL")
+		{
+			if (!RRule::parseDateTime(value, this->until))
+			{
+				throw -1;
+			}
+
+			// a date includes the whole day
+			if (value.size() == 8)
+			{
+				this->until += chrono::hours(24) - chrono::seconds(1);
+			}
+
+			this->hasUntil = true;
+		}
+		else if (name == "BYDAY")
+		{
+			while (getline(values, item, ','))
+			{
+				const string days = "SUMOTUWETHFRSA";
+				byDay_t      byDay;
+				size_t       weekday;
+
+				if (item.size() < 2 || (weekday = days.find(item.substr(item.size() - 2))) == string::npos || weekday % 2)
+				{
+					throw -1;
+				}
+
+				byDay.weekday = weekday / 2;
+				byDay.ordinal = 0;
+
+				if (item.size() > 2)
+				{
+					istringstream ordinal(item.substr(0, item.size() - 2));
+
+					ordinal >> byDay.ordinal;
+
+					if (ordinal.fail() || !ordinal.eof() || byDay.ordinal == 0 || abs(byDay.ordinal) > 5)
+					{
+						throw -1;
+					}
+				}
+
+				this->byDay.push_back(byDay);
+			}
+		}
+		else if (name == "BYMONTHDAY")
+		{
+			while (getline(values, item, ','))
+			{
+				istringstream day(item);
+
+				day >> number;
+
+				if (day.fail() || !day.eof() || number == 0 || abs(number) > 31)
+				{
+					throw -1;
+				}
+
+				this->byMonthDay.push_back(number);
+			}
+		}
+		else if (name == "WKST")
+		{
+			weekStart = value;
+		}
+		else
+		{
+			// BYSETPOS, BYHOUR and the like
+			throw -2;
+		}
+	}
+
+	if (!hasFrequency || (this->count && this->hasUntil))
+	{
+		throw -1;
+	}
+
+	// ordinals only make sense within months
+	if (this->frequency == DAILY || this->frequency == WEEKLY)
+	{
+		for (const byDay_t &byDay : this->byDay)
+		{
+			if (byDay.ordinal != 0)
+			{
+				throw -1;
+			}
+		}
+	}
+
+	// weeks start on Monday, which only matters for weekly rules that skip weeks
+	if (weekStart != "MO" && this->frequency == WEEKLY && this->interval > 1)
+	{
+		throw -2;
+	}
+
+	// yearly rules recur within a single month
+	if (this->month && this->frequency != YEARLY)
+	{
+		throw -2;
+	}
+
+	if (this->frequency == YEARLY && !this->month && !(this->byDay.empty() && this->byMonthDay.empty()))
+	{
+		throw -2;
+	}
+
+	// fill in what the start implies
+	if (this->frequency == WEEKLY && this->byDay.empty())
+	{
+		this->byDay.push_back({0, CivilDate::weekdayFromDays(this->startDay)});
+	}
+
+	if ((this->frequency == MONTHLY || this->frequency == YEARLY) && this->byDay.empty() && this->byMonthDay.empty())
+	{
+		this->byMonthDay.push_back(civil.day);
+	}
+
+	if (this->frequency == YEARLY && !this->month)
+	{
+		this->month = civil.month;
+	}
+
+	switch (this->frequency)
+	{
+		case DAILY:   this->firstDay = this->startDay; break;
+		case WEEKLY:  this->firstDay = RRule::weekStart(this->startDay); break;
+		case MONTHLY: this->firstDay = this->startDay - civil.day + 1; break;
+		case YEARLY:  this->firstDay = CivilDate::daysFromCivil(civil.year, this->month, 1); break;
+	}
+
+	this->rewind();
+}
+
+int64_t RRule::daysOf(timepoint_t date)
+{
+	int64_t seconds = chrono::duration_cast<chrono::seconds>(date.time_since_epoch()).count();
+
+	return (seconds >= 0 ? seconds : seconds - 86399) / 86400;
+}
+
+int64_t RRule::weekStart(int64_t day)
+{
+	// Monday is the first day of the week
+	return day - (CivilDate::weekdayFromDays(day) + 6) % 7;
+}
+
+bool RRule::parseDateTime(const string &value, timepoint_t &date)
+{
+	int year, month, day, hour = 0, minute = 0, second = 0;
+
+	if (value.size() < 8 || sscanf(value.c_str(), "%4d%2d%2d", &year, &month, &day) != 3)
+	{
+		return false;
+	}
+
+	if (value.size() > 8 && (value.size() < 15 || sscanf(value.c_str() + 8, "T%2d%2d%2d", &hour, &minute, &second) != 3))
+	{
+		return false;
+	}
+
+	if (month < 1 || month > 12 || day < 1 || day > (int)CivilDate::lastDayOfMonth(year, month) ||
+	    hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+	{
+		return false;
+	}
+
+	date = timepoint_t(chrono::hours(24 * CivilDate::daysFromCivil(year, month, day)))
+	     + chrono::hours(hour) + chrono::minutes(minute) + chrono::seconds(second);
+
+	return true;
+}
+
+void RRule::exclude(timepoint_t date)
+{
+	this->excluded.push_back(date);
+}
+
+void RRule::rewind()
+{
+	this->period        = -1;
+	this->emitted       = 0;
+	this->emptyPeriods  = 0;
+	this->numCandidates = 0;
+	this->nextCandidate = 0;
+	this->previous      = timepoint_t::min();
+	this->last          = timepoint_t::min();
+	this->exhausted     = false;
+}
+
+bool RRule::matches(int64_t day) const
+{
+	CivilDate::civil_t civil       = CivilDate::civilFromDays(day);
+	int                monthDay    = civil.day;
+	int                monthLength = CivilDate::lastDayOfMonth(civil.year, civil.month);
+	unsigned int       weekday     = CivilDate::weekdayFromDays(day);
+
+	if (!this->byMonthDay.empty() && none_of(this->byMonthDay.begin(), this->byMonthDay.end(), [&](int byMonthDay)
+	    { return byMonthDay > 0 ? byMonthDay == monthDay : monthLength + byMonthDay + 1 == monthDay; }))
+	{
+		return false;
+	}
+
+	if (!this->byDay.empty() && none_of(this->byDay.begin(), this->byDay.end(), [&](const byDay_t &byDay)
+	    { return byDay.weekday == weekday && (byDay.ordinal == 0 ||
+	             (byDay.ordinal > 0 && (monthDay - 1) / 7 + 1 ==  byDay.ordinal) ||
+	             (byDay.ordinal < 0 && (monthLength - monthDay) / 7 + 1 == -byDay.ordinal)); }))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+void RRule::expand()
+{
+	int64_t      first  = this->firstDay;
+	unsigned int length = 1;
+
+	switch (this->frequency)
+	{
+		case DAILY:
+			first += this->period * this->interval;
+			break;
+
+		case WEEKLY:
+			first += this->period * this->interval * 7;
+			length = 7;
+			break;
+
+		case MONTHLY:
+		case YEARLY:
+		{
+			first = CivilDate::addMonths(first, this->period * this->interval * (this->frequency == YEARLY ? 12 : 1));
+
+			CivilDate::civil_t civil = CivilDate::civilFromDays(first);
+
+			length = CivilDate::lastDayOfMonth(civil.year, civil.month);
+			break;
+		}
+	}
+
+	this->numCandidates = 0;
+	this->nextCandidate = 0;
+
+	for (int64_t day = first; day < first + length; day++)
+	{
+		if (day >= this->startDay && this->matches(day))
+		{
+			this->candidates[this->numCandidates++] = day;
+		}
+	}
+}
+
+void RRule::seek(timepoint_t after)
+{
+	int64_t offset, target;
+
+	switch (this->frequency)
+	{
+		case DAILY:   offset = RRule::daysOf(after) - this->firstDay; break;
+		case WEEKLY:  offset = (RRule::daysOf(after) - this->firstDay) / 7; break;
+		case MONTHLY: offset = CivilDate::monthsBetween(this->firstDay, RRule::daysOf(after)); break;
+		case YEARLY:  offset = CivilDate::monthsBetween(this->firstDay, RRule::daysOf(after)) / 12; break;
+	}
+
+	target = offset > 0 ? offset / this->interval : 0;
+
+	// jump to the period that contains the instant, everything before it lies before the instant
+	if (target > this->period)
+	{
+		this->period       = target;
+		this->emptyPeriods = 0;
+		this->previous     = after;
+		this->last         = after;
+
+		this->expand();
+	}
+}
+
+bool RRule::generate(timepoint_t &occurrence)
+{
+	while (!this->exhausted)
+	{
+		if (this->nextCandidate >= this->numCandidates)
+		{
+			if (++this->emptyPeriods > RRULE_MAX_EMPTY_PERIODS)
+			{
+				this->exhausted = true;
+				break;
+			}
+
+			this->period++;
+			this->expand();
+
+			if (this->numCandidates > 0)
+			{
+				this->emptyPeriods = 0;
+			}
+
+			continue;
+		}
+
+		occurrence = timepoint_t(chrono::hours(24 * this->candidates[this->nextCandidate++])) + this->timeOfDay;
+
+		if ((this->count && this->emitted >= this->count) || (this->hasUntil && occurrence > this->until))
+		{
+			this->exhausted = true;
+			break;
+		}
+
+		// excluded dates still count towards COUNT
+		this->emitted++;
+
+		if (find(this->excluded.begin(), this->excluded.end(), occurrence) == this->excluded.end())
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool RRule::nextAfter(timepoint_t after, timepoint_t &occurrence)
+{
+	timepoint_t candidate;
+
+	if (after < this->previous)
+	{
+		this->rewind();
+	}
+	else if (after < this->last)
+	{
+		occurrence = this->last;
+		return true;
+	}
+
+	// occurrences must be counted from the start if there is a COUNT
+	if (!this->count)
+	{
+		this->seek(after);
+	}
+
+	while (this->generate(candidate))
+	{
+		this->previous = this->last;
+		this->last     = candidate;
+
+		if (candidate > after)
+		{
+			occurrence = candidate;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+string RRule::describe() const
+{
+	const char    *units[]    = {"day", "week", "month", "year"};
+	const char    *weekdays[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+	const char    *months[]   = {"January", "February", "March", "April", "May", "June", "July", "August",
+	                             "September", "October", "November", "December"};
+	ostringstream stream;
+
+	// 1st, 2nd, 3rd, 4th, last, 2nd to last and so on
+	auto ordinal = [](int n) -> string
+	{
+		ostringstream stream;
+		int           number = abs(n);
+
+		if (n == -1)
+		{
+			return "last";
+		}
+
+		stream << number << ((number / 10) % 10 == 1 || number % 10 > 3 || number % 10 == 0 ? "th" :
+		                     number % 10 == 3 ? "rd" : number % 10 == 2 ? "nd" : "st") << (n < 0 ? " to last" : "");
+
+		return stream.str();
+	};
+
+	stream << "every ";
+
+	if (this->interval > 1)
+	{
+		stream << this->interval << " " << units[this->frequency] << "s";
+	}
+	else
+	{
+		stream << units[this->frequency];
+	}
+
+	for (size_t i = 0; i < this->byDay.size(); i++)
+	{
+		stream << (i ? ", " : " on ") << (this->byDay[i].ordinal ? "the " + ordinal(this->byDay[i].ordinal) + " " : "")
+		       << weekdays[this->byDay[i].weekday];
+	}
+
+	for (size_t i = 0; i < this->byMonthDay.size(); i++)
+	{
+		stream << (i ? ", " : this->byDay.empty() ? " on the " : " if it is the ") << ordinal(this->byMonthDay[i]);
+	}
+
+	if (this->frequency == YEARLY)
+	{
+		stream << " of " << months[this->month - 1];
+	}
+
+	if (this->count)
+	{
+		stream << ", " << this->count << " times";
+	}
+
+	if (this->hasUntil)
+	{
+		CivilDate::civil_t civil = CivilDate::civilFromDays(RRule::daysOf(this->until));
+		char               buf[16];
+
+		snprintf(buf, sizeof(buf), "%04d-%02u-%02u", (int)civil.year, civil.month, civil.day);
+		stream << " until " << buf;
+	}
+
+	return stream.str();
+}
+
+string ICalendar::unescape(const string &text)
+{
+	string result;
+
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		if (text[i] == '\\' && i + 1 < text.size())
+		{
+			i++;
+
+			// line breaks become spaces, announcements are single lines
+			result += (text[i] == 'n' || text[i] == 'N') ? ' ' : text[i];
+		}
+		else
+		{
+			result += text[i];
+		}
+	}
+
+	return result;
+}
+
+int ICalendar::import(string path, Calendar *calendar, Calendar::duration_t warn, unsigned int warnCount)
+{
+	ifstream       in(path);
+	vector<string> lines;
+	string         line;
+	int            found = 0, added = 0;
+
+	if (!in)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to open iCalendar file " << path << ".");
+		return -1;
+	}
+
+	// unfold lines that were split, continuations start with whitespace
+	while (getline(in, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+		{
+			line.erase(line.size() - 1);
+		}
+
+		if (!line.empty() && (line[0] == ' ' || line[0] == '\t') && !lines.empty())
+		{
+			lines.back() += line.substr(1);
+		}
+		else
+		{
+			lines.push_back(line);
+		}
+	}
+
+	bool                       inEvent = false, hasStart = false;
+	int                        depth   = 0;
+	string                     uid, summary, rrule, status, zone;
+	RRule::timepoint_t         start, date;
+	vector<RRule::timepoint_t> excluded;
+
+	for (const string &property : lines)
+	{
+		size_t colon      = property.find(':');
+		string name       = property.substr(0, MIN(colon, property.size()));
+		string parameters = "";
+		string value      = colon == string::npos ? "" : property.substr(colon + 1);
+
+		if (name.find(';') != string::npos)
+		{
+			parameters = name.substr(name.find(';') + 1);
+			name       = name.substr(0, name.find(';'));
+		}
+
+		transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+		if (!inEvent)
+		{
+			if (name == "BEGIN" && value == "VEVENT")
+			{
+				inEvent  = true;
+				hasStart = false;
+				depth    = 0;
+				uid = summary = rrule = status = zone = "";
+				excluded.clear();
+			}
+
+			continue;
+		}
+
+		// skip nested components like alarms
+		if (name == "BEGIN")
+		{
+			depth++;
+		}
+		else if (name == "END" && depth > 0)
+		{
+			depth--;
+		}
+		else if (depth > 0)
+		{
+			continue;
+		}
+		else if (name == "DTSTART")
+		{
+			hasStart = RRule::parseDateTime(value, start);
+
+			if (parameters.find("TZID=") != string::npos)
+			{
+				zone = parameters.substr(parameters.find("TZID=") + 5);
+				zone = zone.substr(0, zone.find(';'));
+			}
+		}
+		else if (name == "SUMMARY")
+		{
+			summary = ICalendar::unescape(value);
+		}
+		else if (name == "RRULE")
+		{
+			rrule = value;
+		}
+		else if (name == "EXDATE")
+		{
+			istringstream values(value);
+			string        item;
+
+			while (getline(values, item, ','))
+			{
+				if (RRule::parseDateTime(item, date))
+				{
+					excluded.push_back(date);
+				}
+			}
+		}
+		else if (name == "UID")
+		{
+			uid = value;
+		}
+		else if (name == "STATUS")
+		{
+			status = value;
+		}
+		else if (name == "END" && value == "VEVENT")
+		{
+			shared_ptr<RRule> rule;
+			ostringstream     source;
+
+			inEvent = false;
+			found++;
+
+			if (!hasStart || summary.empty() || status == "CANCELLED")
+			{
+				continue;
+			}
+
+			if (!zone.empty())
+			{
+				LOG(Log::LEVEL_INFO, NOTICE << "Time zone " << zone << " of " << summary << " isn't supported, using UTC.");
+			}
+
+			if (!rrule.empty())
+			{
+				try
+				{
+					rule = make_shared<RRule>(rrule, start);
+				}
+				catch (int error)
+				{
+					LOG(Log::LEVEL_ERROR, ERROR << "Skipping " << summary << ", its recurrence rule "
+					                            << (error == -2 ? "isn't supported" : "is malformed") << ": " << rrule);
+					continue;
+				}
+
+				for (const RRule::timepoint_t &date : excluded)
+				{
+					rule->exclude(date);
+				}
+			}
+
+			// the event keeps its journal state until its dates change
+			source << "ics " << (uid.empty() ? path + " " + summary : uid) << " "
+			       << chrono::system_clock::to_time_t(start) << " " << rrule;
+
+			if (calendar->addEvent(start, warn, warnCount, rule ? Calendar::RULE : Calendar::ONCE, summary,
+			                       source.str(), false, rule))
+			{
+				added++;
+			}
+		}
+	}
+
+	LOG(Log::LEVEL_INFO, NOTICE << "Imported " << added << " upcoming of " << found << " events from " << path << ".");
+
+	return added;
+}
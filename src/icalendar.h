@@ -0,0 +1,153 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#ifndef ICALENDAR_H
+#define ICALENDAR_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "calendar.h"
+
+// Give up on a rule after this many periods in a row without an occurrence
+#define RRULE_MAX_EMPTY_PERIODS 1000
+
+/**
+ * @brief A recurrence rule as in RFC 5545 that produces its occurrences one at a time.
+ *
+ * Supports FREQ=DAILY, WEEKLY, MONTHLY and YEARLY with INTERVAL, COUNT, UNTIL, BYDAY (with
+ * ordinals for monthly rules), BYMONTHDAY and excluded dates. Yearly rules recur in the month of
+ * their start. Only a fixed amount of state is kept, and rules without COUNT skip straight to the
+ * period in question, so asking for a date far in the future costs as much as asking for the next.
+ */
+class RRule
+{
+public:
+
+	typedef std::chrono::time_point<std::chrono::system_clock> timepoint_t;
+
+	/**
+	 * @param rule  Value of an RRULE property, like FREQ=WEEKLY;BYDAY=SA
+	 * @param start The first instance of the series (DTSTART), it sets the time of day
+	 * @throws -1 if the rule is malformed, -2 if it uses a part that isn't supported.
+	 */
+	RRule(std::string rule, timepoint_t start);
+
+	/**
+	 * @brief Removes an instance from the series (EXDATE).
+	 */
+	void exclude(timepoint_t date);
+
+	/**
+	 * @brief Finds the first occurrence after an instant, this is fastest with increasing instants.
+	 * @return Whether there is one.
+	 */
+	bool nextAfter(timepoint_t after, timepoint_t &occurrence);
+
+	/**
+	 * @return A short description like "every 2 weeks".
+	 */
+	std::string describe() const;
+
+	/**
+	 * @brief Reads a DATE or DATE-TIME value, times without a zone are taken as UTC.
+	 */
+	static bool parseDateTime(const std::string &value, timepoint_t &date);
+
+private:
+
+	typedef enum frequency_e
+	{
+		DAILY,
+		WEEKLY,
+		MONTHLY,
+		YEARLY
+	} frequency_t;
+
+	typedef struct byDay_s
+	{
+		int          ordinal; // n-th such weekday of the month, negative from its end, 0 for all
+		unsigned int weekday; // 0 for Sunday up to 6 for Saturday
+	} byDay_t;
+
+	// rule, defaults taken from the start are filled in
+	frequency_t              frequency;
+	unsigned int             interval;
+	unsigned int             count;
+	bool                     hasUntil;
+	timepoint_t              until;
+	unsigned int             month;
+	std::vector<byDay_t>     byDay;
+	std::vector<int>         byMonthDay;
+	std::vector<timepoint_t> excluded;
+
+	// start
+	int64_t                  startDay;
+	int64_t                  firstDay;
+	std::chrono::seconds     timeOfDay;
+
+	// generator state, the candidates are the matching days of the current period
+	int64_t                  period;
+	unsigned int             emitted;
+	unsigned int             emptyPeriods;
+	int64_t                  candidates[31];
+	unsigned int             numCandidates;
+	unsigned int             nextCandidate;
+	timepoint_t              previous;
+	timepoint_t              last;
+	bool                     exhausted;
+
+	void    rewind();
+	void    seek(timepoint_t after);
+	bool    generate(timepoint_t &occurrence);
+	void    expand();
+	bool    matches(int64_t day) const;
+
+	static int64_t daysOf(timepoint_t date);
+	static int64_t weekStart(int64_t day);
+};
+
+/**
+ * @brief Adds the events of an iCalendar file to a calendar.
+ */
+class ICalendar
+{
+public:
+
+	/**
+	 * @param path      Path to a file with VEVENT components
+	 * @param calendar  Calendar to add the events to
+	 * @param warn      Time before each occurrence at which to start warning
+	 * @param warnCount Number of warnings per occurrence
+	 * @return Number of events added, or -1 if the file couldn't be read.
+	 */
+	static int import(std::string path, Calendar *calendar, Calendar::duration_t warn, unsigned int warnCount);
+
+private:
+
+	static std::string unescape(const std::string &text);
+};
+
+#endif // ICALENDAR_H
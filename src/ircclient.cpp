@@ -20,29 +20,54 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <cstring>
+#include <climits>
 #include <iostream>
 #include <sstream>
-#include <thread>
 #include <chrono>
-#include <regex>
 
 #include <libircclient/libircclient.h>
 #include <libircclient/libirc_rfcnumeric.h>
 
 #include "ircclient.h"
+#include "eventloop.h"
+#include "metrics.h"
 
 using namespace std;
 
-IRCClient *IRCClient::instanceFromSession(irc_session_t *session)
+static Counter   linesSent("mantis_irc_lines_sent_total", "",
+                           "Message lines handed to the IRC library.");
+static Counter   broadcasts("mantis_irc_broadcasts_total", "",
+                            "Broadcasts to all channels.");
+static Counter   reconnects("mantis_irc_reconnects_total", "",
+                            "Lost connections to an IRC network.");
+static Counter   lagTimeouts("mantis_irc_lag_timeouts_total", "",
+                             "Connections dropped because the server stopped answering PINGs.");
+static Histogram rejoinDuration("mantis_irc_rejoin_seconds", "",
+                                "Time from losing a connection until all channels are joined again.");
+static Histogram listDuration("mantis_irc_command_seconds", "command=\"list\"",
+                              "Time taken to answer a channel command.");
+static Histogram topDuration("mantis_irc_command_seconds", "command=\"top\"",
+                             "Time taken to answer a channel command.");
+static Histogram serverDuration("mantis_irc_command_seconds", "command=\"server\"",
+                                "Time taken to answer a channel command.");
+static Histogram eventsDuration("mantis_irc_command_seconds", "command=\"events\"",
+                                "Time taken to answer a channel command.");
+static Histogram issueDuration("mantis_irc_command_seconds", "command=\"issue\"",
+                               "Time taken to answer a channel command.");
+static Histogram commitDuration("mantis_irc_command_seconds", "command=\"commit\"",
+                                "Time taken to answer a channel command.");
+
+IRCClient::connection_t *IRCClient::connectionFromSession(irc_session_t *session)
 {
-	return (IRCClient *)irc_get_ctx(session);
+	return (connection_t *)irc_get_ctx(session);
 }
 
 void IRCClient::handleNumeric HANDLER_NUMERIC
 {
 	HANDLER_NOWARN
 
-	IRCClient *instance = IRCClient::instanceFromSession(session);
+	connection_t *conn     = IRCClient::connectionFromSession(session);
+	IRCClient    *instance = conn->client;
 
 	// print errors
 	if ( event > 400 )
@@ -59,13 +84,17 @@ void IRCClient::handleNumeric HANDLER_NUMERIC
 			error += params[i];
 		}
 
-		cout << ERROR << event << ": " << ( origin ? origin : "?" ) << " " << error << endl;
+		LOG(Log::LEVEL_ERROR, ERROR << event << ": " << ( origin ? origin : "?" ) << " " << error);
 	}
 
 	switch ( event )
 	{
+		case RPL_ISUPPORT:
+			instance->parseISupport(conn, params, count);
+			break;
+
 		case LIBIRC_RFC_ERR_NICKNAMEINUSE:
-			instance->takeNextNick();
+			instance->takeNextNick(conn);
 			break;
 	}
 }
@@ -74,65 +103,123 @@ void IRCClient::handleConnect HANDLER
 {
 	HANDLER_NOWARN
 
-	IRCClient *instance = IRCClient::instanceFromSession(session);
+	connection_t *conn     = IRCClient::connectionFromSession(session);
+	IRCClient    *instance = conn->client;
 
-	instance->connected = true;
+	conn->connected = true;
+	conn->lost      = false;
 
-	cout << INCOMING << "Connected to " << origin << "." << endl;
+	LOG(Log::LEVEL_INFO, INCOMING << "Connected to " << origin << " as " << conn->currentNick << ".");
 
-	// start asynchronous worker
-	instance->startAsyncWorker();
+	// the connection works, start over with short delays
+	conn->reconnectAttempts = 0;
+	conn->awaitingPong      = false;
+	conn->nextPing          = chrono::system_clock::now() + chrono::seconds(PING_PERIOD_S);
 
-	// rejoin all channels
-	for(channel_t *channel : instance->channels)
-	{
-		instance->internalJoin(channel->name, channel->password);
-	}
+	// start module timers
+	instance->startTimers();
+
+	// take back our channels from the other connections and join them
+	instance->rebalance(conn);
 }
 
 void IRCClient::handleJoin HANDLER
 {
 	HANDLER_NOWARN
 
-	IRCClient *instance = IRCClient::instanceFromSession(session);
+	connection_t *conn     = IRCClient::connectionFromSession(session);
+	IRCClient    *instance = conn->client;
 
 	const char *channel = params[0];
 
-	if ( origin == instance->currentNick )
+	if ( IRCClient::nickFromOrigin(origin) == conn->currentNick )
 	{
-		cout << INCOMING << "Joined " << channel << "." << endl;
+		LOG(Log::LEVEL_INFO, INCOMING << "Joined " << channel << ".");
+
+		vector<pair<timepoint_t, IRCMessage> > missed;
 
-		for(channel_t *cursor : instance->channels)
 		{
-			if(cursor->name == channel)
+			lock_guard<mutex> guard(instance->channelLock);
+			bool              complete = true, owned = false;
+
+			for(channel_t *cursor : instance->channels)
 			{
-				cursor->joined = true;
+				if(cursor->name == channel && cursor->owner == conn)
+				{
+					cursor->joined = true;
+					owned          = true;
+
+					missed.swap(cursor->missed);
+				}
+
+				complete &= cursor->joined;
+			}
+
+			// the channel was left or moved to another connection while we joined
+			if (!owned)
+			{
+				instance->internalPart(conn, channel);
+			}
+
+			if (instance->rejoining && complete)
+			{
+				instance->rejoining = false;
+
+				rejoinDuration.observe(chrono::duration<double>(chrono::system_clock::now() -
+				                                                instance->disconnectedAt).count());
+			}
+		}
+
+		// catch up on the announcements that are still of use
+		for (const pair<timepoint_t, IRCMessage> &announcement : missed)
+		{
+			if (chrono::system_clock::now() - announcement.first < chrono::seconds(MISSED_EVENTS_MAX_S))
+			{
+				instance->msg(channel, announcement.second);
 			}
 		}
 	}
 }
 
+void IRCClient::handleUnknown HANDLER
+{
+	HANDLER_NOWARN
+
+	connection_t *conn = IRCClient::connectionFromSession(session);
+
+	if (!strcmp(event, "PONG") && conn->awaitingPong && conn->connected)
+	{
+		timepoint_t now = chrono::system_clock::now();
+
+		conn->awaitingPong = false;
+		conn->lag->set(chrono::duration_cast<chrono::milliseconds>(now - conn->pingSentAt).count());
+	}
+}
+
 void IRCClient::handleKick HANDLER
 {
 	HANDLER_NOWARN
 
-	IRCClient *instance = IRCClient::instanceFromSession(session);
+	connection_t *conn     = IRCClient::connectionFromSession(session);
+	IRCClient    *instance = conn->client;
 
 	const char *channel = params[0];
 	const char *victim = params[1];
 
-	if ( victim == instance->currentNick )
+	if ( victim == conn->currentNick )
 	{
-		cout << INCOMING << "Kicked from " << channel << " by " << origin << "." << endl;
+		LOG(Log::LEVEL_INFO, INCOMING << "Kicked from " << channel << " by " << IRCClient::nickFromOrigin(origin) << ".");
+
+		lock_guard<mutex> guard(instance->channelLock);
 
 		for(channel_t *cursor : instance->channels)
 		{
-			if(cursor->name == channel)
+			if(cursor->name == channel && cursor->owner == conn)
 			{
 				cursor->joined = false;
 
 				// try to rejoin once
-				instance->internalJoin(cursor->name, cursor->password);
+				instance->internalJoin(conn, cursor->name, cursor->password);
 			}
 		}
 	}
@@ -142,124 +229,290 @@ void IRCClient::handleChannel HANDLER
 {
 	HANDLER_NOWARN
 
-	IRCClient *instance = IRCClient::instanceFromSession(session);
+	connection_t *conn     = IRCClient::connectionFromSession(session);
+	IRCClient    *instance = conn->client;
 
 	const char *channel = params[0];
 	const char *msg     = params[1];
 
 	istringstream stream(msg);
 
+	// while a channel moves, two connections may see its messages
+	if (!instance->owns(conn, channel))
+	{
+		return;
+	}
+
 	if (msg[0] == '!')
 	{
 		string cmd;
 		stream >> cmd;
 
+		// module work runs on the shared executor so that it doesn't stall the event loop, expensive
+		// commands are rate limited
 		if (!cmd.compare("!list"))
 		{
-			instance->cmdList(string(channel));
+			if (instance->rateLimit(origin, channel, RATELIMIT_QUERY, cmd))
+			{
+				instance->worker->post(bind(&IRCClient::cmdList, instance, string(channel)));
+			}
 		}
 		else if (!cmd.compare("!top"))
 		{
-			instance->cmdTop(string(channel));
+			if (instance->rateLimit(origin, channel, RATELIMIT_QUERY, cmd))
+			{
+				instance->worker->post(bind(&IRCClient::cmdTop, instance, string(channel)));
+			}
+		}
+		else if (!cmd.compare("!server"))
+		{
+			string server;
+			getline(stream >> ws, server);
+			if (!server.empty() && instance->rateLimit(origin, channel, RATELIMIT_LOOKUP, cmd))
+			{
+				instance->worker->post(bind(&IRCClient::cmdServer, instance, string(channel), server));
+			}
 		}
 		else if (!cmd.compare("!events"))
 		{
-			instance->cmdEvents(string(channel));
+			instance->worker->post(bind(&IRCClient::cmdEvents, instance, string(channel)));
+		}
+		else if (!cmd.compare("!event"))
+		{
+			string action, definition;
+			stream >> action;
+			getline(stream >> ws, definition);
+			if (!action.compare("add"))
+			{
+				bool allowed = instance->calendar && instance->calendar->mayEdit(origin);
+				instance->worker->post(bind(&IRCClient::cmdAddEvent, instance, string(channel), definition, allowed));
+			}
 		}
 		else if (!cmd.compare("!issue"))
 		{
 			int issue;
 			stream >> issue;
-			thread(&IRCClient::cmdIssue, instance, string(channel), issue, true).detach();
+			if (instance->rateLimit(origin, channel, RATELIMIT_LOOKUP, cmd))
+			{
+				instance->worker->post(bind(&IRCClient::cmdIssue, instance, string(channel), issue, true));
+			}
 		}
 		else if (!cmd.compare("!commit"))
 		{
 			string hash;
 			stream >> hash;
-			thread(&IRCClient::cmdCommit, instance, string(channel), hash, true).detach();
+			if (instance->rateLimit(origin, channel, RATELIMIT_LOOKUP, cmd))
+			{
+				instance->worker->post(bind(&IRCClient::cmdCommit, instance, string(channel), hash, true));
+			}
 		}
 	}
-	/*
 	else
 	{
-		regex issueRE("#[0-9]+");
-		regex commitRE("[0-9a-fA-F]{7,40}");
+		instance->scanLinks(origin, channel, msg);
+	}
+}
+
+void IRCClient::scanLinks(const char *origin, string channel, const char *msg)
+{
+	LinkScanner::result_t result;
+
+	if (!this->gitHubQuery)
+	{
+		return;
+	}
+
+	LinkScanner::scan(msg, &result);
+
+	// only candidates that pass the prefilters cost a lookup
+	for (unsigned int i = 0; i < result.numIssues; i++)
+	{
+		unsigned int issue = result.issues[i];
 
-		// issues
+		if (this->gitHubQuery->mightBeIssue(issue) &&
+		    this->rateLimit(origin, channel, RATELIMIT_PASSIVE, "#" + to_string(issue)))
 		{
-			cregex_iterator begin(msg, msg + strlen(msg), issueRE), end;
-			set<int>        issues;
-			int             lineNum = 0;
+			this->worker->post(bind(&IRCClient::cmdIssue, this, channel, issue, false));
+		}
+	}
+
+	for (unsigned int i = 0; i < result.numCommits; i++)
+	{
+		const LinkScanner::commit_t &commit = result.commits[i];
 
-			for (cregex_iterator match = begin; match != end; match++)
-				issues.insert(atoi(match->str().c_str() + 1));
+		if (this->gitHubQuery->mightBeCommit(commit.start, commit.length))
+		{
+			string hash(commit.start, commit.length);
 
-			for (int issue : issues)
+			if (this->rateLimit(origin, channel, RATELIMIT_PASSIVE, hash))
 			{
-				if (lineNum++ == 3) break;
-				thread(&IRCClient::cmdIssue, instance, string(channel), issue, false).detach();
+				this->worker->post(bind(&IRCClient::cmdCommit, this, channel, hash, false));
 			}
 		}
+	}
+}
 
-		// commits
-		{
-			cregex_iterator begin(msg, msg + strlen(msg), commitRE), end;
-			set<string>     hashes;
-			int             lineNum = 0;
+string IRCClient::nickFromOrigin(const char *origin)
+{
+	char nick[128];
 
-			for (cregex_iterator match = begin; match != end; match++)
-				hashes.insert(match->str());
+	irc_target_get_nick(origin, nick, sizeof(nick));
 
-			for (string hash : hashes)
-			{
-				if (lineNum++ == 3) break;
-				thread(&IRCClient::cmdCommit, instance, string(channel), hash, false).detach();
-			}
+	return string(nick);
+}
+
+bool IRCClient::rateLimit(const char *origin, string channel, string category, string command)
+{
+	string nick = IRCClient::nickFromOrigin(origin);
+	string mask = origin;
+
+	// strip the nick so that nick changes don't reset the hostmask's bucket
+	mask.erase(0, mask.find('!') == string::npos ? 0 : mask.find('!') + 1);
+
+	vector<string> userKeys = {category + " nick " + nick, category + " mask " + mask};
+
+	if (!this->userLimiter.allow(userKeys))
+	{
+		LOG(Log::LEVEL_DEBUG, NOTICE << "Dropped " << command << " by rate limited user " << origin << ".");
+		return false;
+	}
+
+	if (!this->channelLimiter.allow({category + " channel " + channel}))
+	{
+		// the command doesn't run, so it doesn't count against the user
+		this->userLimiter.refund(userKeys);
+
+		lock_guard<mutex> guard(this->cacheLock);
+
+		auto cached = this->responseCache.find(channel + " " + command);
+
+		LOG(Log::LEVEL_DEBUG, NOTICE << "Rate limited " << command << " in " << channel << ".");
+
+		// answer from the cache if we can do so cheaply
+		if (cached != this->responseCache.end() &&
+		    cached->second.time + chrono::seconds(RATELIMIT_CACHE_S) > chrono::system_clock::now())
+		{
+			this->msg(channel, IRCMessage(cached->second.response, true));
 		}
+
+		return false;
 	}
-	*/
+
+	return true;
+}
+
+void IRCClient::cacheResponse(string channel, string command, string response)
+{
+	lock_guard<mutex> guard(this->cacheLock);
+
+	this->responseCache[channel + " " + command] = {response, chrono::system_clock::now()};
+}
+
+void IRCClient::printIRCSessionError(connection_t *conn)
+{
+	LOG(Log::LEVEL_ERROR, ERROR << irc_strerror(irc_errno(conn->session)));
 }
 
-void IRCClient::printIRCSessionError()
+void IRCClient::parseISupport(connection_t *conn, const char **params, unsigned int count)
 {
-	cout << ERROR << irc_strerror(irc_errno(this->session)) << endl;
+	// the first parameter is our nick and the last one a human readable trailer
+	for (unsigned int i = 1; i + 1 < count; i++)
+	{
+		string token = params[i];
+
+		if (token.find("TARGMAX=") == 0)
+		{
+			istringstream stream(token.substr(strlen("TARGMAX=")));
+			string        limit;
+
+			while (getline(stream, limit, ','))
+			{
+				if (limit.find("PRIVMSG:") == 0)
+				{
+					// an empty value means there is no limit
+					string value = limit.substr(strlen("PRIVMSG:"));
+					conn->maxTargets = value.empty() ? UINT_MAX : MAX(atoi(value.c_str()), 1);
+				}
+			}
+		}
+		else if (token.find("MAXTARGETS=") == 0)
+		{
+			conn->maxTargets = MAX(atoi(token.c_str() + strlen("MAXTARGETS=")), 1);
+		}
+	}
 }
 
-int IRCClient::connectToServer()
+int IRCClient::connectToServer(connection_t *conn)
 {
-	cout << OUTGOING << "Connecting to " << this->host << ":" << this->port << "..." << endl;
+	LOG(Log::LEVEL_INFO, OUTGOING << "Connecting to " << this->host << ":" << this->port << " as "
+	                              << conn->preferedNick << "...");
 
 	const char *host = this->host.c_str();
 	const char *pass = this->password.empty() ? NULL : this->password.c_str();
-	const char *nick = this->preferedNick.c_str();
+	const char *nick = conn->preferedNick.c_str();
 
-	return irc_connect(this->session, host, this->port, pass, nick, nick, nick);
+	return irc_connect(conn->session, host, this->port, pass, nick, nick, nick);
 }
 
-void IRCClient::takeNextNick()
+void IRCClient::takeNextNick(connection_t *conn)
 {
-	string oldNick = this->currentNick;
+	string oldNick = conn->currentNick;
 
-	this->currentNick += "_";
+	conn->currentNick += "_";
 
-	cout << OUTGOING << "Changing nick: " << oldNick << " -> " << this->currentNick << endl;
+	LOG(Log::LEVEL_INFO, OUTGOING << "Changing nick: " << oldNick << " -> " << conn->currentNick);
 
-	irc_cmd_nick(this->session, this->currentNick.c_str());
+	irc_cmd_nick(conn->session, conn->currentNick.c_str());
 }
 
-IRCClient::IRCClient(string host, unsigned short port, string password, string nick)
+IRCClient::IRCClient(EventLoop *eventLoop, Scheduler *worker, string host, unsigned short port, string password, string nick,
+                     unsigned int numConnections)
+	: userLimiter(RATELIMIT_USER_BURST, RATELIMIT_USER_PERIOD_S),
+	  channelLimiter(RATELIMIT_CHANNEL_BURST, RATELIMIT_CHANNEL_PERIOD_S)
 {
 	// context
-	this->preferedNick = nick;
-	this->currentNick  = nick;
 	this->host         = host;
 	this->port         = port;
 	this->password     = password;
-	this->connected    = false;
 	this->channels     = set<channel_t *>();
 
 	// system
 	this->shallReconnect = true;
+	this->done           = false;
+
+	// supervision
+	this->rejoining = false;
+	this->random.seed(random_device()());
+
+	// connections, each one with its own nick and its points on the ring
+	for (unsigned int index = 0; index < MAX(numConnections, 1u); index++)
+	{
+		connection_t *conn = new connection_t;
+		string       labels;
+
+		conn->client            = this;
+		conn->index             = index;
+		conn->session           = NULL;
+		conn->preferedNick      = index > 0 ? nick + to_string(index + 1) : nick;
+		conn->currentNick       = conn->preferedNick;
+		conn->connected         = false;
+		conn->lost              = false;
+		conn->maxTargets        = 1;
+		conn->reconnectAt       = timepoint_t::min();
+		conn->reconnectAttempts = 0;
+		conn->awaitingPong      = false;
+
+		labels    = "network=\"" + host + "\",connection=\"" + to_string(index) + "\"";
+		conn->lag = new Gauge("mantis_irc_lag_milliseconds", labels.c_str(),
+		                      "Round trip time of the last PING to an IRC network.");
+
+		for (unsigned int point = 0; point < CONNECTION_VNODES; point++)
+		{
+			this->ring[ringHash(to_string(index) + "/" + to_string(point))] = conn;
+		}
+
+		this->connections.push_back(conn);
+	}
 
 	// event handlers
 	memset(&this->callbacks, 0, sizeof(this->callbacks));
@@ -268,169 +521,591 @@ IRCClient::IRCClient(string host, unsigned short port, string password, string n
 	this->callbacks.event_join    = &handleJoin;
 	this->callbacks.event_channel = &handleChannel;
 	this->callbacks.event_kick    = &handleKick;
+	this->callbacks.event_unknown = &handleUnknown;
 
-	// background worker
-	this->asyncWorkerRun     = false;
-	this->asyncWorkerRunning = false;
+	// timers
+	this->worker       = worker;
+	this->peekTimer    = 0;
+	this->timersActive = false;
 
 	// modules
-	this->unvQuery = NULL;
-	this->calendar = NULL;
+	this->unvQuery    = NULL;
+	this->calendar    = NULL;
+	this->gitHubQuery = NULL;
+
+	// let the event loop drive our sessions
+	this->eventLoop = eventLoop;
+	this->eventLoop->addClient(this);
+}
+
+bool IRCClient::openSession(connection_t *conn)
+{
+	irc_session_t *session;
+
+	// create a session
+	session = irc_create_session(&this->callbacks);
+
+	if (!session)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to initialize IRC session.");
+		this->done = true;
+		return false;
+	}
+
+	// set session options, we keep the full origin to be able to rate limit hostmasks
+	irc_set_ctx(session, conn);
+
+	{
+		lock_guard<mutex> guard(this->sessionLock);
+		conn->session = session;
+	}
+
+	// connect
+	if (connectToServer(conn) != 0)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to initialize IRC connection: "
+		                            << irc_strerror(irc_errno(conn->session)) << ".");
+		this->closeSession(conn);
+		this->scheduleReconnect(conn);
+		return false;
+	}
 
-	// start main loop worker
-	this->eventWorker = new thread(&IRCClient::mainLoop, this);
+	// registration has to complete within the lag limit as well, handleConnect starts pinging
+	conn->pingSentAt   = chrono::system_clock::now();
+	conn->awaitingPong = true;
+
+	return true;
 }
 
-void IRCClient::mainLoop()
+void IRCClient::closeSession(connection_t *conn)
 {
-	while (true)
+	lock_guard<mutex> guard(this->sessionLock);
+
+	irc_destroy_session(conn->session);
+	conn->session = NULL;
+}
+
+bool IRCClient::anyConnected()
+{
+	for (connection_t *conn : this->connections)
 	{
-		// create a session
-		this->session = irc_create_session(&this->callbacks);
+		if (conn->connected)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void IRCClient::handleDisconnect(connection_t *conn)
+{
+	LOG(Log::LEVEL_INFO, INCOMING << "Disconnected " << conn->currentNick << ": "
+	                              << irc_strerror(irc_errno(conn->session)) << ".");
 
-		if (!this->session)
+	reconnects.inc();
+
+	// destroy session
+	this->closeSession(conn);
+
+	// reset context, the channels of a connection that was up fail over until it is back
+	conn->lost        = conn->lost || conn->connected;
+	conn->connected   = false;
+	conn->currentNick = conn->preferedNick;
+	conn->maxTargets  = 1;
+
+	// stop module timers once no connection is left
+	if (!this->anyConnected())
+	{
+		this->stopTimers();
+	}
+
+	if (shallReconnect)
+	{
+		// mark our channels as not joined
 		{
-			cerr << FATAL << "Failed to initialize IRC session." << endl;
-			break;
+			lock_guard<mutex> guard(this->channelLock);
+
+			for(channel_t *channel : this->channels)
+			{
+				if (channel->owner == conn)
+				{
+					channel->joined = false;
+				}
+			}
 		}
 
-		// set session options
-		irc_option_set(this->session, LIBIRC_OPTION_STRIPNICKS);
-		irc_set_ctx(this->session, this);
+		// measure until all channels are joined again
+		if (!this->rejoining)
+		{
+			this->disconnectedAt = chrono::system_clock::now();
+			this->rejoining      = true;
+		}
+
+		this->scheduleReconnect(conn);
 
-		// connect
-		if (connectToServer() != 0)
+		// move our channels to the remaining connections
+		this->rebalance();
+	}
+	else
+	{
+		this->done = true;
+
+		for (connection_t *cursor : this->connections)
 		{
-			cerr << FATAL << "Failed to initialize IRC connection." << endl;
-			break;
+			this->done &= (cursor->session == NULL);
 		}
+	}
+}
+
+void IRCClient::scheduleReconnect(connection_t *conn)
+{
+	unsigned int delay = RECONNECT_DELAY_S;
+
+	// back off exponentially, the jitter keeps many clients from reconnecting in lockstep
+	for (unsigned int attempt = 0; attempt < conn->reconnectAttempts && delay < RECONNECT_DELAY_MAX_S; attempt++)
+	{
+		delay *= 2;
+	}
+
+	delay = MIN(delay, (unsigned int)RECONNECT_DELAY_MAX_S);
+
+	uniform_int_distribution<unsigned int> jitter(delay * 500, delay * 1000);
+	chrono::milliseconds                   wait(jitter(this->random));
+
+	conn->reconnectAttempts++;
+
+	LOG(Log::LEVEL_INFO, NOTICE << "Reconnecting " << conn->preferedNick << " in " << wait.count() / 1000 << " seconds...");
+
+	conn->reconnectAt = chrono::system_clock::now() + wait;
+}
+
+bool IRCClient::supervise(connection_t *conn, timepoint_t *deadline)
+{
+	timepoint_t now = chrono::system_clock::now(), due;
 
-		// start event handler loop, will exit when disconnected
-		irc_run(this->session);
+	// a server that doesn't answer or register us within the limit is considered gone
+	if (conn->awaitingPong && now - conn->pingSentAt > chrono::seconds(LAG_MAX_S))
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "No " << (conn->connected ? "PONG" : "welcome") << " from " << this->host
+		                            << " for " << LAG_MAX_S << " seconds, reconnecting " << conn->currentNick << ".");
 
-		cout << INCOMING << "Disconnected: " << irc_strerror(irc_errno(this->session)) << "." << endl;
+		lagTimeouts.inc();
+		conn->lag->set(LAG_MAX_S * 1000);
 
-		if (shallReconnect)
 		{
-			// stop asynchronous worker
-			this->stopAsyncWorker();
+			lock_guard<mutex> guard(this->sessionLock);
+			irc_disconnect(conn->session);
+		}
 
-			// reset context
-			this->connected   = false;
-			this->currentNick = this->preferedNick;
+		this->handleDisconnect(conn);
+		return false;
+	}
 
-			// mark all channels as not joined
-			for(channel_t *channel : this->channels)
+	if (!conn->awaitingPong && now >= conn->nextPing)
+	{
+		{
+			lock_guard<mutex> guard(this->sessionLock);
+			ERRCHK(conn, irc_send_raw(conn->session, "PING :%s", this->host.c_str()));
+		}
+
+		conn->pingSentAt   = now;
+		conn->awaitingPong = true;
+		conn->nextPing     = now + chrono::seconds(PING_PERIOD_S);
+	}
+
+	due = conn->awaitingPong ? conn->pingSentAt + chrono::seconds(LAG_MAX_S) : conn->nextPing;
+
+	*deadline = MIN(*deadline, due);
+
+	return true;
+}
+
+void IRCClient::addDescriptors(fd_set *in, fd_set *out, int *maxfd, timepoint_t *deadline)
+{
+	for (connection_t *conn : this->connections)
+	{
+		if (this->done)
+		{
+			return;
+		}
+
+		if (!conn->session)
+		{
+			// stay down once we quit
+			if (!this->shallReconnect)
 			{
-				channel->joined = false;
+				continue;
 			}
 
-			// destroy session
-			irc_destroy_session(this->session);
-
-			// wait a while before reconnecting
-			if (RECONNECT_DELAY_S > 0)
+			if (chrono::system_clock::now() < conn->reconnectAt)
 			{
-				cout << NOTICE << "Reconnecting in " << RECONNECT_DELAY_S << " seconds..." << endl;
-				this_thread::sleep_for(chrono::seconds(RECONNECT_DELAY_S));
+				*deadline = MIN(*deadline, conn->reconnectAt);
+				continue;
+			}
 
-				if (this->asyncWorkerRunning)
-				{
-					cout << NOTICE << "Asynchronous worker still running, waiting for termination..." << endl;
-				}
+			if (!this->openSession(conn))
+			{
+				continue;
 			}
+		}
+		else if (!this->supervise(conn, deadline))
+		{
+			continue;
+		}
+
+		irc_add_select_descriptors(conn->session, in, out, maxfd);
+	}
+}
 
-			// make sure the worker is dead
-			if (this->asyncWorker && this->asyncWorker->joinable())
+void IRCClient::processDescriptors(fd_set *in, fd_set *out)
+{
+	for (connection_t *conn : this->connections)
+	{
+		if (!conn->session)
+		{
+			continue;
+		}
+
+		irc_process_select_descriptors(conn->session, in, out);
+
+		if (!irc_is_connected(conn->session))
+		{
+			this->handleDisconnect(conn);
+		}
+	}
+}
+
+bool IRCClient::finished()
+{
+	return this->done;
+}
+
+string IRCClient::getNetwork()
+{
+	return this->host;
+}
+
+string IRCClient::status()
+{
+	ostringstream stream;
+	string        joined;
+	unsigned int  numJoined = 0;
+
+	{
+		lock_guard<mutex> guard(this->channelLock);
+
+		for (channel_t *channel : this->channels)
+		{
+			if (channel->joined)
 			{
-				this->asyncWorker->join();
+				joined += " " + channel->name;
+				numJoined++;
 			}
 		}
-		else
+
+		stream << this->host << " connected=";
+
+		for (connection_t *conn : this->connections)
 		{
-			break;
+			stream << (conn->index > 0 ? "," : "") << conn->currentNick << ":" << (conn->connected ? 1 : 0);
 		}
+
+		stream << " channels=" << numJoined << "/" << this->channels.size() << joined;
+	}
+
+	return stream.str();
+}
+
+void IRCClient::forceRefresh()
+{
+	if (this->unvQuery)
+	{
+		UnvQuery *query = this->unvQuery;
+
+		// a sweep blocks for seconds, keep it off the event loop
+		this->worker->post([query]() { query->refresh(); });
+	}
+}
+
+void IRCClient::setMaster(string master, unsigned short port, unsigned short protocol)
+{
+	UnvQuery *query = this->unvQuery;
+
+	if (query)
+	{
+		this->worker->post([query, master, port, protocol]()
+		{
+			query->setMaster(master, port, protocol);
+		});
 	}
+}
 
-	// clean up
-	this->stopAsyncWorker();
+void IRCClient::flushCaches()
+{
+	{
+		lock_guard<mutex> guard(this->cacheLock);
+		this->responseCache.clear();
+	}
 
-	if (this->asyncWorker->joinable())
+	if (this->unvQuery)
 	{
-		this->asyncWorker->join();
+		this->unvQuery->invalidate();
 	}
 
-	if (this->session)
+	if (this->gitHubQuery)
 	{
-		irc_destroy_session(this->session);
+		this->gitHubQuery->flushCache();
 	}
 }
 
-void IRCClient::threadJoin()
+void IRCClient::internalJoin(connection_t *conn, string name, string password)
 {
-	eventWorker->join();
+	LOG(Log::LEVEL_INFO, OUTGOING << "Joining " << name << " as " << conn->currentNick << "...");
+
+	{
+		lock_guard<mutex> guard(this->sessionLock);
+		ERRCHK(conn, irc_cmd_join(conn->session, name.c_str(), password.empty() ? NULL : password.c_str()));
+	}
+
+	this->eventLoop->wake();
 }
 
-void IRCClient::commandLoop()
+void IRCClient::internalPart(connection_t *conn, string name)
 {
-	string command;
+	LOG(Log::LEVEL_INFO, OUTGOING << "Leaving " << name << " as " << conn->currentNick << "...");
+
+	{
+		lock_guard<mutex> guard(this->sessionLock);
+		ERRCHK(conn, irc_cmd_part(conn->session, name.c_str()));
+	}
+
+	this->eventLoop->wake();
+}
 
-	cout << NOTICE << "Receiving commands on console." << endl;
+void IRCClient::joinAll(connection_t *conn)
+{
+	vector<channel_t *> keyed, open;
+	string              names, keys;
 
-	while (true)
 	{
-		getline(cin, command);
+		lock_guard<mutex> guard(this->channelLock);
 
-		cout << COMMAND << command << endl;
+		for (channel_t *channel : this->channels)
+		{
+			if (channel->owner == conn && !channel->joined)
+			{
+				(channel->password.empty() ? open : keyed).push_back(channel);
+			}
+		}
 
-		if (command == "quit")
+		// channels with a key have to come first, as keys are matched by position
+		keyed.insert(keyed.end(), open.begin(), open.end());
+
+		for (channel_t *channel : keyed)
 		{
-			this->quit("Shut down via console.");
+			string moreNames = names + (names.empty() ? "" : ",") + channel->name;
+			string moreKeys  = keys + (keys.empty() ? "" : ",") + channel->password;
 
-			break;
+			if (channel->password.empty())
+			{
+				moreKeys = keys;
+			}
+
+			// send what we have if "JOIN <names> <keys>\r\n" would get too long
+			if (!names.empty() && strlen("JOIN  \r\n") + moreNames.size() + moreKeys.size() > IRC_LINE_MAX)
+			{
+				this->internalJoin(conn, names, keys);
+
+				names = channel->name;
+				keys  = channel->password;
+			}
+			else
+			{
+				names = moreNames;
+				keys  = moreKeys;
+			}
+		}
+	}
+
+	if (!names.empty())
+	{
+		this->internalJoin(conn, names, keys);
+	}
+}
+
+uint32_t IRCClient::ringHash(const string &key)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+
+	for (unsigned char c : key)
+	{
+		hash ^= c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+IRCClient::connection_t *IRCClient::ownerOf(const string &channel)
+{
+	auto start = this->ring.lower_bound(IRCClient::ringHash(channel));
+
+	if (start == this->ring.end())
+	{
+		start = this->ring.begin();
+	}
+
+	// walk the ring past connections that were lost, so that only their channels move; one that
+	// hasn't been up yet keeps its channels, or the first connection would join them all at startup
+	auto it = start;
+
+	do
+	{
+		if (it->second->connected || !it->second->lost)
+		{
+			return it->second;
+		}
+
+		if (++it == this->ring.end())
+		{
+			it = this->ring.begin();
 		}
-		else if (command == "reconnect")
+	}
+	while (it != start);
+
+	return start->second;
+}
+
+IRCClient::connection_t *IRCClient::route(const string &target)
+{
+	lock_guard<mutex> guard(this->channelLock);
+
+	for (channel_t *channel : this->channels)
+	{
+		if (channel->name == target)
 		{
-			this->reconnect("Reconnect via console.");
+			return channel->owner;
 		}
-		else if (command == "help")
+	}
+
+	// not one of our channels, any connection will do
+	for (connection_t *conn : this->connections)
+	{
+		if (conn->connected)
 		{
-			cout << ANSWER << "Available commands: help, reconnect, quit." << endl;
+			return conn;
 		}
 	}
 
-	this->threadJoin();
+	return this->connections.front();
 }
 
-void IRCClient::internalJoin(string name, string password)
+bool IRCClient::owns(connection_t *conn, const string &channel)
 {
-	cout << OUTGOING << "Joining " << name << "..." << endl;
+	lock_guard<mutex> guard(this->channelLock);
 
-	ERRCHK(irc_cmd_join(this->session, name.c_str(), password.empty() ? NULL : password.c_str()));
+	for (channel_t *cursor : this->channels)
+	{
+		if (cursor->name == channel)
+		{
+			return cursor->owner == conn;
+		}
+	}
+
+	return false;
+}
+
+void IRCClient::rebalance(connection_t *joining)
+{
+	set<connection_t *> gained;
+
+	if (joining)
+	{
+		gained.insert(joining);
+	}
+
+	{
+		lock_guard<mutex> guard(this->channelLock);
+
+		for (channel_t *channel : this->channels)
+		{
+			connection_t *owner = this->ownerOf(channel->name);
+
+			if (owner == channel->owner)
+			{
+				continue;
+			}
+
+			if (channel->owner->connected && channel->joined)
+			{
+				this->internalPart(channel->owner, channel->name);
+			}
+
+			channel->owner  = owner;
+			channel->joined = false;
+
+			if (owner->connected)
+			{
+				gained.insert(owner);
+			}
+		}
+	}
+
+	for (connection_t *conn : gained)
+	{
+		this->joinAll(conn);
+	}
 }
 
 void IRCClient::join(string name, string password, int broadcastFlags)
 {
-	channel_t *channel;
+	channel_t    *channel = NULL;
+	connection_t *owner;
+	bool         joined;
+
+	{
+		lock_guard<mutex> guard(this->channelLock);
+
+		// update a known channel instead of adding it twice
+		for (channel_t *cursor : this->channels)
+		{
+			if (cursor->name == name)
+			{
+				channel = cursor;
+				break;
+			}
+		}
 
-	channel = new channel_t;
-	channel->name           = name;
-	channel->password       = password;
-	channel->broadcastFlags = broadcastFlags;
-	channel->joined         = false;
+		if (!channel)
+		{
+			channel = new channel_t;
+			channel->name   = name;
+			channel->joined = false;
+			channel->owner  = this->ownerOf(name);
+
+			this->channels.insert(channel);
+		}
 
-	this->channels.insert(channel);
+		channel->password       = password;
+		channel->broadcastFlags = broadcastFlags;
+
+		owner  = channel->owner;
+		joined = channel->joined;
+	}
 
 	// if we are connected, try to join, otherwise handleConnect will do so
-	if (this->connected)
+	if (owner->connected && !joined)
 	{
-		this->internalJoin(name, password);
+		this->internalJoin(owner, name, password);
 	}
 }
 
 void IRCClient::leave(std::string name)
 {
-	channel_t *target = NULL;
+	lock_guard<mutex> guard(this->channelLock);
+	channel_t         *target = NULL;
 
 	// find channel in set
 	for (channel_t *cursor : channels)
@@ -445,11 +1120,9 @@ void IRCClient::leave(std::string name)
 	if (target)
 	{
 		// if we are in the channel, try to leave, otherwise we'll have to wait for a disconnect
-		if (this->connected && target->joined)
+		if (target->owner->connected && target->joined)
 		{
-			cout << OUTGOING << "Leaving " << name << "..." << endl;
-
-			ERRCHK(irc_cmd_part(this->session, name.c_str()));
+			this->internalPart(target->owner, name);
 		}
 
 		delete target;
@@ -458,43 +1131,166 @@ void IRCClient::leave(std::string name)
 	}
 }
 
-void IRCClient::msg(string target, string text)
+size_t IRCClient::lineBudget(connection_t *conn, const string &target)
 {
-	char *colored = irc_color_convert_to_mirc(text.c_str());
-	istringstream stream(colored);
-	string        line;
+	size_t prefix, command;
+
+	// the server relays our lines as ":<nick>!~<user>@<host> PRIVMSG <target> :<text>\r\n", where
+	// the user name equals the nick and the host is unknown to us
+	prefix  = strlen(":!~@ ") + 2 * conn->currentNick.size() + IRC_HOST_MAX;
+	command = strlen("PRIVMSG  :\r\n") + target.size();
 
-	if (text.empty())
+	return prefix + command < IRC_LINE_MAX ? IRC_LINE_MAX - prefix - command : 0;
+}
+
+void IRCClient::sendLines(connection_t *conn, const string &targets, const vector<string> &lines)
+{
 	{
-		return;
+		lock_guard<mutex> guard(this->sessionLock);
+
+		// the connection went down since the lines were prepared
+		if (!conn->session)
+		{
+			return;
+		}
+
+		for (const string &line : lines)
+		{
+			irc_cmd_msg(conn->session, targets.c_str(), line.c_str());
+		}
 	}
 
-	while(getline(stream, line, '\n'))
+	linesSent.inc(lines.size());
+
+	this->eventLoop->wake();
+}
+
+void IRCClient::msg(string target, string text)
+{
+	this->msg(target, IRCMessage(text));
+}
+
+void IRCClient::msg(string target, const IRCMessage &message)
+{
+	if (message.empty())
 	{
-		irc_cmd_msg(this->session, target.c_str(), line.c_str());
+		return;
 	}
 
-	free(colored);
+	connection_t *conn = this->route(target);
+
+	this->sendLines(conn, target, message.render(this->lineBudget(conn, target)));
 }
 
 void IRCClient::broadcast(string text, int flags)
 {
-	for (channel_t *channel : this->channels)
+	this->broadcast(IRCMessage(text), flags);
+}
+
+void IRCClient::broadcast(const IRCMessage &message, int flags)
+{
+	map<connection_t *, vector<string> > recipients;
+
+	if (message.empty())
 	{
-		if (channel->joined && (channel->broadcastFlags & flags))
+		return;
+	}
+
+	broadcasts.inc();
+
+	// copy the names, channels may be left while we send
+	{
+		lock_guard<mutex> guard(this->channelLock);
+
+		for (channel_t *channel : this->channels)
 		{
-			this->msg(channel->name, text);
+			if (channel->joined && (channel->broadcastFlags & flags))
+			{
+				recipients[channel->owner].push_back(channel->name);
+			}
+			else if (!channel->joined && (channel->broadcastFlags & flags & BROADCAST_EVENT))
+			{
+				// the calendar doesn't wait for us, so keep what it announces while we rejoin
+				if (channel->missed.size() == MISSED_EVENTS_MAX)
+				{
+					LOG_LIMITED(Log::LEVEL_INFO, "missed " + channel->name, NOTICE << "Dropping an announcement for "
+					            << channel->name << ", too many came in while it wasn't joined.");
+
+					channel->missed.erase(channel->missed.begin());
+				}
+
+				channel->missed.push_back(make_pair(chrono::system_clock::now(), message));
+			}
+		}
+	}
+
+	// every connection sends to its own channels, the event loop flushes them all at once
+	for (auto &entry : recipients)
+	{
+		connection_t   *conn = entry.first;
+		vector<string> lines;
+		string         targets, longestName;
+		unsigned int   numTargets = 0;
+		size_t         overhead, maxTargetsLen, maxLineLen = 0;
+
+		for (const string &name : entry.second)
+		{
+			if (name.size() > longestName.size())
+			{
+				longestName = name;
+			}
+		}
+
+		// encode once for the channel with the smallest budget
+		lines = message.render(this->lineBudget(conn, longestName));
+
+		for (const string &line : lines)
+		{
+			maxLineLen = MAX(maxLineLen, line.size());
+		}
+
+		// room left for the target list in a "PRIVMSG <targets> :<line>\r\n" command, if there is
+		// none left every channel gets its own command
+		overhead      = strlen("PRIVMSG  :\r\n") + maxLineLen;
+		maxTargetsLen = overhead < IRC_LINE_MAX ? IRC_LINE_MAX - overhead : 0;
+
+		for (const string &name : entry.second)
+		{
+			if (numTargets > 0 && (numTargets == conn->maxTargets ||
+			                       targets.size() + 1 + name.size() > maxTargetsLen))
+			{
+				this->sendLines(conn, targets, lines);
+
+				targets.clear();
+				numTargets = 0;
+			}
+
+			targets += (numTargets > 0 ? "," : "") + name;
+			numTargets++;
+		}
+
+		if (numTargets > 0)
+		{
+			this->sendLines(conn, targets, lines);
 		}
 	}
 }
 
 void IRCClient::reconnect(string reason)
 {
-	if (this->connected)
+	for (connection_t *conn : this->connections)
 	{
-		cout << OUTGOING << "Disconnecting..." << endl;
+		if (conn->connected)
+		{
+			LOG(Log::LEVEL_INFO, OUTGOING << "Disconnecting " << conn->currentNick << "...");
+
+			{
+				lock_guard<mutex> guard(this->sessionLock);
+				ERRCHK(conn, irc_cmd_quit(conn->session, reason.c_str()));
+			}
 
-		ERRCHK(irc_cmd_quit(this->session, reason.c_str()));
+			this->eventLoop->wake();
+		}
 	}
 }
 
@@ -503,6 +1299,12 @@ void IRCClient::quit(string reason)
 	this->shallReconnect = false;
 
 	this->reconnect(reason);
+
+	// nothing to wait for if no connection is up
+	if (!this->anyConnected())
+	{
+		this->done = true;
+	}
 }
 
 void IRCClient::addUnvQuery(UnvQuery *instance)
@@ -513,6 +1315,12 @@ void IRCClient::addUnvQuery(UnvQuery *instance)
 void IRCClient::addCalendar(Calendar *instance)
 {
 	this->calendar = instance;
+
+	// the calendar is shared by all networks and announces its events by itself
+	this->calendar->subscribe([this](const IRCMessage &message)
+	{
+		this->broadcast(message, BROADCAST_EVENT);
+	});
 }
 
 void IRCClient::addGitHubQuery(GitHubQuery *instance)
@@ -529,86 +1337,142 @@ if(!this->x) \
 
 void IRCClient::cmdList(string channel)
 {
-	string response;
+	string       response, pending, summary;
+	unsigned int pendingServers = 0;
+	Histogram::timepoint_t start = Histogram::now();
 	CHECKMODULE(unvQuery)
-	response = this->unvQuery->printActiveServers();
-	if (response.empty()) response = RESP_NOPLAYERS;
-	this->msg(channel, response);
+
+	// send the first servers early, but pack them so that a busy list costs few lines
+	summary = this->unvQuery->streamActiveServers([this, &channel, &response, &pending, &pendingServers](const string &line)
+	{
+		pending  += line;
+		response += line;
+
+		if (++pendingServers == LIST_PACK_SERVERS)
+		{
+			this->msg(channel, IRCMessage(pending, true));
+			pending.clear();
+			pendingServers = 0;
+		}
+	}, LIST_MAX_SERVERS);
+
+	if (summary.empty())
+	{
+		summary = RESP_NOPLAYERS;
+	}
+
+	this->msg(channel, IRCMessage(pending + summary, true));
+	this->cacheResponse(channel, "!list", response + summary);
+	listDuration.observeSince(start);
 }
 
 void IRCClient::cmdTop(string channel)
 {
 	string response;
+	Histogram::timepoint_t start = Histogram::now();
 	CHECKMODULE(unvQuery)
 	response = this->unvQuery->checkPeekActivity(0, 0);
 	if (response.empty()) response = RESP_NOPLAYERS;
+	this->cacheResponse(channel, "!top", response);
 	this->msg(channel, response);
+	topDuration.observeSince(start);
+}
+
+void IRCClient::cmdServer(string channel, string server)
+{
+	string response;
+	Histogram::timepoint_t start = Histogram::now();
+	CHECKMODULE(unvQuery)
+	response = this->unvQuery->printServerDetails(server);
+	this->msg(channel, response);
+	serverDuration.observeSince(start);
 }
 
 void IRCClient::cmdEvents(string channel)
 {
 	string response;
+	Histogram::timepoint_t start = Histogram::now();
 	CHECKMODULE(calendar)
 	response = this->calendar->listEvents();
 	this->msg(channel, response);
+	eventsDuration.observeSince(start);
+}
+
+void IRCClient::cmdAddEvent(string channel, string definition, bool allowed)
+{
+	CHECKMODULE(calendar)
+
+	if (!allowed)
+	{
+		this->msg(channel, RESP_NOTALLOWED);
+	}
+	else if (this->calendar->addEvent(definition, true))
+	{
+		this->msg(channel, RESP_EVENTADDED);
+	}
+	else
+	{
+		this->msg(channel, RESP_BADEVENT);
+	}
 }
 
 void IRCClient::cmdIssue(string channel, int issue, bool verbose)
 {
-	string response;
+	Histogram::timepoint_t start = Histogram::now();
 	CHECKMODULE(gitHubQuery)
-	response = this->gitHubQuery->linkIssue(issue, verbose);
-	this->msg(channel, response);
+	this->gitHubQuery->linkIssue(issue, verbose, [this, channel, start](const string &response)
+	{
+		this->msg(channel, response);
+		issueDuration.observeSince(start);
+	});
 }
 
 void IRCClient::cmdCommit(string channel, string hash, bool verbose)
 {
-	string response;
+	Histogram::timepoint_t start = Histogram::now();
 	CHECKMODULE(gitHubQuery)
-	response = this->gitHubQuery->linkCommit(hash, verbose);
-	this->msg(channel, response);
+	this->gitHubQuery->linkCommit(hash, verbose, [this, channel, start](const string &response)
+	{
+		this->msg(channel, response);
+		commitDuration.observeSince(start);
+	});
 }
 
-void IRCClient::asyncWork()
+void IRCClient::checkPeek()
 {
-	this->asyncWorkerRunning = true;
+	this->broadcast(this->unvQuery->checkPeekActivity(PEEK_PERIOD_S, PEEK_MIN_PLAYERS), BROADCAST_PLAYERPEEK);
 
-	cout << NOTICE << "Worker started." << endl;
+	lock_guard<mutex> guard(this->timerLock);
 
-	while(asyncWorkerRun)
+	if (this->timersActive)
 	{
-		if(this->unvQuery)
-		{
-			this->broadcast(this->unvQuery->checkPeekActivity(60 * 60 * 6, 1), BROADCAST_PLAYERPEEK);
-		}
-
-		if(this->calendar)
-		{
-			this->broadcast(this->calendar->pumpEvents(), BROADCAST_EVENT);
-		}
-
-		this_thread::sleep_for(chrono::milliseconds(ASYNC_WORKER_PERIOD_MS));
+		this->peekTimer = this->worker->schedule(chrono::seconds(PEEK_CHECK_PERIOD_S),
+		                                            bind(&IRCClient::checkPeek, this));
 	}
-
-	cout << NOTICE << "Worker stopped." << endl;
-
-	this->asyncWorkerRunning = false;
 }
 
-void IRCClient::startAsyncWorker()
+void IRCClient::startTimers()
 {
-	if (!this->asyncWorkerRun)
+	lock_guard<mutex> guard(this->timerLock);
+
+	if (this->timersActive)
 	{
-		this->asyncWorkerRun = true;
+		return;
+	}
+
+	this->timersActive = true;
 
-		this->asyncWorker = new thread(&IRCClient::asyncWork, this);
+	if (this->unvQuery)
+	{
+		this->peekTimer = this->worker->post(bind(&IRCClient::checkPeek, this));
 	}
 }
 
-void IRCClient::stopAsyncWorker()
+void IRCClient::stopTimers()
 {
-	if (this->asyncWorkerRun)
-	{
-		this->asyncWorkerRun = false;
-	}
+	lock_guard<mutex> guard(this->timerLock);
+
+	this->timersActive = false;
+
+	this->worker->cancel(this->peekTimer);
 }
@@ -22,8 +22,13 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef IRCCLIENT_H
 #define IRCCLIENT_H
 
-#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <random>
 #include <set>
+#include <map>
+#include <vector>
 
 #include <libircclient/libircclient.h>
 
@@ -31,9 +36,52 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #include "unvquery.h"
 #include "calendar.h"
 #include "github.h"
+#include "scheduler.h"
+#include "ircmessage.h"
+#include "log.h"
+#include "ratelimit.h"
+#include "linkscan.h"
 
-#define ASYNC_WORKER_PERIOD_MS 1000
+class EventLoop;
+class Gauge;
+
+#define PEEK_CHECK_PERIOD_S    CHECKPEEKACTIVITY_STATUSPERIOD
+
+// A player count is broadcast if no higher one was seen in this period
+#define PEEK_PERIOD_S          (60 * 60 * 6)
+#define PEEK_MIN_PLAYERS       1
+
+// Maximum number of servers listed by !list, sent packed in groups as they answer
+#define LIST_MAX_SERVERS       8
+#define LIST_PACK_SERVERS      4
+
+// Connection supervision: the first reconnect waits RECONNECT_DELAY_S, every further attempt
+// doubles the delay up to RECONNECT_DELAY_MAX_S, with up to half of it taken off at random
+#define PING_PERIOD_S          60
+#define LAG_MAX_S              90
 #define RECONNECT_DELAY_S      5
+#define RECONNECT_DELAY_MAX_S  300
+
+// Points per connection on the ring that assigns channels to connections
+#define CONNECTION_VNODES      64
+
+// Rate limits for expensive commands: a burst of requests, then one more per period
+#define RATELIMIT_USER_BURST       3
+#define RATELIMIT_USER_PERIOD_S    30
+#define RATELIMIT_CHANNEL_BURST    6
+#define RATELIMIT_CHANNEL_PERIOD_S 15
+#define RATELIMIT_CACHE_S          60
+
+// Rate limiting categories, links detected in chat have their own so that talking about commits
+// doesn't use up the tokens for !issue and !commit
+#define RATELIMIT_QUERY            "query"
+#define RATELIMIT_LOOKUP           "lookup"
+#define RATELIMIT_PASSIVE          "passive"
+
+// Protocol limits
+#define IRC_LINE_MAX           512
+#define IRC_HOST_MAX           63
+#define RPL_ISUPPORT           5
 
 #define HANDLER_NUMERIC (irc_session_t *session, \
                          unsigned int  event, \
@@ -53,6 +101,13 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #define RESP_MISSINGMODULE "Can't do that, don't have the necessary module."
 #define RESP_NOPLAYERS     "No one is playing. :("
 #define RESP_NOEVENTS      "No upcoming events."
+#define RESP_NOTALLOWED    "You may not do that."
+#define RESP_EVENTADDED    "Event added."
+#define RESP_BADEVENT      "Usage: !event add <unix time> <warn seconds> <warn count> <period> <description>, in the future."
+
+// Announcements kept for a channel while it isn't joined, and how long they stay worth sending
+#define MISSED_EVENTS_MAX      4
+#define MISSED_EVENTS_MAX_S    (60 * 15)
 
 // Broadcast flags
 #define BROADCAST_ALL        -1
@@ -60,20 +115,26 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #define BROADCAST_EVENT      0b0001
 #define BROADCAST_PLAYERPEEK 0b0010
 
-#define ERRCHK(cmd)      if(cmd) printIRCSessionError()
-#define CMDOK            cout << ANSWER << "OK." << endl
+#define ERRCHK(conn, cmd) if(cmd) printIRCSessionError(conn)
 
 class IRCClient
 {
 public:
 
+	typedef std::chrono::time_point<std::chrono::system_clock> timepoint_t;
+
 	/**
-	 * @param host     Server hostname
-	 * @param port     Server post
-	 * @param password Server password
-	 * @param nick     Prefered nickname
+	 * @param eventLoop Event loop that drives the connection
+	 * @param worker    Executor for blocking module work and the periodic checks, kept apart from
+	 *                  the timer service and from other clients so that slow queries delay no one else
+	 * @param host      Server hostname
+	 * @param port      Server post
+	 * @param password  Server password
+	 * @param nick      Prefered nickname, further connections append their number
+	 * @param numConnections Number of connections that the channels are spread over
 	 */
-	IRCClient(std::string host, unsigned short port, std::string password, std::string nick);
+	IRCClient(EventLoop *eventLoop, Scheduler *worker, std::string host, unsigned short port, std::string password, std::string nick,
+	          unsigned int numConnections = 1);
 
 	/**
 	 * @brief Adds a UnvQuery instance that is used to provide server browser functionality.
@@ -83,18 +144,18 @@ public:
 
 	/**
 	 * @brief Adds a Calendar isntance that is used to announce relevant dates.
-	 * @param instance A Calendar instance
+	 * @param instance A Calendar instance, which may be shared with other clients
 	 */
 	void addCalendar(Calendar *instance);
 
 	/**
 	 * @brief Adds a GitHubQuery isntance that is used to lookup commits and issues.
-	 * @param instance A GitHubQuery instance
+	 * @param instance A GitHubQuery instance, which may be shared with other clients
 	 */
 	void addGitHubQuery(GitHubQuery *instance);
 
 	/**
-	 * @brief Adds a channel, it will be automatically (re)joined.
+	 * @brief Adds a channel, it will be automatically (re)joined. Updates a known channel.
 	 * @param channel  Channel name
 	 * @param password Channel password
 	 */
@@ -113,12 +174,26 @@ public:
 	 */
 	void msg(std::string channel, std::string text);
 
+	/**
+	 * @brief Send an already encoded message to a channel.
+	 * @param channel Channel name
+	 * @param message Message
+	 */
+	void msg(std::string channel, const IRCMessage &message);
+
 	/**
 	 * @brief Send a text to all channels. Supports multiline.
 	 * @param text Text
 	 */
 	void broadcast(std::string text, int flags);
 
+	/**
+	 * @brief Send an already encoded message to all channels. Uses multi-target PRIVMSG if the
+	 *        server supports it.
+	 * @param message Message
+	 */
+	void broadcast(const IRCMessage &message, int flags);
+
 	/**
 	 * @brief Reconnects to the IRC network.
 	 * @param reason Quit message
@@ -132,33 +207,110 @@ public:
 	void quit(std::string reason);
 
 	/**
-	 * @brief Joins the main loop thread.
+	 * @brief Adds the session's descriptors to a select set, (re)connecting first if it is time to.
+	 *        Called by the event loop.
+	 * @param deadline Lowered to the time of the next reconnect attempt, if one is pending.
+	 */
+	void addDescriptors(fd_set *in, fd_set *out, int *maxfd, timepoint_t *deadline);
+
+	/**
+	 * @brief Processes select results for the session. Called by the event loop.
+	 */
+	void processDescriptors(fd_set *in, fd_set *out);
+
+	/**
+	 * @return Whether the client has quit and will not reconnect.
 	 */
-	void threadJoin();
+	bool finished();
 
 	/**
-	 * @brief Receives commands on standard input in a loop.
+	 * @return The network's hostname, used to address the client.
 	 */
-	void commandLoop();
+	std::string getNetwork();
+
+	/**
+	 * @return A single line summarizing connection state and channels.
+	 */
+	std::string status();
+
+	/**
+	 * @brief Queries the game servers again right away instead of waiting for the next command.
+	 */
+	void forceRefresh();
+
+	/**
+	 * @brief Points the UnvQuery instance to another master server on the worker thread.
+	 */
+	void setMaster(std::string master, unsigned short port, unsigned short protocol);
+
+	/**
+	 * @brief Drops cached command responses and GitHub lookups and makes the next command query the
+	 *        game servers.
+	 */
+	void flushCaches();
 
 private:
 
+	// a single session with the network, channels are spread over all of them
+	typedef struct connection_s
+	{
+		IRCClient     *client;
+		unsigned int  index;
+		irc_session_t *session;
+		std::string   preferedNick;
+		std::string   currentNick;
+		bool          connected;
+		bool          lost;
+		unsigned int  maxTargets;
+		timepoint_t   reconnectAt;
+		unsigned int  reconnectAttempts;
+		timepoint_t   nextPing;
+		timepoint_t   pingSentAt;
+		bool          awaitingPong;
+		Gauge         *lag;
+	} connection_t;
+
 	typedef struct channel_s
 	{
-		std::string name;
-		std::string password;
-		bool        joined;
-		int         broadcastFlags;
+		std::string  name;
+		std::string  password;
+		bool         joined;
+		int          broadcastFlags;
+		connection_t *owner;
+
+		// announcements that came while the channel wasn't joined
+		std::vector<std::pair<timepoint_t, IRCMessage> > missed;
 	} channel_t;
 
 	// system
 	irc_callbacks_t callbacks;
-	irc_session_t   *session;
-	std::thread     *eventWorker;
-	std::thread     *asyncWorker;
-	bool            asyncWorkerRun;
-	bool            asyncWorkerRunning;
+	std::mutex      sessionLock;
+	EventLoop       *eventLoop;
 	bool            shallReconnect;
+	bool            done;
+
+	// supervision
+	timepoint_t     disconnectedAt;
+	bool            rejoining;
+	std::mt19937    random;
+
+	// timers
+	Scheduler           *worker;
+	Scheduler::handle_t peekTimer;
+	bool                timersActive;
+	std::mutex          timerLock;
+
+	// rate limiting
+	typedef struct cachedResponse_s
+	{
+		std::string response;
+		timepoint_t time;
+	} cachedResponse_t;
+
+	RateLimiter     userLimiter;
+	RateLimiter     channelLimiter;
+	std::map<std::string, cachedResponse_t> responseCache;
+	std::mutex      cacheLock;
 
 	// modules and tools
 	UnvQuery        *unvQuery;
@@ -168,14 +320,22 @@ private:
 	// context data
 	std::string     host;
 	std::string     password;
-	std::string     preferedNick;
-	std::string     currentNick;
 	unsigned short  port;
-	bool            connected;
 	std::set<channel_t *> channels;
+	std::mutex      channelLock;
+
+	// connections and the ring that assigns channels to them
+	std::vector<connection_t *>        connections;
+	std::map<uint32_t, connection_t *> ring;
+
+	// retrieves the connection from the C library's session "object"
+	static connection_t *connectionFromSession(irc_session_t *session);
+
+	// position of a key on the ring
+	static uint32_t ringHash(const std::string &key);
 
-	// retrieves the class instance from the C library's session "object"
-	static IRCClient *instanceFromSession(irc_session_t *session);
+	// extracts the nick from a nick!user@host origin
+	static std::string nickFromOrigin(const char *origin);
 
 	// event handlers
 	static void handleNumeric HANDLER_NUMERIC;
@@ -183,23 +343,43 @@ private:
 	static void handleJoin    HANDLER;
 	static void handleChannel HANDLER;
 	static void handleKick    HANDLER;
+	static void handleUnknown HANDLER;
 
 	// user commands
 	void cmdList(std::string channel);
 	void cmdTop(std::string channel);
+	void cmdServer(std::string channel, std::string server);
 	void cmdEvents(std::string channel);
+	void cmdAddEvent(std::string channel, std::string definition, bool allowed);
 	void cmdIssue(std::string channel, int issue, bool verbose);
 	void cmdCommit(std::string channel, std::string commit, bool verbose);
 
 	// helpers
-	void printIRCSessionError();
-	int  connectToServer();
-	void takeNextNick();
-	void mainLoop();
-	void internalJoin(std::string name, std::string password);
-	void asyncWork();
-	void startAsyncWorker();
-	void stopAsyncWorker();
+	void printIRCSessionError(connection_t *conn);
+	bool rateLimit(const char *origin, std::string channel, std::string category, std::string command);
+	void cacheResponse(std::string channel, std::string command, std::string response);
+	void parseISupport(connection_t *conn, const char **params, unsigned int count);
+	size_t lineBudget(connection_t *conn, const std::string &target);
+	void sendLines(connection_t *conn, const std::string &targets, const std::vector<std::string> &lines);
+	int  connectToServer(connection_t *conn);
+	void takeNextNick(connection_t *conn);
+	bool openSession(connection_t *conn);
+	void closeSession(connection_t *conn);
+	void handleDisconnect(connection_t *conn);
+	void scheduleReconnect(connection_t *conn);
+	bool supervise(connection_t *conn, timepoint_t *deadline);
+	bool anyConnected();
+	void internalJoin(connection_t *conn, std::string name, std::string password);
+	void internalPart(connection_t *conn, std::string name);
+	void joinAll(connection_t *conn);
+	connection_t *ownerOf(const std::string &channel);
+	connection_t *route(const std::string &target);
+	bool owns(connection_t *conn, const std::string &channel);
+	void rebalance(connection_t *joining = NULL);
+	void checkPeek();
+	void scanLinks(const char *origin, std::string channel, const char *msg);
+	void startTimers();
+	void stopTimers();
 };
 
 #endif // IRCCLIENT_H
@@ -0,0 +1,176 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <sstream>
+
+#include <libircclient/libircclient.h>
+
+#include "ircmessage.h"
+
+using namespace std;
+
+IRCMessage::IRCMessage(const string &text, bool packed)
+{
+	this->packed = packed;
+
+	if (text.empty())
+	{
+		return;
+	}
+
+	char          *colored = irc_color_convert_to_mirc(text.c_str());
+	istringstream stream(colored);
+	string        line;
+
+	while (getline(stream, line, '\n'))
+	{
+		if (line.empty())
+		{
+			continue;
+		}
+
+		this->lines.push_back(line);
+	}
+
+	free(colored);
+}
+
+const vector<string> &IRCMessage::getLines() const
+{
+	return this->lines;
+}
+
+bool IRCMessage::empty() const
+{
+	return this->lines.empty();
+}
+
+size_t IRCMessage::tokenLength(const string &line, size_t pos)
+{
+	unsigned char c   = line[pos];
+	size_t        len = 1;
+
+	// color code with up to two digits for foreground and, after a comma, background
+	if (c == '\x03')
+	{
+		while (len < 3 && pos + len < line.size() && isdigit(line[pos + len])) len++;
+
+		if (pos + len + 1 < line.size() && line[pos + len] == ',' && isdigit(line[pos + len + 1]))
+		{
+			size_t bg = len + 1;
+			while (bg < len + 3 && pos + bg < line.size() && isdigit(line[pos + bg])) bg++;
+			len = bg;
+		}
+	}
+
+	// UTF-8 sequence
+	else if (c >= 0xF0) len = 4;
+	else if (c >= 0xE0) len = 3;
+	else if (c >= 0xC0) len = 2;
+
+	return MIN(len, line.size() - pos);
+}
+
+size_t IRCMessage::findCut(const string &line, size_t budget)
+{
+	size_t pos = 0, lastSafe = 0, lastSpace = 0, len;
+
+	while (pos < line.size())
+	{
+		len = tokenLength(line, pos);
+
+		if (pos + len > budget)
+		{
+			break;
+		}
+
+		pos += len;
+		lastSafe = pos;
+
+		if (line[pos - 1] == ' ')
+		{
+			lastSpace = pos;
+		}
+	}
+
+	// prefer cutting at a word boundary unless that wastes more than half of the line
+	if (lastSpace > budget / 2)
+	{
+		return lastSpace;
+	}
+
+	return lastSafe > 0 ? lastSafe : MIN(budget, line.size());
+}
+
+vector<string> IRCMessage::render(size_t budget) const
+{
+	vector<string> result;
+	string         current;
+	size_t         cut;
+
+	budget = MAX(budget, (size_t)16);
+
+	for (string line : this->lines)
+	{
+		while (!line.empty())
+		{
+			string piece;
+
+			// split lines that don't fit on their own
+			if (line.size() > budget)
+			{
+				cut   = findCut(line, budget);
+				piece = line.substr(0, cut);
+				line.erase(0, line.find_first_not_of(' ', cut));
+			}
+			else
+			{
+				piece = line;
+				line.clear();
+			}
+
+			if (this->packed && !current.empty() &&
+			    current.size() + strlen(PACK_SEPARATOR) + piece.size() <= budget)
+			{
+				current += PACK_SEPARATOR + piece;
+			}
+			else
+			{
+				if (!current.empty())
+				{
+					result.push_back(current);
+				}
+
+				current = piece;
+			}
+		}
+	}
+
+	if (!current.empty())
+	{
+		result.push_back(current);
+	}
+
+	return result;
+}
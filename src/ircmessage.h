@@ -0,0 +1,74 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef IRCMESSAGE_H
+#define IRCMESSAGE_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Seperates entries that were packed into one line
+#define PACK_SEPARATOR " | "
+
+/**
+ * @brief A message text that has been converted to mIRC color codes and split into lines once, so
+ *        that it can be sent to any number of targets without encoding it again.
+ *
+ * Before sending, the lines are fitted into the byte budget of a target: Lines that are too long
+ * are split without cutting color codes or UTF-8 sequences and, for packed messages, short lines
+ * are combined into as few lines as possible.
+ */
+class IRCMessage
+{
+public:
+
+	/**
+	 * @param text   Newline seperated text with BB style color codes
+	 * @param packed Whether lines may be combined into fewer lines when sent
+	 */
+	IRCMessage(const std::string &text, bool packed = false);
+
+	/**
+	 * @return The encoded, non-empty lines of the message.
+	 */
+	const std::vector<std::string> &getLines() const;
+
+	bool empty() const;
+
+	/**
+	 * @brief Fits the message into lines of a given size.
+	 * @param budget Maximum number of bytes per line
+	 * @return Lines that are no longer than the budget.
+	 */
+	std::vector<std::string> render(size_t budget) const;
+
+private:
+
+	std::vector<std::string> lines;
+	bool                     packed;
+
+	static size_t tokenLength(const std::string &line, size_t pos);
+	static size_t findCut(const std::string &line, size_t budget);
+};
+
+#endif // IRCMESSAGE_H
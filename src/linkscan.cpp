@@ -0,0 +1,190 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+
+#include "linkscan.h"
+
+using namespace std;
+
+// rows are states, columns are character classes: other, digit, hex letter, letter, pound sign
+const unsigned char LinkScanner::transitions[NUM_STATES][NUM_CLASSES] =
+{
+	/* SEPARATOR */ {STATE_SEPARATOR, STATE_HASH,  STATE_HASH, STATE_WORD, STATE_POUND},
+	/* POUND     */ {STATE_SEPARATOR, STATE_ISSUE, STATE_WORD, STATE_WORD, STATE_WORD },
+	/* ISSUE     */ {STATE_SEPARATOR, STATE_ISSUE, STATE_WORD, STATE_WORD, STATE_WORD },
+	/* HASH      */ {STATE_SEPARATOR, STATE_HASH,  STATE_HASH, STATE_WORD, STATE_WORD },
+	/* WORD      */ {STATE_SEPARATOR, STATE_WORD,  STATE_WORD, STATE_WORD, STATE_WORD }
+};
+
+LinkScanner::class_t LinkScanner::classify(unsigned char c)
+{
+	if (c >= '0' && c <= '9')                              return CLASS_DIGIT;
+	if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) return CLASS_HEXLETTER;
+	if ((c >= 'g' && c <= 'z') || (c >= 'G' && c <= 'Z')) return CLASS_LETTER;
+	if (c == '_' || c >= 0x80)                             return CLASS_LETTER;
+	if (c == '#')                                          return CLASS_POUND;
+
+	return CLASS_OTHER;
+}
+
+void LinkScanner::addIssue(result_t *result, const char *start, const char *end)
+{
+	unsigned int issue = 0;
+
+	if (end - start > LINKSCAN_ISSUE_DIGITS || result->numIssues == LINKSCAN_MAX)
+	{
+		return;
+	}
+
+	for (const char *c = start; c < end; c++)
+	{
+		issue = 10 * issue + (*c - '0');
+	}
+
+	for (unsigned int i = 0; i < result->numIssues; i++)
+	{
+		if (result->issues[i] == issue)
+		{
+			return;
+		}
+	}
+
+	result->issues[result->numIssues++] = issue;
+}
+
+void LinkScanner::addCommit(result_t *result, const char *start, const char *end)
+{
+	size_t length = end - start;
+
+	if (length < LINKSCAN_HASH_MIN || length > LINKSCAN_HASH_MAX || result->numCommits == LINKSCAN_MAX)
+	{
+		return;
+	}
+
+	for (unsigned int i = 0; i < result->numCommits; i++)
+	{
+		if (result->commits[i].length == length && strncasecmp(result->commits[i].start, start, length) == 0)
+		{
+			return;
+		}
+	}
+
+	result->commits[result->numCommits++] = {start, length};
+}
+
+void LinkScanner::scan(const char *msg, result_t *result)
+{
+	state_t    state = STATE_SEPARATOR, next;
+	const char *tokenStart = msg;
+
+	result->numIssues  = 0;
+	result->numCommits = 0;
+
+	// the terminating null byte is processed as a separator
+	for (const char *c = msg; ; c++)
+	{
+		next = (state_t)LinkScanner::transitions[state][LinkScanner::classify(*c)];
+
+		if (next != state)
+		{
+			if (next == STATE_SEPARATOR)
+			{
+				if (state == STATE_ISSUE)
+				{
+					LinkScanner::addIssue(result, tokenStart, c);
+				}
+				else if (state == STATE_HASH)
+				{
+					LinkScanner::addCommit(result, tokenStart, c);
+				}
+			}
+			else if (next == STATE_HASH || next == STATE_ISSUE)
+			{
+				tokenStart = c;
+			}
+
+			state = next;
+		}
+
+		if (*c == '\0')
+		{
+			break;
+		}
+	}
+}
+
+BloomFilter::BloomFilter(size_t bits, unsigned int hashes)
+	: words((bits + 63) / 64, 0), bits(((bits + 63) / 64) * 64), hashes(hashes)
+{}
+
+uint64_t BloomFilter::hash(const char *data, size_t length, uint64_t seed)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL ^ seed;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+void BloomFilter::add(const char *data, size_t length)
+{
+	uint64_t a = BloomFilter::hash(data, length, 0);
+	uint64_t b = BloomFilter::hash(data, length, 0x9e3779b97f4a7c15ULL) | 1;
+
+	// derive all bit positions from two hashes
+	for (unsigned int i = 0; i < this->hashes; i++)
+	{
+		uint64_t bit = (a + i * b) % this->bits;
+
+		this->words[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+bool BloomFilter::mightContain(const char *data, size_t length) const
+{
+	uint64_t a = BloomFilter::hash(data, length, 0);
+	uint64_t b = BloomFilter::hash(data, length, 0x9e3779b97f4a7c15ULL) | 1;
+
+	for (unsigned int i = 0; i < this->hashes; i++)
+	{
+		uint64_t bit = (a + i * b) % this->bits;
+
+		if (!(this->words[bit / 64] & (1ULL << (bit % 64))))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void BloomFilter::clear()
+{
+	fill(this->words.begin(), this->words.end(), 0);
+}
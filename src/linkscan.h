@@ -0,0 +1,133 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef LINKSCAN_H
+#define LINKSCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+// Maximum number of issues and commits reported per message
+#define LINKSCAN_MAX        3
+
+// Length bounds of commit hashes
+#define LINKSCAN_HASH_MIN   7
+#define LINKSCAN_HASH_MAX   40
+
+// Issue numbers with more digits are ignored
+#define LINKSCAN_ISSUE_DIGITS 9
+
+/**
+ * @brief Finds issue references like #123 and commit hashes in a message.
+ *
+ * A table driven automaton looks at every byte once and writes its findings into a fixed size
+ * result, so scanning doesn't allocate. Tokens have to stand on their own: #12a or a hash that is
+ * part of a longer word are not reported.
+ */
+class LinkScanner
+{
+public:
+
+	typedef struct commit_s
+	{
+		const char *start;
+		size_t     length;
+	} commit_t;
+
+	typedef struct result_s
+	{
+		unsigned int numIssues;
+		unsigned int issues[LINKSCAN_MAX];
+		unsigned int numCommits;
+		commit_t     commits[LINKSCAN_MAX];
+	} result_t;
+
+	/**
+	 * @brief Scans a message, duplicates are reported once.
+	 * @param msg    Null terminated message
+	 * @param result Receives the findings, commits point into msg
+	 */
+	static void scan(const char *msg, result_t *result);
+
+private:
+
+	typedef enum state_e
+	{
+		STATE_SEPARATOR,
+		STATE_POUND,
+		STATE_ISSUE,
+		STATE_HASH,
+		STATE_WORD,
+
+		NUM_STATES
+	} state_t;
+
+	typedef enum class_e
+	{
+		CLASS_OTHER,
+		CLASS_DIGIT,
+		CLASS_HEXLETTER,
+		CLASS_LETTER,
+		CLASS_POUND,
+
+		NUM_CLASSES
+	} class_t;
+
+	static const unsigned char transitions[NUM_STATES][NUM_CLASSES];
+
+	static class_t classify(unsigned char c);
+	static void    addIssue(result_t *result, const char *start, const char *end);
+	static void    addCommit(result_t *result, const char *start, const char *end);
+};
+
+/**
+ * @brief A fixed size Bloom filter over short strings.
+ *
+ * Answers whether a string was possibly added, false positives happen at a rate depending on the
+ * size and fill, false negatives never do.
+ */
+class BloomFilter
+{
+public:
+
+	/**
+	 * @param bits   Size of the filter in bits
+	 * @param hashes Number of bits set per string
+	 */
+	BloomFilter(size_t bits, unsigned int hashes);
+
+	void add(const char *data, size_t length);
+	bool mightContain(const char *data, size_t length) const;
+	void clear();
+
+private:
+
+	std::vector<uint64_t> words;
+	size_t                bits;
+	unsigned int          hashes;
+
+	static uint64_t hash(const char *data, size_t length, uint64_t seed);
+};
+
+#endif // LINKSCAN_H
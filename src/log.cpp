@@ -0,0 +1,296 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include <cstdio>
+#include <cstring>
+
+#include "log.h"
+
+using namespace std;
+
+atomic<int> Log::threshold(Log::LEVEL_DEBUG);
+
+Log::Log()
+{
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+	{
+		this->ring[i].sequence.store(i, memory_order_relaxed);
+	}
+
+	this->enqueuePos = 0;
+	this->dequeuePos = 0;
+	this->written    = 0;
+	this->dropped    = 0;
+	this->sleeping   = false;
+	this->run        = true;
+
+	this->flusher = new thread(&Log::work, this);
+}
+
+Log::~Log()
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->run = false;
+	}
+
+	this->wakeup.notify_one();
+
+	this->flusher->join();
+	delete this->flusher;
+}
+
+Log &Log::instance()
+{
+	static Log log;
+
+	return log;
+}
+
+bool Log::push(level_t level, const string &line)
+{
+	size_t pos = this->enqueuePos.load(memory_order_relaxed);
+	slot_t *slot;
+
+	// claim a slot, see Dmitry Vyukov's bounded MPMC queue
+	while (true)
+	{
+		slot = &this->ring[pos % LOG_RING_SIZE];
+
+		size_t   sequence = slot->sequence.load(memory_order_acquire);
+		intptr_t diff     = (intptr_t)sequence - (intptr_t)pos;
+
+		if (diff == 0)
+		{
+			if (this->enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			// full
+			return false;
+		}
+		else
+		{
+			pos = this->enqueuePos.load(memory_order_relaxed);
+		}
+	}
+
+	slot->level = level;
+	strncpy(slot->text, line.c_str(), sizeof(slot->text) - 1);
+	slot->text[sizeof(slot->text) - 1] = '\0';
+
+	// publish
+	slot->sequence.store(pos + 1, memory_order_release);
+
+	return true;
+}
+
+void Log::write(level_t level, const string &line)
+{
+	Log &log = Log::instance();
+
+	if (!log.push(level, line))
+	{
+		if (level == LEVEL_FATAL)
+		{
+			// never lose a fatal line
+			log.flush();
+			fprintf(stdout, "%s\n", line.c_str());
+			fflush(stdout);
+			return;
+		}
+
+		// the flusher reports the loss
+		log.dropped++;
+		log.notify();
+		return;
+	}
+
+	log.notify();
+
+	if (level == LEVEL_FATAL)
+	{
+		Log::flush();
+	}
+}
+
+void Log::flush()
+{
+	Log                &log   = Log::instance();
+	size_t             target = log.enqueuePos.load();
+	unique_lock<mutex> guard(log.lock);
+
+	log.wakeup.notify_one();
+
+	log.drained.wait(guard, [&log, target] { return log.written.load() >= target; });
+}
+
+void Log::notify()
+{
+	// pairs with the fence in work: either the flusher is seen asleep or it sees the new line
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (this->sleeping.load())
+	{
+		// the flusher holds the lock from its last check until it waits, so this can't be lost
+		lock_guard<mutex> guard(this->lock);
+		this->wakeup.notify_one();
+	}
+}
+
+void Log::setLevel(level_t level)
+{
+	Log::threshold = level;
+}
+
+Log::level_t Log::getLevel()
+{
+	return (level_t)Log::threshold.load(memory_order_relaxed);
+}
+
+Log::level_t Log::stringToLevel(const string &str)
+{
+	if (str.find("d") == 0) return LEVEL_DEBUG;
+	if (str.find("i") == 0) return LEVEL_INFO;
+	if (str.find("e") == 0) return LEVEL_ERROR;
+	if (str.find("f") == 0) return LEVEL_FATAL;
+	else
+	{
+		LOG(LEVEL_ERROR, ERROR << "Failed to parse log level, using 'debug'.");
+		return LEVEL_DEBUG;
+	}
+}
+
+bool Log::admit(const string &key, unsigned int *suppressed)
+{
+	Log               &log = Log::instance();
+	time_t            now  = time(NULL);
+	lock_guard<mutex> guard(log.limitLock);
+
+	// forget about keys that have been quiet for a while
+	if (log.limits.size() > LOG_RING_SIZE)
+	{
+		for (auto it = log.limits.begin(); it != log.limits.end(); )
+		{
+			if (it->second.lastAdmitted + LOG_RATELIMIT_S <= now && it->second.suppressed == 0)
+			{
+				it = log.limits.erase(it);
+			}
+			else
+			{
+				it++;
+			}
+		}
+	}
+
+	auto it = log.limits.find(key);
+
+	if (it == log.limits.end())
+	{
+		log.limits[key] = {now, 0};
+		*suppressed = 0;
+		return true;
+	}
+
+	if (it->second.lastAdmitted + LOG_RATELIMIT_S <= now)
+	{
+		*suppressed = it->second.suppressed;
+		it->second  = {now, 0};
+		return true;
+	}
+
+	it->second.suppressed++;
+	return false;
+}
+
+void Log::work()
+{
+	string       batch;
+	size_t       lines;
+	unsigned int lost;
+
+	while (true)
+	{
+		batch.clear();
+		lines = 0;
+
+		// take everything that has been published so far
+		while (true)
+		{
+			slot_t *slot    = &this->ring[this->dequeuePos % LOG_RING_SIZE];
+			size_t sequence = slot->sequence.load(memory_order_acquire);
+
+			if (sequence != this->dequeuePos + 1)
+			{
+				break;
+			}
+
+			batch += slot->text;
+			batch += '\n';
+			lines++;
+
+			slot->sequence.store(this->dequeuePos + LOG_RING_SIZE, memory_order_release);
+			this->dequeuePos++;
+		}
+
+		if ((lost = this->dropped.exchange(0)) > 0)
+		{
+			batch += NOTICE;
+			batch += to_string(lost) + " log lines dropped.\n";
+		}
+
+		if (!batch.empty())
+		{
+			fwrite(batch.data(), 1, batch.size(), stdout);
+			fflush(stdout);
+
+			{
+				lock_guard<mutex> guard(this->lock);
+				this->written += lines;
+			}
+
+			this->drained.notify_all();
+			continue;
+		}
+
+		unique_lock<mutex> guard(this->lock);
+
+		if (!this->run)
+		{
+			break;
+		}
+
+		// producers only notify while we sleep, so sleep only if nothing arrived meanwhile
+		this->sleeping = true;
+		atomic_thread_fence(memory_order_seq_cst);
+
+		while (this->run && this->dropped.load() == 0 &&
+		       this->ring[this->dequeuePos % LOG_RING_SIZE].sequence.load() != this->dequeuePos + 1)
+		{
+			this->wakeup.wait(guard);
+		}
+
+		this->sleeping = false;
+	}
+}
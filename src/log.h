@@ -0,0 +1,172 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "common.h"
+
+// Number of lines the ring buffer can hold before lines are dropped
+#define LOG_RING_SIZE     1024
+
+// Maximum length of a single line, longer lines are truncated
+#define LOG_LINE_MAX      512
+
+// Lines with the same rate limiting key are printed at most once per this many seconds
+#define LOG_RATELIMIT_S   60
+
+/**
+ * @brief Formats and queues a line without blocking. Prefixes from common.h go into the text.
+ */
+#define LOG(level, text) \
+do { \
+	if ((level) >= Log::getLevel()) \
+	{ \
+		std::ostringstream logStream_; \
+		logStream_ << text; \
+		Log::write((level), logStream_.str()); \
+	} \
+} while (0)
+
+/**
+ * @brief Like LOG, but lines sharing a key are printed at most once per LOG_RATELIMIT_S seconds.
+ */
+#define LOG_LIMITED(level, key, text) \
+do { \
+	unsigned int logSuppressed_; \
+	if ((level) >= Log::getLevel() && Log::admit((key), &logSuppressed_)) \
+	{ \
+		if (logSuppressed_ > 0) \
+		{ \
+			LOG(level, text << " (" << logSuppressed_ << " similar messages suppressed)"); \
+		} \
+		else \
+		{ \
+			LOG(level, text); \
+		} \
+	} \
+} while (0)
+
+/**
+ * @brief An asynchronous logger.
+ *
+ * Producers copy their line into a lock-free, bounded multi-producer ring buffer and return
+ * immediately; a background thread writes the lines to standard output and flushes once per batch.
+ * If the ring is full, lines are dropped and the number of dropped lines is reported later.
+ * Fatal lines are flushed before write returns.
+ */
+class Log
+{
+public:
+
+	typedef enum level_e
+	{
+		LEVEL_DEBUG,
+		LEVEL_INFO,
+		LEVEL_ERROR,
+		LEVEL_FATAL
+	} level_t;
+
+	/**
+	 * @brief Queues a line for output.
+	 */
+	static void    write(level_t level, const std::string &line);
+
+	/**
+	 * @brief Blocks until all queued lines have been written.
+	 */
+	static void    flush();
+
+	/**
+	 * @param level Lines below this level are discarded.
+	 */
+	static void    setLevel(level_t level);
+
+	static level_t getLevel();
+
+	/**
+	 * @param str A level name such as "debug" or "error"
+	 */
+	static level_t stringToLevel(const std::string &str);
+
+	/**
+	 * @brief Decides whether a rate limited line may be printed.
+	 * @param key        Rate limiting key
+	 * @param suppressed Set to the number of lines suppressed since the last admitted one
+	 */
+	static bool    admit(const std::string &key, unsigned int *suppressed);
+
+private:
+
+	typedef struct slot_s
+	{
+		std::atomic<size_t> sequence;
+		level_t             level;
+		char                text[LOG_LINE_MAX];
+	} slot_t;
+
+	typedef struct limit_s
+	{
+		time_t       lastAdmitted;
+		unsigned int suppressed;
+	} limit_t;
+
+	Log();
+	~Log();
+
+	static Log &instance();
+
+	bool push(level_t level, const std::string &line);
+	void notify();
+	void work();
+
+	// ring buffer
+	slot_t                  ring[LOG_RING_SIZE];
+	std::atomic<size_t>     enqueuePos;
+	size_t                  dequeuePos;
+	std::atomic<size_t>     written;
+	std::atomic<unsigned>   dropped;
+
+	// flusher
+	std::thread             *flusher;
+	std::atomic<bool>       sleeping;
+	bool                    run;
+	std::mutex              lock;
+	std::condition_variable wakeup;
+	std::condition_variable drained;
+
+	// rate limiting
+	std::map<std::string, limit_t> limits;
+	std::mutex              limitLock;
+
+	static std::atomic<int> threshold;
+};
+
+#endif // LOG_H
@@ -19,6 +19,7 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 ====================================================================
 */
 
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <list>
@@ -27,25 +28,46 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #include "ircclient.h"
 #include "unvquery.h"
 #include "github.h"
+#include "scheduler.h"
+#include "eventloop.h"
+#include "log.h"
+#include "metrics.h"
+#include "admin.h"
+#include "reload.h"
+#include "icalendar.h"
+#include "simulation.h"
+#include "httpclient.h"
 
 using namespace std;
 
 int main(int argc, char **argv)
 {
 	MantisConfig      *config;
+	Scheduler         *scheduler;
+	EventLoop         *eventLoop;
+	Calendar          *calendar;
+	HTTPClient        *httpClient;
+	GitHubQuery       *gitHubQuery;
+	ConfigReloader    *reloader;
 	list<IRCClient *> ircClients;
+	string            configFile;
+	int               simulateDays = 0;
 
 	// load configuration
 	{
-		string configFile;
-
-		if (argc > 1)
+		if (argc > 2 && string(argv[1]) == "--simulate")
+		{
+			configFile   = argv[2];
+			simulateDays = argc > 3 ? atoi(argv[3]) : SIMULATION_DAYS;
+		}
+		else if (argc > 1)
 		{
 			configFile = argv[1];
 		}
 		else
 		{
 			cerr << "Usage: " << argv[0] << " <config>" << endl;
+			cerr << "       " << argv[0] << " --simulate <config> [days]" << endl;
 			return -1;
 		}
 
@@ -63,6 +85,11 @@ int main(int argc, char **argv)
 			cerr << FATAL << e.getError() << " on line " << e.getLine() << " of " << e.getFile() << "." << endl;
 			return -3;
 		}
+		catch (libconfig::SettingException &e)
+		{
+			cerr << FATAL << "Setting " << e.getPath() << " is missing or invalid." << endl;
+			return -4;
+		}
 	}
 
 	const libconfig::Setting &cfgRoot = config->getRoot();
@@ -71,125 +98,162 @@ int main(int argc, char **argv)
 	// global config
 	bool useColor = (bool)globals["usecolor"];
 
-	// start irc clients
+	if (globals.exists("loglevel"))
 	{
-		const libconfig::Setting &cfg     = cfgRoot["irc"];
-		const libconfig::Setting &servers = cfg["servers"];
+		Log::setLevel(Log::stringToLevel(globals["loglevel"]));
+	}
 
-		for (int serverNum = 0; serverNum < servers.getLength(); serverNum++)
-		{
-			const libconfig::Setting &server   = servers[serverNum];
-			const libconfig::Setting &channels = server["channels"];
+	// fast-forward the calendar and peek detection instead of connecting anywhere
+	if (simulateDays > 0)
+	{
+		return Simulation(config, simulateDays).run() ? 0 : 1;
+	}
 
-			string host     = server["host"];
-			string password = server["password"];
-			string nick     = server["nick"];
-			int    port     = server["port"];
+	// start the timer service shared by all modules and the event loop shared by all clients
+	scheduler = new Scheduler();
 
-			IRCClient   *ircClient   = new IRCClient(host, port, password, nick);
-			GitHubQuery *gitHubQuery;
-			UnvQuery    *unvQuery;
-			Calendar    *calendar;
+	try
+	{
+		eventLoop = new EventLoop();
+	}
+	catch (int error)
+	{
+		return error - 200;
+	}
 
-			// init unvanquished query module
-			{
-				const libconfig::Setting &cfg = cfgRoot["unvquery"];
-
-				string master   = cfg["master"];
-				int    port     = cfg["port"];
-				int    protocol = cfg["protocol"];
-
-				try
-				{
-					unvQuery = new UnvQuery(master, port, protocol, useColor);
-				}
-				catch (int error)
-				{
-					return error - 100;
-				}
-			}
+	// serve metrics if configured
+	if (cfgRoot.exists("metrics"))
+	{
+		const libconfig::Setting &cfg = cfgRoot["metrics"];
 
-			// init calendar module
-			{
-				const libconfig::Setting &cfg    = cfgRoot["calendar"];
-				const libconfig::Setting &events = cfg["events"];
+		string address = cfg["address"];
+		int    port    = cfg["port"];
 
-				calendar = new Calendar(useColor);
+		try
+		{
+			new MetricsServer(eventLoop, address, port);
+		}
+		catch (int error)
+		{
+			return error - 300;
+		}
+	}
 
-				for (int eventNum = 0; eventNum < events.getLength(); eventNum++)
-				{
-					const libconfig::Setting &event = events[eventNum];
+	// init the calendar shared by all clients, it continues from its journal if it keeps one
+	calendar = new Calendar(scheduler, useColor);
 
-					int    start       = event["start"];
-					int    warnTime    = event["warnTime"];
-					int    warnCount   = event["warnCount"];
-					string period      = event["period"];
-					string description = event["description"];
+	if (cfgRoot["calendar"].exists("state"))
+	{
+		calendar->load((const char *)cfgRoot["calendar"]["state"]);
+	}
 
-					ostringstream stream;
+	if (cfgRoot["calendar"].exists("editors"))
+	{
+		const libconfig::Setting &cfg = cfgRoot["calendar"]["editors"];
+		vector<string>           editors;
 
-					stream << start << " " << warnTime << " " << warnCount << " " << period << " " << description;
+		for (int editorNum = 0; editorNum < cfg.getLength(); editorNum++)
+		{
+			editors.push_back((const char *)cfg[editorNum]);
+		}
 
-					calendar->addEvent(stream.str());
-				}
-			}
+		calendar->setEditors(editors);
+	}
 
-			// init GitHub query module
-			{
-				const libconfig::Setting &cfg = cfgRoot["github"];
+	for (const string &event : config->getEvents())
+	{
+		calendar->addEvent(event);
+	}
 
-				string owner = cfg["owner"];
-				string repo  = cfg["repository"];
+	for (const MantisConfig::import_t &import : config->getImports())
+	{
+		ICalendar::import(import.file, calendar, chrono::seconds(import.warnTime), import.warnCount);
+	}
 
-				gitHubQuery = new GitHubQuery(owner, repo, useColor);
-			}
+	// keep the connections to web APIs open for all clients
+	try
+	{
+		httpClient = new HTTPClient("mantisbot");
+	}
+	catch (int error)
+	{
+		return error - 600;
+	}
 
-			// add modules
-			ircClient->addUnvQuery(unvQuery);
-			ircClient->addCalendar(calendar);
-			ircClient->addGitHubQuery(gitHubQuery);
+	// init the GitHub query module shared by all clients, so that they share its lookup cache
+	{
+		const MantisConfig::gitHub_t &cfg = config->getGitHub();
 
-			// join channels
-			for (int chanNum = 0; chanNum < channels.getLength(); chanNum++)
+		gitHubQuery = new GitHubQuery(httpClient, scheduler, cfg.owner, cfg.repository, cfg.token, useColor);
+	}
+
+	// start irc clients
+	for (const MantisConfig::server_t &server : config->getServers())
+	{
+		// every network sweeps its game servers on a worker of its own, so that neither the timers
+		// nor the other networks wait for it
+		Scheduler   *worker      = new Scheduler();
+		IRCClient   *ircClient   = new IRCClient(eventLoop, worker, server.host, server.port,
+		                                         server.password, server.nick, server.connections);
+		UnvQuery    *unvQuery;
+
+		// init unvanquished query module
+		{
+			const MantisConfig::unvQuery_t &cfg = config->getUnvQuery();
+
+			try
+			{
+				unvQuery = new UnvQuery(cfg.master, cfg.port, cfg.protocol, useColor);
+			}
+			catch (int error)
 			{
-				const libconfig::Setting &channel = channels[chanNum];
+				return error - 100;
+			}
+		}
 
-				string name     = channel["name"];
-				string password = channel["password"];
+		// add modules
+		ircClient->addUnvQuery(unvQuery);
+		ircClient->addCalendar(calendar);
+		ircClient->addGitHubQuery(gitHubQuery);
 
-				int broadcastFlags;
+		// join channels
+		for (const MantisConfig::channel_t &channel : server.channels)
+		{
+			ircClient->join(channel.name, channel.password, channel.broadcastFlags);
+		}
 
-				if (channel.exists("noBroadcasts") && (bool)channel["noBroadcasts"])
-				{
-					broadcastFlags = BROADCAST_NONE;
-				}
-				else
-				{
-					 broadcastFlags = BROADCAST_ALL;
+		ircClients.push_back(ircClient);
+	}
 
-					if (channel.exists("noPlayerPeekBroadcasts") && (bool)channel["noPlayerPeekBroadcasts"])
-					{
-						broadcastFlags &= ~BROADCAST_PLAYERPEEK;
-					}
+	// reload the configuration on SIGHUP
+	try
+	{
+		reloader = new ConfigReloader(eventLoop, configFile, config, &ircClients, calendar);
+	}
+	catch (int error)
+	{
+		return error - 500;
+	}
 
-					if (channel.exists("noEventBroadcasts") && (bool)channel["noEventBroadcasts"])
-					{
-						broadcastFlags &= ~BROADCAST_EVENT;
-					}
-				}
+	// accept admin commands if configured
+	if (cfgRoot.exists("admin"))
+	{
+		const libconfig::Setting &cfg = cfgRoot["admin"];
 
-				ircClient->join(name, password, broadcastFlags);
-			}
+		string path = cfg["socket"];
 
-			ircClients.push_back(ircClient);
+		try
+		{
+			new AdminServer(eventLoop, path, &ircClients, reloader);
+		}
+		catch (int error)
+		{
+			return error - 400;
 		}
 	}
 
-	// wait for irc clients to terminate
-	for (IRCClient *ircClient : ircClients)
-	{
-		ircClient->threadJoin();
-	}
+	// drive all irc clients until they terminate
+	eventLoop->run();
 
 	return 0;
 }
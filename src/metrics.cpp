@@ -0,0 +1,335 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "eventloop.h"
+#include "log.h"
+
+using namespace std;
+
+// upper bounds of the histogram buckets in seconds
+const double Histogram::bounds[]  = {0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+                                     30, 60, 300};
+const size_t Histogram::numBounds = sizeof(Histogram::bounds) / sizeof(Histogram::bounds[0]);
+
+static mutex registryLock;
+
+// assigns each thread a shard in round robin order
+static unsigned int shardIndex()
+{
+	static atomic<unsigned int> next(0);
+	static thread_local unsigned int index = next++ % METRICS_SHARDS;
+
+	return index;
+}
+
+Metric::Metric(const char *name, const char *labels, const char *help)
+	: name(name), labels(labels), help(help)
+{
+	lock_guard<mutex> guard(registryLock);
+	Metric::registry().push_back(this);
+}
+
+vector<Metric *> &Metric::registry()
+{
+	static vector<Metric *> metrics;
+
+	return metrics;
+}
+
+string Metric::series(const string &suffix, const string &extraLabel) const
+{
+	string result = this->name + suffix;
+
+	if (!this->labels.empty() || !extraLabel.empty())
+	{
+		result += "{" + this->labels;
+		result += (!this->labels.empty() && !extraLabel.empty()) ? "," : "";
+		result += extraLabel + "}";
+	}
+
+	return result;
+}
+
+string Metric::exportAll()
+{
+	vector<Metric *> metrics;
+	string           out;
+
+	{
+		lock_guard<mutex> guard(registryLock);
+		metrics = Metric::registry();
+	}
+
+	// series of the same metric must be adjacent and share one header
+	stable_sort(metrics.begin(), metrics.end(), [](const Metric *a, const Metric *b)
+	{
+		return a->name < b->name;
+	});
+
+	for (size_t i = 0; i < metrics.size(); i++)
+	{
+		if (i == 0 || metrics[i]->name != metrics[i - 1]->name)
+		{
+			out += "# HELP " + metrics[i]->name + " " + metrics[i]->help + "\n";
+			out += "# TYPE " + metrics[i]->name + " " + metrics[i]->type() + "\n";
+		}
+
+		metrics[i]->print(out);
+	}
+
+	return out;
+}
+
+Counter::Counter(const char *name, const char *labels, const char *help)
+	: Metric(name, labels, help)
+{
+	for (shard_t &shard : this->shards)
+	{
+		shard.value = 0;
+	}
+}
+
+void Counter::inc(uint64_t amount)
+{
+	this->shards[shardIndex()].value.fetch_add(amount, memory_order_relaxed);
+}
+
+uint64_t Counter::value() const
+{
+	uint64_t sum = 0;
+
+	for (const shard_t &shard : this->shards)
+	{
+		sum += shard.value.load(memory_order_relaxed);
+	}
+
+	return sum;
+}
+
+const char *Counter::type() const
+{
+	return "counter";
+}
+
+void Counter::print(string &out) const
+{
+	out += this->series("", "") + " " + to_string(this->value()) + "\n";
+}
+
+Gauge::Gauge(const char *name, const char *labels, const char *help)
+	: Metric(name, labels, help), current(0)
+{}
+
+void Gauge::set(int64_t value)
+{
+	this->current.store(value, memory_order_relaxed);
+}
+
+void Gauge::add(int64_t amount)
+{
+	this->current.fetch_add(amount, memory_order_relaxed);
+}
+
+int64_t Gauge::value() const
+{
+	return this->current.load(memory_order_relaxed);
+}
+
+const char *Gauge::type() const
+{
+	return "gauge";
+}
+
+void Gauge::print(string &out) const
+{
+	out += this->series("", "") + " " + to_string(this->value()) + "\n";
+}
+
+Histogram::Histogram(const char *name, const char *labels, const char *help)
+	: Metric(name, labels, help), count(0), sumMicroseconds(0)
+{
+	for (atomic<uint64_t> &bucket : this->buckets)
+	{
+		bucket = 0;
+	}
+}
+
+void Histogram::observe(double seconds)
+{
+	size_t bucket;
+
+	for (bucket = 0; bucket < numBounds && seconds > bounds[bucket]; bucket++);
+
+	this->buckets[bucket].fetch_add(1, memory_order_relaxed);
+	this->count.fetch_add(1, memory_order_relaxed);
+	this->sumMicroseconds.fetch_add((uint64_t)(seconds * 1e6), memory_order_relaxed);
+}
+
+void Histogram::observeSince(timepoint_t start)
+{
+	this->observe(chrono::duration<double>(Histogram::now() - start).count());
+}
+
+Histogram::timepoint_t Histogram::now()
+{
+	return chrono::steady_clock::now();
+}
+
+const char *Histogram::type() const
+{
+	return "histogram";
+}
+
+void Histogram::print(string &out) const
+{
+	uint64_t cumulative = 0;
+	char     bound[32];
+
+	for (size_t bucket = 0; bucket <= numBounds; bucket++)
+	{
+		cumulative += this->buckets[bucket].load(memory_order_relaxed);
+
+		if (bucket < numBounds)
+		{
+			snprintf(bound, sizeof(bound), "le=\"%g\"", bounds[bucket]);
+		}
+		else
+		{
+			snprintf(bound, sizeof(bound), "le=\"+Inf\"");
+		}
+
+		out += this->series("_bucket", bound) + " " + to_string(cumulative) + "\n";
+	}
+
+	snprintf(bound, sizeof(bound), "%.6f", this->sumMicroseconds.load(memory_order_relaxed) / 1e6);
+
+	out += this->series("_sum", "") + " " + bound + "\n";
+	out += this->series("_count", "") + " " + to_string(this->count.load(memory_order_relaxed)) + "\n";
+}
+
+MetricsServer::MetricsServer(EventLoop *eventLoop, string address, unsigned short port)
+{
+	sockaddr_in localAddr;
+	int         reuse = 1;
+
+	this->eventLoop = eventLoop;
+
+	memset(&localAddr, 0, sizeof(localAddr));
+	localAddr.sin_family = AF_INET;
+	localAddr.sin_port   = htons(port);
+
+	if (inet_pton(AF_INET, address.c_str(), &localAddr.sin_addr) != 1)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Invalid metrics listen address " << address << ".");
+		throw -1;
+	}
+
+	this->listenSock = socket(AF_INET, SOCK_STREAM, 0);
+	if (this->listenSock < 0)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to create socket.");
+		throw -2;
+	}
+
+	setsockopt(this->listenSock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	fcntl(this->listenSock, F_SETFL, O_NONBLOCK);
+
+	if (bind(this->listenSock, (sockaddr *)&localAddr, sizeof(localAddr)) < 0 ||
+	    listen(this->listenSock, 8) < 0)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to listen on " << address << ":" << port << ".");
+		throw -3;
+	}
+
+	LOG(Log::LEVEL_INFO, NOTICE << "Serving metrics on http://" << address << ":" << port << "/metrics.");
+
+	this->eventLoop->watch(this->listenSock, bind(&MetricsServer::accept, this));
+}
+
+void MetricsServer::accept()
+{
+	int fd;
+
+	while ((fd = ::accept(this->listenSock, NULL, NULL)) >= 0)
+	{
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		this->requests[fd] = "";
+		this->eventLoop->watch(fd, bind(&MetricsServer::receive, this, fd));
+	}
+}
+
+void MetricsServer::receive(int fd)
+{
+	char    buffer[1024];
+	ssize_t len;
+	string  &request = this->requests[fd];
+
+	while ((len = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+	{
+		request.append(buffer, len);
+	}
+
+	if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+	    request.size() > METRICS_REQUEST_MAX)
+	{
+		this->close(fd);
+		return;
+	}
+
+	// wait for the end of the request header, we don't care what was requested
+	if (request.find("\r\n\r\n") == string::npos)
+	{
+		return;
+	}
+
+	string body     = Metric::exportAll();
+	string response = "HTTP/1.0 200 OK\r\n"
+	                  "Content-Type: text/plain; version=0.0.4\r\n"
+	                  "Content-Length: " + to_string(body.size()) + "\r\n"
+	                  "Connection: close\r\n\r\n" + body;
+
+	// the response is small enough to fit into the socket buffer
+	if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) < (ssize_t)response.size())
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to send metrics response.");
+	}
+
+	this->close(fd);
+}
+
+void MetricsServer::close(int fd)
+{
+	this->eventLoop->unwatch(fd);
+	this->requests.erase(fd);
+	::close(fd);
+}
@@ -0,0 +1,187 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+class EventLoop;
+
+// Number of per-thread shards a counter is split into
+#define METRICS_SHARDS 8
+
+// Maximum size of a request to the metrics listener
+#define METRICS_REQUEST_MAX 4096
+
+/**
+ * @brief Base class of all metrics, registers itself for export on construction.
+ */
+class Metric
+{
+public:
+
+	/**
+	 * @param name   Metric name
+	 * @param labels Label set without braces, such as command="list", may be empty
+	 * @param help   Description
+	 */
+	Metric(const char *name, const char *labels, const char *help);
+
+	/**
+	 * @return All metrics in the Prometheus text exposition format.
+	 */
+	static std::string exportAll();
+
+protected:
+
+	std::string name;
+	std::string labels;
+	std::string help;
+
+	virtual const char *type() const = 0;
+	virtual void        print(std::string &out) const = 0;
+
+	std::string         series(const std::string &suffix, const std::string &extraLabel) const;
+
+private:
+
+	static std::vector<Metric *> &registry();
+};
+
+/**
+ * @brief A monotonic counter. Increments go to a per-thread shard and never contend.
+ */
+class Counter : public Metric
+{
+public:
+
+	Counter(const char *name, const char *labels, const char *help);
+
+	void     inc(uint64_t amount = 1);
+	uint64_t value() const;
+
+protected:
+
+	const char *type() const;
+	void        print(std::string &out) const;
+
+private:
+
+	struct alignas(64) shard_t
+	{
+		std::atomic<uint64_t> value;
+	};
+
+	shard_t shards[METRICS_SHARDS];
+};
+
+/**
+ * @brief A value that can go up and down.
+ */
+class Gauge : public Metric
+{
+public:
+
+	Gauge(const char *name, const char *labels, const char *help);
+
+	void    set(int64_t value);
+	void    add(int64_t amount);
+	int64_t value() const;
+
+protected:
+
+	const char *type() const;
+	void        print(std::string &out) const;
+
+private:
+
+	std::atomic<int64_t> current;
+};
+
+/**
+ * @brief A distribution of durations over fixed buckets.
+ */
+class Histogram : public Metric
+{
+public:
+
+	typedef std::chrono::steady_clock::time_point timepoint_t;
+
+	Histogram(const char *name, const char *labels, const char *help);
+
+	void observe(double seconds);
+
+	/**
+	 * @brief Observes the time passed since start.
+	 */
+	void observeSince(timepoint_t start);
+
+	static timepoint_t now();
+
+protected:
+
+	const char *type() const;
+	void        print(std::string &out) const;
+
+private:
+
+	static const double   bounds[];
+	static const size_t   numBounds;
+
+	std::atomic<uint64_t> buckets[16];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sumMicroseconds;
+};
+
+/**
+ * @brief A minimal HTTP listener that answers every request with the exported metrics.
+ */
+class MetricsServer
+{
+public:
+
+	/**
+	 * @param eventLoop Event loop that serves the listener
+	 * @param address   Local address to listen on
+	 * @param port      Local port to listen on
+	 */
+	MetricsServer(EventLoop *eventLoop, std::string address, unsigned short port);
+
+private:
+
+	EventLoop                  *eventLoop;
+	int                        listenSock;
+	std::map<int, std::string> requests;
+
+	void accept();
+	void receive(int fd);
+	void close(int fd);
+};
+
+#endif // METRICS_H
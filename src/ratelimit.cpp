@@ -0,0 +1,114 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include "ratelimit.h"
+
+using namespace std;
+
+RateLimiter::RateLimiter(unsigned int burst, unsigned int period)
+{
+	this->burst    = burst;
+	this->period   = period;
+	this->expireAt = RATELIMIT_EXPIRY_SIZE;
+}
+
+double RateLimiter::refill(bucket_t &bucket, timepoint_t now)
+{
+	double elapsed = chrono::duration<double>(now - bucket.updated).count();
+
+	bucket.tokens  = MIN(this->burst, bucket.tokens + elapsed / this->period);
+	bucket.updated = now;
+
+	return bucket.tokens;
+}
+
+void RateLimiter::expire(timepoint_t now)
+{
+	for (auto it = this->buckets.begin(); it != this->buckets.end(); )
+	{
+		if (this->refill(it->second, now) >= this->burst)
+		{
+			it = this->buckets.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+
+	// don't scan again before the table has grown considerably
+	this->expireAt = MAX((size_t)RATELIMIT_EXPIRY_SIZE, 2 * this->buckets.size());
+}
+
+bool RateLimiter::allow(const vector<string> &keys)
+{
+	lock_guard<mutex> guard(this->lock);
+	timepoint_t       now = chrono::steady_clock::now();
+
+	if (this->buckets.size() > this->expireAt)
+	{
+		this->expire(now);
+	}
+
+	// check all buckets before taking from any of them
+	for (const string &key : keys)
+	{
+		auto it = this->buckets.find(key);
+
+		if (it != this->buckets.end() && this->refill(it->second, now) < 1)
+		{
+			return false;
+		}
+	}
+
+	for (const string &key : keys)
+	{
+		auto it = this->buckets.find(key);
+
+		if (it == this->buckets.end())
+		{
+			this->buckets[key] = {this->burst - 1, now};
+		}
+		else
+		{
+			it->second.tokens -= 1;
+		}
+	}
+
+	return true;
+}
+
+void RateLimiter::refund(const vector<string> &keys)
+{
+	lock_guard<mutex> guard(this->lock);
+	timepoint_t       now = chrono::steady_clock::now();
+
+	for (const string &key : keys)
+	{
+		auto it = this->buckets.find(key);
+
+		// a bucket that was expired meanwhile is full already
+		if (it != this->buckets.end())
+		{
+			it->second.tokens = MIN(this->burst, this->refill(it->second, now) + 1);
+		}
+	}
+}
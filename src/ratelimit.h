@@ -0,0 +1,86 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Number of buckets above which full buckets are expired
+#define RATELIMIT_EXPIRY_SIZE 256
+
+/**
+ * @brief Token bucket rate limiting for arbitrary keys.
+ *
+ * Every key starts with a full bucket of burst tokens and regains one token per period. Buckets
+ * are refilled lazily when they are accessed, and buckets that are full again are forgotten once
+ * the table grows, since a missing bucket behaves exactly like a full one.
+ */
+class RateLimiter
+{
+public:
+
+	/**
+	 * @param burst  Number of requests allowed at once
+	 * @param period Seconds until another request is allowed
+	 */
+	RateLimiter(unsigned int burst, unsigned int period);
+
+	/**
+	 * @brief Takes a token from every key's bucket if all of them have one left.
+	 * @param keys Keys that all have to allow the request
+	 * @return Whether the request is allowed.
+	 */
+	bool allow(const std::vector<std::string> &keys);
+
+	/**
+	 * @brief Gives back the token taken by an allowed request that didn't happen after all.
+	 * @param keys Keys that were passed to allow
+	 */
+	void refund(const std::vector<std::string> &keys);
+
+private:
+
+	typedef std::chrono::steady_clock::time_point timepoint_t;
+
+	typedef struct bucket_s
+	{
+		double      tokens;
+		timepoint_t updated;
+	} bucket_t;
+
+	double                                    burst;
+	double                                    period;
+	size_t                                    expireAt;
+	std::unordered_map<std::string, bucket_t> buckets;
+	std::mutex                                lock;
+
+	double refill(bucket_t &bucket, timepoint_t now);
+	void   expire(timepoint_t now);
+};
+
+#endif // RATELIMIT_H
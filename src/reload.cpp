@@ -0,0 +1,311 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include <algorithm>
+#include <map>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "reload.h"
+#include "eventloop.h"
+#include "ircclient.h"
+#include "calendar.h"
+#include "log.h"
+
+using namespace std;
+
+int ConfigReloader::signalPipe[2] = {-1, -1};
+
+ConfigReloader::ConfigReloader(EventLoop *eventLoop, string path, MantisConfig *config,
+                               list<IRCClient *> *clients, Calendar *calendar)
+{
+	struct sigaction action;
+
+	this->eventLoop = eventLoop;
+	this->path      = path;
+	this->config    = config;
+	this->clients   = clients;
+	this->calendar  = calendar;
+
+	if (pipe(ConfigReloader::signalPipe) < 0)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to create signal pipe.");
+		throw -1;
+	}
+
+	fcntl(ConfigReloader::signalPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(ConfigReloader::signalPipe[1], F_SETFL, O_NONBLOCK);
+
+	this->eventLoop->watch(ConfigReloader::signalPipe[0], bind(&ConfigReloader::receiveSignal, this));
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = &ConfigReloader::handleSignal;
+	action.sa_flags   = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	if (sigaction(SIGHUP, &action, NULL) < 0)
+	{
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to install SIGHUP handler.");
+		throw -2;
+	}
+}
+
+void ConfigReloader::handleSignal(int signal)
+{
+	char byte = 0;
+	int  savedErrno = errno;
+
+	UNUSED(signal);
+
+	// only async-signal-safe calls in here, the event loop does the actual work
+	if (write(ConfigReloader::signalPipe[1], &byte, 1) < 0)
+	{
+		// the pipe is full, so a reload is pending anyway
+	}
+
+	errno = savedErrno;
+}
+
+void ConfigReloader::receiveSignal()
+{
+	char   buffer[64];
+	string changes;
+
+	while (read(ConfigReloader::signalPipe[0], buffer, sizeof(buffer)) > 0);
+
+	LOG(Log::LEVEL_INFO, NOTICE << "Received SIGHUP, reloading " << this->path << "...");
+
+	this->reload(changes);
+}
+
+vector<string> ConfigReloader::difference(const vector<string> &a, const vector<string> &b)
+{
+	vector<string> result;
+
+	for (const string &element : a)
+	{
+		if (find(b.begin(), b.end(), element) == b.end())
+		{
+			result.push_back(element);
+		}
+	}
+
+	return result;
+}
+
+bool ConfigReloader::reload(string &changes)
+{
+	MantisConfig  *next;
+	ostringstream stream;
+
+	try
+	{
+		next = new MantisConfig(this->path);
+	}
+	catch (libconfig::ParseException &e)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << e.getError() << " on line " << e.getLine() << " of "
+		                            << e.getFile() << ", keeping the running configuration.");
+		changes = "Failed to parse " + this->path + ".\n";
+		return false;
+	}
+	catch (libconfig::SettingException &e)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Setting " << e.getPath() << " is missing or invalid, "
+		                            << "keeping the running configuration.");
+		changes = string("Invalid setting ") + e.getPath() + ".\n";
+		return false;
+	}
+	catch (libconfig::ConfigException &e)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to read " << this->path << ", keeping the running configuration.");
+		changes = "Failed to read " + this->path + ".\n";
+		return false;
+	}
+
+	// networks, matched by host
+	for (IRCClient *client : *this->clients)
+	{
+		const MantisConfig::server_t *from = NULL, *to = NULL;
+
+		for (const MantisConfig::server_t &server : this->config->getServers())
+		{
+			if (server.host == client->getNetwork())
+			{
+				from = &server;
+			}
+		}
+
+		for (const MantisConfig::server_t &server : next->getServers())
+		{
+			if (server.host == client->getNetwork())
+			{
+				to = &server;
+			}
+		}
+
+		if (from && to)
+		{
+			this->applyServer(client, *from, *to, stream);
+		}
+		else if (from)
+		{
+			stream << "Network " << client->getNetwork() << " was removed, restart to disconnect." << endl;
+		}
+	}
+
+	for (const MantisConfig::server_t &server : next->getServers())
+	{
+		bool running = false;
+
+		for (IRCClient *client : *this->clients)
+		{
+			running |= client->getNetwork() == server.host;
+		}
+
+		if (!running)
+		{
+			stream << "Network " << server.host << " was added, restart to connect." << endl;
+		}
+	}
+
+	// calendar events
+	{
+		vector<string> removed = ConfigReloader::difference(this->config->getEvents(), next->getEvents());
+		vector<string> added   = ConfigReloader::difference(next->getEvents(), this->config->getEvents());
+
+		if (!removed.empty() || !added.empty())
+		{
+			for (const string &event : removed)
+			{
+				this->calendar->removeEvent(event);
+			}
+
+			for (const string &event : added)
+			{
+				this->calendar->addEvent(event);
+			}
+
+			stream << "Removed " << removed.size() << " and added " << added.size() << " events." << endl;
+		}
+	}
+
+	// master server
+	{
+		const MantisConfig::unvQuery_t &from = this->config->getUnvQuery();
+		const MantisConfig::unvQuery_t &to   = next->getUnvQuery();
+
+		if (from.master != to.master || from.port != to.port || from.protocol != to.protocol)
+		{
+			for (IRCClient *client : *this->clients)
+			{
+				client->setMaster(to.master, to.port, to.protocol);
+			}
+
+			stream << "Master server is now " << to.master << ":" << to.port << "." << endl;
+		}
+	}
+
+	if (this->config->getGitHub().owner != next->getGitHub().owner ||
+	    this->config->getGitHub().repository != next->getGitHub().repository ||
+	    this->config->getGitHub().token != next->getGitHub().token)
+	{
+		stream << "GitHub settings changed, restart to apply." << endl;
+	}
+
+	delete this->config;
+	this->config = next;
+
+	changes = stream.str();
+
+	if (changes.empty())
+	{
+		changes = "Nothing changed.\n";
+	}
+
+	// log every change on its own line
+	{
+		istringstream lines(changes);
+		string        line;
+
+		while (getline(lines, line))
+		{
+			LOG(Log::LEVEL_INFO, NOTICE << "Reload: " << line);
+		}
+	}
+
+	return true;
+}
+
+void ConfigReloader::applyServer(IRCClient *client, const MantisConfig::server_t &from,
+                                 const MantisConfig::server_t &to, ostringstream &changes)
+{
+	map<string, const MantisConfig::channel_t *> before, after;
+
+	if (from.port != to.port || from.password != to.password || from.nick != to.nick ||
+	    from.connections != to.connections)
+	{
+		changes << "Connection settings of " << to.host << " changed, restart to apply." << endl;
+	}
+
+	for (const MantisConfig::channel_t &channel : from.channels)
+	{
+		before[channel.name] = &channel;
+	}
+
+	for (const MantisConfig::channel_t &channel : to.channels)
+	{
+		after[channel.name] = &channel;
+	}
+
+	for (auto &entry : before)
+	{
+		if (!after.count(entry.first))
+		{
+			client->leave(entry.first);
+			changes << "Leaving " << entry.first << " on " << to.host << "." << endl;
+		}
+	}
+
+	for (auto &entry : after)
+	{
+		auto previous = before.find(entry.first);
+
+		if (previous == before.end())
+		{
+			changes << "Joining " << entry.first << " on " << to.host << "." << endl;
+		}
+		else if (previous->second->password != entry.second->password ||
+		         previous->second->broadcastFlags != entry.second->broadcastFlags)
+		{
+			changes << "Updating " << entry.first << " on " << to.host << "." << endl;
+		}
+		else
+		{
+			continue;
+		}
+
+		client->join(entry.first, entry.second->password, entry.second->broadcastFlags);
+	}
+}
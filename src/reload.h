@@ -0,0 +1,87 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "config.h"
+
+class EventLoop;
+class IRCClient;
+class Calendar;
+
+/**
+ * @brief Rereads the config file on SIGHUP or on request and applies only what changed.
+ *
+ * Channels are joined or left, calendar events are added or removed and the query module is
+ * pointed to a new master server, while sessions and cached state of the clients stay untouched.
+ * Changes to the networks themselves still need a restart.
+ */
+class ConfigReloader
+{
+public:
+
+	/**
+	 * @param eventLoop Event loop that receives the signal
+	 * @param path      Path to config file
+	 * @param config    The configuration the clients were started with, now owned by the reloader
+	 * @param clients   IRC clients that are reconfigured
+	 * @param calendar  Calendar that holds the configured events
+	 */
+	ConfigReloader(EventLoop *eventLoop, std::string path, MantisConfig *config,
+	               std::list<IRCClient *> *clients, Calendar *calendar);
+
+	/**
+	 * @brief Rereads the config file and applies the differences to the running clients.
+	 * @param changes Receives one line per change
+	 * @return Whether the file could be read, otherwise the running configuration is kept.
+	 */
+	bool reload(std::string &changes);
+
+private:
+
+	EventLoop              *eventLoop;
+	std::string            path;
+	MantisConfig           *config;
+	std::list<IRCClient *> *clients;
+	Calendar               *calendar;
+
+	// self-pipe that turns SIGHUP into an event loop event
+	static int signalPipe[2];
+
+	static void handleSignal(int signal);
+	void receiveSignal();
+
+	void applyServer(IRCClient *client, const MantisConfig::server_t &from,
+	                 const MantisConfig::server_t &to, std::ostringstream &changes);
+
+	// elements of a that are missing from b
+	static std::vector<std::string> difference(const std::vector<std::string> &a,
+	                                           const std::vector<std::string> &b);
+};
+
+#endif // RELOAD_H
@@ -0,0 +1,131 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#include "scheduler.h"
+#include "metrics.h"
+
+using namespace std;
+
+static Gauge pendingTasks("mantis_scheduler_pending_tasks", "",
+                          "Timers and module work waiting to run on the scheduler.");
+
+Scheduler::Scheduler()
+{
+	this->nextId = 1;
+	this->run    = true;
+	this->worker = new thread(&Scheduler::work, this);
+}
+
+Scheduler::~Scheduler()
+{
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->run = false;
+	}
+
+	this->wakeup.notify_all();
+
+	this->worker->join();
+	delete this->worker;
+}
+
+Scheduler::handle_t Scheduler::schedule(timepoint_t when, task_t task)
+{
+	handle_t id;
+	bool     earliest;
+
+	{
+		lock_guard<mutex> guard(this->lock);
+
+		id = this->nextId++;
+		earliest = this->timers.empty() || when < this->timers.top().when;
+
+		this->timers.push({when, id, task});
+		this->pending.insert(id);
+
+		pendingTasks.add(1);
+	}
+
+	// only an earlier deadline changes how long the worker has to sleep
+	if (earliest)
+	{
+		this->wakeup.notify_one();
+	}
+
+	return id;
+}
+
+Scheduler::handle_t Scheduler::schedule(chrono::milliseconds delay, task_t task)
+{
+	return this->schedule(chrono::system_clock::now() + delay, task);
+}
+
+Scheduler::handle_t Scheduler::post(task_t task)
+{
+	return this->schedule(chrono::system_clock::now(), task);
+}
+
+void Scheduler::cancel(handle_t timer)
+{
+	lock_guard<mutex> guard(this->lock);
+
+	// the heap entry is dropped lazily once it reaches the top, the gauge is shared by all
+	// schedulers so it is adjusted rather than set
+	if (this->pending.erase(timer) > 0)
+	{
+		pendingTasks.add(-1);
+	}
+}
+
+void Scheduler::work()
+{
+	unique_lock<mutex> guard(this->lock);
+
+	while (this->run)
+	{
+		if (this->timers.empty())
+		{
+			this->wakeup.wait(guard);
+			continue;
+		}
+
+		if (this->timers.top().when > chrono::system_clock::now())
+		{
+			this->wakeup.wait_until(guard, this->timers.top().when);
+			continue;
+		}
+
+		entry_t entry = this->timers.top();
+		this->timers.pop();
+
+		if (this->pending.erase(entry.id) == 0)
+		{
+			// cancelled
+			continue;
+		}
+
+		pendingTasks.add(-1);
+
+		guard.unlock();
+		entry.task();
+		guard.lock();
+	}
+}
@@ -0,0 +1,114 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <queue>
+#include <vector>
+#include <set>
+
+#include "common.h"
+
+/**
+ * @brief A deadline driven timer service shared by all modules.
+ *
+ * Timers are kept in a min-heap ordered by their due time. A single worker thread sleeps until the
+ * earliest deadline (or until a new, earlier timer is added) and then runs every due task in order.
+ */
+class Scheduler
+{
+public:
+
+	typedef std::chrono::time_point<std::chrono::system_clock> timepoint_t;
+	typedef std::function<void()>                              task_t;
+	typedef unsigned long                                      handle_t;
+
+	/**
+	 * @brief Starts the worker thread.
+	 */
+	Scheduler();
+
+	/**
+	 * @brief Stops the worker thread, pending timers are discarded.
+	 */
+	~Scheduler();
+
+	/**
+	 * @brief Runs a task once at the given time.
+	 * @param when Due time
+	 * @param task Task to run on the worker thread
+	 * @return A handle that can be passed to cancel.
+	 */
+	handle_t schedule(timepoint_t when, task_t task);
+
+	/**
+	 * @brief Runs a task once after the given delay.
+	 */
+	handle_t schedule(std::chrono::milliseconds delay, task_t task);
+
+	/**
+	 * @brief Runs a task as soon as possible.
+	 */
+	handle_t post(task_t task);
+
+	/**
+	 * @brief Discards a pending timer. Does nothing if the timer already fired.
+	 * @param timer Handle returned by schedule or post
+	 */
+	void cancel(handle_t timer);
+
+private:
+
+	typedef struct entry_s
+	{
+		timepoint_t when;
+		handle_t    id;
+		task_t      task;
+	} entry_t;
+
+	// orders the heap so that the earliest deadline (and among equal ones the oldest timer) is on top
+	struct later
+	{
+		bool operator()(const entry_t &a, const entry_t &b) const
+		{
+			return a.when > b.when || (a.when == b.when && a.id > b.id);
+		}
+	};
+
+	std::priority_queue<entry_t, std::vector<entry_t>, later> timers;
+	std::set<handle_t>      pending;
+	handle_t                nextId;
+
+	std::mutex              lock;
+	std::condition_variable wakeup;
+	std::thread             *worker;
+	bool                    run;
+
+	void work();
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,337 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "simulation.h"
+#include "calendar.h"
+#include "civildate.h"
+#include "icalendar.h"
+#include "ircclient.h"
+#include "unvquery.h"
+
+using namespace std;
+
+Simulation::Simulation(MantisConfig *config, unsigned int days) :
+	clock(chrono::system_clock::now())
+{
+	this->config = config;
+	this->days   = days;
+}
+
+bool Simulation::run()
+{
+	bool calendarOk = this->runCalendar();
+	bool startupOk  = this->runStartup();
+	bool civilOk    = this->runCivilDate();
+	bool peekOk     = this->runPeekActivity();
+
+	return calendarOk && startupOk && civilOk && peekOk;
+}
+
+string Simulation::timing(elapsed_t elapsed, unsigned long calls)
+{
+	ostringstream stream;
+
+	stream << chrono::duration_cast<chrono::milliseconds>(elapsed).count() << " ms spent in them ("
+	       << (calls ? chrono::duration_cast<chrono::nanoseconds>(elapsed).count() / calls : 0) << " ns each)";
+
+	return stream.str();
+}
+
+bool Simulation::runCalendar()
+{
+	Calendar::timepoint_t start = chrono::system_clock::now();
+	Calendar::timepoint_t end   = start + chrono::hours(24 * this->days);
+	Calendar::timepoint_t due;
+	Calendar              calendar(NULL, false, &this->clock);
+	unsigned long         pumps = 0, starts = 0, warnings = 0, violations = 0;
+	string                line;
+	elapsed_t             elapsed(0);
+
+	this->clock.set(start);
+
+	for (const string &event : this->config->getEvents())
+	{
+		calendar.addEvent(event);
+	}
+
+	for (const MantisConfig::import_t &import : this->config->getImports())
+	{
+		ICalendar::import(import.file, &calendar, chrono::seconds(import.warnTime), import.warnCount);
+	}
+
+	// jump from one due instant to the next
+	while ((due = calendar.nextDue()) < end)
+	{
+		// nothing may be announced ahead of time
+		if (due - chrono::seconds(1) > this->clock.now())
+		{
+			this->clock.set(due - chrono::seconds(1));
+
+			if (!calendar.pumpEvents().empty())
+			{
+				violations++;
+			}
+		}
+
+		this->clock.set(due);
+
+		chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+		istringstream announcements(calendar.pumpEvents());
+
+		elapsed += chrono::steady_clock::now() - begin;
+
+		// something is announced when it is due, and afterwards nothing is due anymore
+		if (announcements.str().empty() || calendar.nextDue() <= due)
+		{
+			violations++;
+		}
+
+		while (getline(announcements, line))
+		{
+			(line.find(" starts now.") != string::npos ? starts : warnings)++;
+		}
+
+		pumps++;
+	}
+
+	cout << "Calendar: " << calendar.numEvents() << " events over " << this->days << " days, "
+	     << starts << " starts and " << warnings << " warnings in " << pumps << " pumps, "
+	     << Simulation::timing(elapsed, pumps) << ", "
+	     << violations << " violations." << endl;
+
+	return violations == 0;
+}
+
+bool Simulation::runStartup()
+{
+	static const char *periods[] = {"minutely", "daily", "weekly", "firstofmonth", "monthly", "yearly"};
+
+	Calendar       calendar(NULL, false, &this->clock);
+	vector<string> events;
+	istringstream  announcements;
+	string         line;
+	unsigned long  violations = 0;
+	elapsed_t      elapsed;
+
+	this->clock.set(chrono::system_clock::now());
+
+	for (int eventNum = 0; eventNum < SIMULATION_STARTUP_EVENTS; eventNum++)
+	{
+		ostringstream event;
+
+		event << SIMULATION_STARTUP_FROM + eventNum * 10007L << " 3600 3 " << periods[eventNum % 6]
+		      << " Event " << eventNum;
+
+		events.push_back(event.str());
+	}
+
+	chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+	for (const string &event : events)
+	{
+		if (!calendar.addEvent(event))
+		{
+			violations++;
+		}
+	}
+
+	elapsed = chrono::steady_clock::now() - begin;
+
+	// every event has to be moved past the present, a start announced now was left behind
+	announcements.str(calendar.pumpEvents());
+
+	while (getline(announcements, line))
+	{
+		if (line.find(" starts now.") != string::npos)
+		{
+			violations++;
+		}
+	}
+
+	cout << "Startup: " << calendar.numEvents() << " recurring events from 2013 added, "
+	     << Simulation::timing(elapsed, events.size()) << ", "
+	     << violations << " violations." << endl;
+
+	return violations == 0;
+}
+
+bool Simulation::runCivilDate()
+{
+	int64_t            last  = (int64_t)SIMULATION_CIVIL_YEARS / 2 * 146097 / 400, first = -last;
+	unsigned long      days  = 0, violations = 0, checksum = 0;
+	elapsed_t          civilElapsed, gmtimeElapsed;
+	struct tm          broken;
+	time_t             seconds;
+	CivilDate::civil_t civil;
+
+	// both have to agree on every day, weekdays included
+	for (int64_t day = first; day < last; day++)
+	{
+		seconds = (time_t)day * 86400;
+		civil   = CivilDate::civilFromDays(day);
+
+		if (!gmtime_r(&seconds, &broken) || civil.year != broken.tm_year + 1900 ||
+		    civil.month != (unsigned int)broken.tm_mon + 1 || civil.day != (unsigned int)broken.tm_mday ||
+		    CivilDate::weekdayFromDays(day) != (unsigned int)broken.tm_wday)
+		{
+			violations++;
+		}
+
+		days++;
+	}
+
+	// then time both over the same days, the checksums keep the work from being optimized away
+	chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+	for (int64_t day = first; day < last; day++)
+	{
+		checksum += CivilDate::civilFromDays(day).day;
+	}
+
+	civilElapsed = chrono::steady_clock::now() - begin;
+	begin        = chrono::steady_clock::now();
+
+	for (int64_t day = first; day < last; day++)
+	{
+		seconds   = (time_t)day * 86400;
+		checksum -= gmtime_r(&seconds, &broken) ? broken.tm_mday : 0;
+	}
+
+	gmtimeElapsed = chrono::steady_clock::now() - begin;
+
+	if (checksum != 0)
+	{
+		violations++;
+	}
+
+	cout << "Civil dates: " << days << " days around the epoch, civilFromDays "
+	     << Simulation::timing(civilElapsed, days) << ", gmtime_r "
+	     << Simulation::timing(gmtimeElapsed, days) << ", "
+	     << violations << " violations." << endl;
+
+	return violations == 0;
+}
+
+bool Simulation::runPeekActivity()
+{
+	const MantisConfig::unvQuery_t &cfg = this->config->getUnvQuery();
+
+	Clock::timepoint_t        start = chrono::system_clock::now();
+	Clock::timepoint_t        end   = start + chrono::hours(24 * this->days);
+	UnvQuery                  *unvQuery;
+	vector<int>               players(SIMULATION_SERVERS);
+	vector<double>            popularity(SIMULATION_SERVERS);
+	deque<pair<time_t, int> > window;
+	map<int, time_t>          lastAnnounced;
+	unsigned long             checks = 0, announcements = 0, violations = 0;
+	elapsed_t                 elapsed(0);
+
+	this->clock.set(start);
+
+	// the master server is never asked, since the simulated status is always fresh
+	try
+	{
+		unvQuery = new UnvQuery("127.0.0.1", cfg.port, cfg.protocol, false, &this->clock);
+	}
+	catch (int)
+	{
+		cout << "Peek activity: Failed to set up the query module." << endl;
+		return false;
+	}
+
+	for (double &weight : popularity)
+	{
+		weight = uniform_real_distribution<double>(0.0, 1.0)(this->random);
+	}
+
+	for (Clock::timepoint_t now = start; now < end; now += chrono::seconds(PEEK_CHECK_PERIOD_S))
+	{
+		time_t seconds = chrono::system_clock::to_time_t(now);
+		double daytime = sin(2 * M_PI * (seconds % 86400) / 86400.0);
+		int    maximum = 0;
+
+		this->clock.set(now);
+
+		// a daily curve that peaks on the popular servers, with some noise
+		for (int serverNum = 0; serverNum < SIMULATION_SERVERS; serverNum++)
+		{
+			double expected = popularity[serverNum] * MAX_PLAYERS / 2 * (1 + daytime);
+
+			players[serverNum] = (int)lround(normal_distribution<double>(expected, 2.0)(this->random));
+			players[serverNum] = MAX(0, MIN(players[serverNum], MAX_PLAYERS));
+			maximum            = MAX(maximum, players[serverNum]);
+		}
+
+		unvQuery->simulateStatus(players);
+
+		chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+		string announcement = unvQuery->checkPeekActivity(PEEK_PERIOD_S, PEEK_MIN_PLAYERS);
+
+		elapsed += chrono::steady_clock::now() - begin;
+
+		// the highest count seen within the period, including this one
+		while (!window.empty() && window.back().second <= maximum)
+		{
+			window.pop_back();
+		}
+
+		window.push_back(make_pair(seconds, maximum));
+
+		while (window.front().first + PEEK_PERIOD_S <= seconds)
+		{
+			window.pop_front();
+		}
+
+		// a count is announced only if it is the period's highest and wasn't announced within it
+		if (!announcement.empty())
+		{
+			if (maximum < PEEK_MIN_PLAYERS || maximum < window.front().second ||
+			    (lastAnnounced.count(maximum) && lastAnnounced[maximum] + PEEK_PERIOD_S >= seconds))
+			{
+				violations++;
+			}
+
+			lastAnnounced[maximum] = seconds;
+			announcements++;
+		}
+
+		checks++;
+	}
+
+	cout << "Peek activity: " << SIMULATION_SERVERS << " servers over " << this->days << " days, "
+	     << announcements << " announcements in " << checks << " checks, "
+	     << Simulation::timing(elapsed, checks) << ", "
+	     << violations << " violations." << endl;
+
+	delete unvQuery;
+
+	return violations == 0;
+}
@@ -0,0 +1,89 @@
+/*
+====================================================================
+Copyright 2013-2014 Maximilian Stahlberg
+
+This file is part of Mantis.
+
+Mantis is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Mantis is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
+====================================================================
+*/
+
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <chrono>
+#include <random>
+#include <string>
+
+#include "common.h"
+#include "clock.h"
+#include "config.h"
+
+// Number of game servers in the synthetic player count trace
+#define SIMULATION_SERVERS 16
+
+// Simulated time span if none is given
+#define SIMULATION_DAYS    365
+
+// Old recurring events added at startup, with start dates spread over 2013
+#define SIMULATION_STARTUP_EVENTS 3000
+#define SIMULATION_STARTUP_FROM   1357000000
+
+// Years of dates around the epoch that are converted by both civildate.h and gmtime_r
+#define SIMULATION_CIVIL_YEARS    600
+
+/**
+ * @brief Fast-forwards the calendar and the player peek detection on a virtual clock.
+ *
+ * The calendar of the configuration is pumped at every instant it asks for, and the peek
+ * detection is fed a synthetic daily player count curve at the rate the clients check it. The
+ * results are compared with what should have been announced, and the time spent is reported, so
+ * that this serves as a correctness check as well as a benchmark. Adding thousands of old
+ * recurring events and the date conversions of the calendar are measured the same way.
+ */
+class Simulation
+{
+public:
+
+	/**
+	 * @param config Configuration whose calendar and query settings are simulated
+	 * @param days   Length of the simulated time span
+	 */
+	Simulation(MantisConfig *config, unsigned int days);
+
+	/**
+	 * @brief Runs all simulations and prints their results.
+	 * @return Whether every check passed.
+	 */
+	bool run();
+
+private:
+
+	MantisConfig *config;
+	unsigned int days;
+	VirtualClock clock;
+	std::mt19937 random;
+
+	typedef std::chrono::steady_clock::duration elapsed_t;
+
+	bool runCalendar();
+	bool runStartup();
+	bool runCivilDate();
+	bool runPeekActivity();
+
+	static std::string timing(elapsed_t elapsed, unsigned long calls);
+};
+
+#endif // SIMULATION_H
@@ -23,13 +23,32 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 #include <sstream>
 #include <cstring>
 #include <chrono>
+#include <set>
 #include <netdb.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 
 #include "unvquery.h"
+#include "log.h"
+#include "metrics.h"
 
 using namespace std;
 
+static Histogram listDuration("mantis_unvquery_list_seconds", "",
+                              "Duration of server list queries to the master server.");
+static Histogram sweepDuration("mantis_unvquery_sweep_seconds", "",
+                               "Duration of status sweeps over all known servers.");
+static Gauge     serversKnown("mantis_unvquery_servers_known", "",
+                              "Servers listed by the master server.");
+static Gauge     serversResponsive("mantis_unvquery_servers_responsive", "",
+                                   "Servers that answered the last status sweep.");
+static Counter   packetsDropped("mantis_unvquery_packets_dropped_total", "",
+                                "Received packets that were not the expected response.");
+static Counter   parseFailures("mantis_unvquery_parse_failures_total", "",
+                               "Status responses that failed to parse.");
+static Counter   coalescedRefreshes("mantis_unvquery_coalesced_refreshes_total", "",
+                                    "Refreshes that waited for one already in flight.");
+
 void UnvQuery::stripColors(char *dst, const char *src, size_t maxChars)
 {
 	bool sequence = false;
@@ -62,28 +81,46 @@ void UnvQuery::stripColors(char *dst, const char *src, size_t maxChars)
 	dst[d] = '\0';
 }
 
-UnvQuery::UnvQuery(string master, unsigned short port, unsigned short protocol, bool useColor)
+string UnvQuery::indexKey(const char *name)
+{
+	char key[128];
+
+	UnvQuery::stripColors(key, name, sizeof(key));
+
+	for (char *c = key; *c; c++)
+	{
+		*c = tolower(*c);
+	}
+
+	return string(key);
+}
+
+UnvQuery::UnvQuery(string master, unsigned short port, unsigned short protocol, bool useColor, Clock *clock)
 {
-	hostent     *targetHost;
 	sockaddr_in masterLocalAddr;
 	sockaddr_in serverLocalAddr;
 	timeval     timeout;
 
 	// copy parameters
 	this->useColor = useColor;
+	this->clock    = clock;
 
 	// init timers and confitions
 	this->lastServerListQuery   = 0;
 	this->lastServerStatusQuery = 0;
 	this->serverListQuerySuccessful   = false;
 	this->serverStatusQuerySuccessful = false;
+	this->sweeping                    = false;
+	this->serverList   = make_shared<vector<server_t> >();
+	this->serverStatus = make_shared<vector<serverStatus_t> >();
+	this->serverIndex  = make_shared<map<string, string> >();
 	memset(&this->peekActivityData, 0, sizeof(this->peekActivityData));
 
-	// build query strings
-	snprintf(this->getServersQuery, sizeof(this->getServersQuery), GETSERVERSQUERY, protocol);
-
-	// resolve master address
-	targetHost = gethostbyname(master.c_str());
+	// resolve master address and build query strings
+	if (!this->setMaster(master, port, protocol))
+	{
+		throw -4;
+	}
 
 	// assemble master bind address
 	memset(&masterLocalAddr, 0, sizeof(masterLocalAddr));
@@ -97,17 +134,11 @@ UnvQuery::UnvQuery(string master, unsigned short port, unsigned short protocol,
 	serverLocalAddr.sin_port   = 0;
 	serverLocalAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	// assemble master target address
-	memset(&this->masterAddr, 0, sizeof(this->masterAddr));
-	this->masterAddr.sin_family = AF_INET;
-	this->masterAddr.sin_port   = htons(port);
-	memcpy((void *)&this->masterAddr.sin_addr, targetHost->h_addr_list[0], targetHost->h_length);
-
 	// create master socket
 	this->masterSock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (this->masterSock < 0)
 	{
-		cerr << FATAL << "Failed to create socket." << endl;
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to create socket.");
 		throw -1;
 	}
 
@@ -116,14 +147,14 @@ UnvQuery::UnvQuery(string master, unsigned short port, unsigned short protocol,
 	timeout.tv_usec = 0;
 	if (setsockopt(this->masterSock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0)
 	{
-		cerr << FATAL << "Failed to set socket options." << endl;
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to set socket options.");
 		throw -2;
 	}
 
 	// bind master socket
 	if (bind(this->masterSock, (sockaddr *)&masterLocalAddr, sizeof(masterLocalAddr)) < 0)
 	{
-		cerr << FATAL << "Failed to bind socket to " << port << "." << endl;
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to bind socket to " << port << ".");
 		throw -3;
 	}
 
@@ -131,7 +162,7 @@ UnvQuery::UnvQuery(string master, unsigned short port, unsigned short protocol,
 	this->serverSock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (this->serverSock < 0)
 	{
-		cerr << FATAL << "Failed to create socket." << endl;
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to create socket.");
 		throw -1;
 	}
 
@@ -140,18 +171,49 @@ UnvQuery::UnvQuery(string master, unsigned short port, unsigned short protocol,
 	timeout.tv_usec = 0;
 	if (setsockopt(this->serverSock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0)
 	{
-		cerr << FATAL << "Failed to set socket options." << endl;
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to set socket options.");
 		throw -2;
 	}
 
 	// bind server socket
 	if (bind(this->serverSock, (sockaddr *)&serverLocalAddr, sizeof(serverLocalAddr)) < 0)
 	{
-		cerr << FATAL << "Failed to bind socket to " << port << "." << endl;
+		LOG(Log::LEVEL_FATAL, FATAL << "Failed to bind socket to " << port << ".");
 		throw -3;
 	}
 }
 
+bool UnvQuery::setMaster(string master, unsigned short port, unsigned short protocol)
+{
+	hostent *targetHost;
+
+	// resolve master address
+	targetHost = gethostbyname(master.c_str());
+
+	if (!targetHost)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to resolve master server " << master << ".");
+		return false;
+	}
+
+	lock_guard<mutex> guard(this->lock);
+
+	// build query strings
+	snprintf(this->getServersQuery, sizeof(this->getServersQuery), GETSERVERSQUERY, protocol);
+
+	// assemble master target address
+	memset(&this->masterAddr, 0, sizeof(this->masterAddr));
+	this->masterAddr.sin_family = AF_INET;
+	this->masterAddr.sin_port   = htons(port);
+	memcpy((void *)&this->masterAddr.sin_addr, targetHost->h_addr_list[0], targetHost->h_length);
+
+	// the known servers belong to the previous master
+	this->lastServerListQuery   = 0;
+	this->lastServerStatusQuery = 0;
+
+	return true;
+}
+
 void UnvQuery::setUseColor(bool useColor)
 {
 	this->useColor = useColor;
@@ -164,77 +226,248 @@ bool UnvQuery::usesColor()
 
 bool UnvQuery::refresh(time_t minListQueryPeriod, time_t minStatusQueryPeriod)
 {
-	return ( this->refreshServerList(minListQueryPeriod) &&
-	         this->refreshServerStatus(minStatusQueryPeriod) );
+	return this->sweep(true, true, false, minListQueryPeriod, minStatusQueryPeriod);
 }
 
 bool UnvQuery::refresh()
 {
-	return ( this->refreshServerList() &&
-	         this->refreshServerStatus() );
+	return this->sweep(true, true, true, 0, 0);
+}
+
+void UnvQuery::invalidate()
+{
+	lock_guard<mutex> guard(this->lock);
+
+	this->lastServerListQuery   = 0;
+	this->lastServerStatusQuery = 0;
 }
 
 bool UnvQuery::refreshServerList(time_t minPeriod)
 {
-	if (this->lastServerListQuery + MAX(minPeriod, TIMEOUT_S + 1) <= time(NULL))
+	return this->sweep(true, false, false, minPeriod, 0);
+}
+
+bool UnvQuery::refreshServerStatus(time_t minPeriod)
+{
+	return this->sweep(false, true, false, 0, minPeriod);
+}
+
+bool UnvQuery::refreshServerList()
+{
+	return this->sweep(true, false, true, 0, 0);
+}
+
+bool UnvQuery::refreshServerStatus()
+{
+	return this->sweep(false, true, true, 0, 0);
+}
+
+bool UnvQuery::isDue(time_t last, bool successful, time_t minPeriod, time_t now)
+{
+	// query again after the minimum period, or after a timeout if the last query failed
+	return ( last + MAX(minPeriod, TIMEOUT_S + 1) <= now ||
+	         (!successful && last + TIMEOUT_S < now) );
+}
+
+bool UnvQuery::sweep(bool wantList, bool wantStatus, bool forced, time_t minListPeriod, time_t minStatusPeriod,
+                     const statusHandler_t &handler)
+{
+	unique_lock<mutex> guard(this->lock);
+	bool               joined = false;
+	bool               list, status, successful, streamed = false;
+	time_t             now;
+	statusList_t       replay;
+
+	// only one sweep may use the sockets, the others share its result
+	while (this->sweeping)
 	{
-		return refreshServerList();
+		joined = true;
+		this->sweepDone.wait(guard);
 	}
-	else if (!this->serverListQuerySuccessful &&
-	         this->lastServerListQuery + TIMEOUT_S < time(NULL))
+
+	if (joined)
 	{
-		return refreshServerList();
+		coalescedRefreshes.inc();
+	}
+
+	now = this->clock->time();
+
+	if (forced)
+	{
+		list   = wantList   && !joined;
+		status = wantStatus && !joined;
 	}
 	else
 	{
-		return this->serverListQuerySuccessful;
+		list   = wantList   && this->isDue(this->lastServerListQuery, this->serverListQuerySuccessful,
+		                                   minListPeriod, now);
+		status = wantStatus && this->isDue(this->lastServerStatusQuery, this->serverStatusQuerySuccessful,
+		                                   minStatusPeriod, now);
 	}
+
+	if (list || status)
+	{
+		serverList_t                            knownList = this->serverList;
+		shared_ptr<vector<serverStatus_t> >     newStatus;
+		sockaddr_in                             master    = this->masterAddr;
+		string                                  query     = this->getServersQuery;
+		bool                                    listOk    = this->serverListQuerySuccessful;
+		bool                                    statusOk  = this->serverStatusQuerySuccessful;
+
+		this->sweeping = true;
+		guard.unlock();
+
+		if (list)
+		{
+			shared_ptr<vector<server_t> > newList = make_shared<vector<server_t> >();
+
+			listOk    = this->queryServerList(master, query.c_str(), *newList);
+			knownList = newList;
+		}
+
+		// a status sweep over a failed server list is pointless
+		if (status && (!list || listOk))
+		{
+			newStatus = make_shared<vector<serverStatus_t> >();
+			statusOk  = this->queryServerStatus(*knownList, *newStatus, handler);
+			streamed  = true;
+		}
+
+		guard.lock();
+
+		if (list)
+		{
+			this->serverList                = knownList;
+			this->lastServerListQuery       = now;
+			this->serverListQuerySuccessful = listOk;
+		}
+
+		if (newStatus)
+		{
+			this->publishStatus(newStatus, statusOk, now);
+		}
+
+		this->sweeping = false;
+		this->sweepDone.notify_all();
+	}
+
+	successful = ( (!wantList   || this->serverListQuerySuccessful) &&
+	               (!wantStatus || this->serverStatusQuerySuccessful) );
+
+	// the handler saw the responses of a sweep made on our behalf, otherwise show it the last one
+	if (handler && wantStatus && successful && !streamed)
+	{
+		replay = this->serverStatus;
+		guard.unlock();
+
+		for (const serverStatus_t &ss : *replay)
+		{
+			handler(ss);
+		}
+	}
+
+	return successful;
 }
 
-bool UnvQuery::refreshServerStatus(time_t minPeriod)
+void UnvQuery::publishStatus(shared_ptr<vector<serverStatus_t> > status, bool successful, time_t now)
 {
-	if (this->lastServerStatusQuery + MAX(minPeriod, TIMEOUT_S + 1) <= time(NULL))
+	shared_ptr<map<string, string> > index = make_shared<map<string, string> >();
+
+	// index the responsive servers for lookups by name or address prefix
+	for (const serverStatus_t &ss : *status)
 	{
-		return refreshServerStatus();
+		(*index)[UnvQuery::indexKey(ss.name)] = ss.addr;
+		(*index)[ss.addr]                     = ss.addr;
 	}
-	else if (!this->serverStatusQuerySuccessful &&
-	         this->lastServerStatusQuery + TIMEOUT_S < time(NULL))
+
+	this->serverStatus                = status;
+	this->serverIndex                 = index;
+	this->lastServerStatusQuery       = now;
+	this->serverStatusQuerySuccessful = successful;
+
+	// save timestamps for total numbers of players
+	for (const serverStatus_t &ss : *status)
 	{
-		return refreshServerStatus();
+		this->peekActivityData[ss.numPlayers[TEAM_1] + ss.numPlayers[TEAM_2]].lastSeen = now;
 	}
-	else
+}
+
+void UnvQuery::simulateStatus(const vector<int> &players)
+{
+	shared_ptr<vector<serverStatus_t> > status = make_shared<vector<serverStatus_t> >(players.size());
+	lock_guard<mutex>                   guard(this->lock);
+	time_t                              now    = this->clock->time();
+
+	for (size_t serverNum = 0; serverNum < players.size(); serverNum++)
 	{
-		return this->serverStatusQuerySuccessful;
+		serverStatus_t &ss        = (*status)[serverNum];
+		int            numPlayers = MAX(0, MIN(players[serverNum], MAX_PLAYERS));
+
+		memset(&ss, 0, sizeof(ss));
+		snprintf(ss.addr, sizeof(ss.addr), "127.0.0.%u:%u", (unsigned int)(serverNum % 254) + 1, DEFAULT_PORT);
+		snprintf(ss.name, sizeof(ss.name), "Simulated Server %u", (unsigned int)serverNum + 1);
+		snprintf(ss.map,  sizeof(ss.map),  "plat23");
+
+		// players alternate between the teams, the remaining slots are free
+		ss.numClientSlots = MAX_PLAYERS;
+
+		for (int slot = 0; slot < numPlayers; slot++)
+		{
+			ss.clientTeam[slot] = slot % 2 ? TEAM_2 : TEAM_1;
+		}
+
+		this->analyzeClientData(&ss);
 	}
+
+	// the server list counts as fresh too, so that refreshes don't go to the network
+	this->lastServerListQuery       = now;
+	this->serverListQuerySuccessful = true;
+
+	this->publishStatus(status, true, now);
 }
 
-bool UnvQuery::refreshServerList()
+UnvQuery::statusList_t UnvQuery::currentStatus()
+{
+	lock_guard<mutex> guard(this->lock);
+
+	return this->serverStatus;
+}
+
+bool UnvQuery::queryServerList(const sockaddr_in &master, const char *query, vector<server_t> &list)
 {
 	char          response[1024];
 	unsigned char ip[4], port[2];
 	int           responseLen = 0, position;
+	bool          successful  = false;
+	server_t      server;
 
-	this->lastServerListQuery = time(NULL);
-	cout << OUTGOING << "Querying master server..." << endl;
+	Histogram::timepoint_t start = Histogram::now();
+
+	LOG(Log::LEVEL_INFO, OUTGOING << "Querying master server...");
 
 	// send master request
-	sendto(this->masterSock, this->getServersQuery, strlen(this->getServersQuery), 0,
-	        (sockaddr *)&this->masterAddr, sizeof(this->masterAddr));
+	sendto(this->masterSock, query, strlen(query), 0, (sockaddr *)&master, sizeof(master));
 
-	for (this->numKnown = 0, this->serverListQuerySuccessful = false; ; )
+	for (;;)
 	{
 		// read until we get a fitting response or timeout
 		for (response[0] = '\0'; strncmp(response, GETSERVERSRESPONSE, strlen(GETSERVERSRESPONSE)) != 0 && responseLen >= 0; )
 		{
 			responseLen = recv(this->masterSock, response, sizeof(response), 0);
+
+			if (responseLen >= 0 && strncmp(response, GETSERVERSRESPONSE, strlen(GETSERVERSRESPONSE)) != 0)
+			{
+				packetsDropped.inc();
+			}
 		}
 
 		// check for timeout/error
 		if ( responseLen < 0 )
 		{
-			if (this->serverListQuerySuccessful == false)
+			if (successful == false)
 			{
-				cout << ERROR << "Failed to query master for servers." << endl;
+				LOG(Log::LEVEL_ERROR, ERROR << "Failed to query master for servers.");
+				listDuration.observeSince(start);
 				return false;
 			}
 			else {
@@ -243,13 +476,13 @@ bool UnvQuery::refreshServerList()
 			}
 		}
 
-		cout << INCOMING << "Received server list packet from master server." << endl;
-		this->serverListQuerySuccessful = true;
+		LOG(Log::LEVEL_DEBUG, INCOMING << "Received server list packet from master server.");
+		successful = true;
 
 		position = strlen(GETSERVERSRESPONSE);
 
 		// extract servers
-		for (; this->numKnown < MAX_SERVERS; this->numKnown++ )
+		while ( list.size() < MAX_SERVERS )
 		{
 			if ( position >= responseLen )
 			{
@@ -264,28 +497,32 @@ bool UnvQuery::refreshServerList()
 			position += 7;
 
 			// extract address in NBO
-			this->servers[this->numKnown] = htonl((ip[0] << 24) + (ip[1] << 16) + (ip[2] << 8) + ip[3]);
-			this->ports[this->numKnown]   = htons((port[0] << 8) + port[1]);
+			server.addr = htonl((ip[0] << 24) + (ip[1] << 16) + (ip[2] << 8) + ip[3]);
+			server.port = htons((port[0] << 8) + port[1]);
+
+			list.push_back(server);
 		}
 	}
 
+	listDuration.observeSince(start);
+	serversKnown.set(list.size());
+
 	return true;
 }
 
-bool UnvQuery::refreshServerStatus()
+bool UnvQuery::queryServerStatus(const vector<server_t> &list, vector<serverStatus_t> &status,
+                                 const statusHandler_t &handler)
 {
-	sockaddr_in serverAddr;
-	char        response[1024], addrStr[32];
-	int         responseLen, serverNum;
-	socklen_t   serverAddrLen;
-
-	this->lastServerStatusQuery = time(NULL);
+	sockaddr_in    serverAddr;
+	char           response[1024], addrStr[32];
+	int            responseLen, responseNum;
+	socklen_t      serverAddrLen;
+	serverStatus_t ss;
 
-	this->numResponsive = 0;
+	Histogram::timepoint_t start = Histogram::now();
 
-	if (this->numKnown == 0)
+	if (list.empty())
 	{
-		this->serverStatusQuerySuccessful = true;
 		return true;
 	}
 
@@ -293,18 +530,20 @@ bool UnvQuery::refreshServerStatus()
 	serverAddr.sin_family = AF_INET;
 
 	// request status from all known servers
-	for ( serverNum = 0; serverNum < this->numKnown; serverNum++ )
+	for (const server_t &server : list)
 	{
 		// assemble server address
-		serverAddr.sin_addr.s_addr = this->servers[serverNum];
-		serverAddr.sin_port = this->ports[serverNum];
+		serverAddr.sin_addr.s_addr = server.addr;
+		serverAddr.sin_port = server.port;
 
 		// request server status
 		sendto(this->serverSock, GETSTATUSQUERY, strlen(GETSTATUSQUERY), 0, (sockaddr *)&serverAddr, sizeof(serverAddr));
 	}
 
+	status.reserve(list.size());
+
 	// receive status responses
-	for ( serverNum = 0; serverNum < MAX_SERVERS; serverNum++ )
+	for ( responseNum = 0; responseNum < MAX_SERVERS; responseNum++ )
 	{
 		serverAddrLen = sizeof(serverAddr);
 		responseLen = recvfrom(this->serverSock, response, sizeof(response), 0, (sockaddr *)&serverAddr, &serverAddrLen);
@@ -319,27 +558,166 @@ bool UnvQuery::refreshServerStatus()
 		snprintf(addrStr, sizeof(addrStr), "%s:%d", inet_ntoa(serverAddr.sin_addr), ntohs(serverAddr.sin_port));
 
 		// parse the response
-		if ( parseStatusResponse(this->numResponsive, addrStr, response, responseLen) )
+		if ( parseStatusResponse(&ss, addrStr, response, responseLen) )
 		{
 			// analyze data found in client and bot items
-			this->analyzeClientData(this->numResponsive++);
+			this->analyzeClientData(&ss);
+			status.push_back(ss);
+
+			if (handler)
+			{
+				handler(ss);
+			}
+		}
+	}
+
+	sweepDuration.observeSince(start);
+	serversResponsive.set(status.size());
+
+	return ( status.size() > 0 );
+}
+
+bool UnvQuery::resolveServer(string server, sockaddr_in &addr, string &error)
+{
+	serverIndex_t  index;
+	set<string>    candidates;
+	string         key = UnvQuery::indexKey(server.c_str()), target = server, host;
+	size_t         colon;
+	int            port;
+
+	{
+		lock_guard<mutex> guard(this->lock);
+		index = this->serverIndex;
+	}
+
+	// an exact match wins, otherwise the prefix has to be unique among the known servers
+	auto exact = index->find(key);
+
+	if (exact != index->end())
+	{
+		target = exact->second;
+	}
+	else
+	{
+		for (auto it = index->lower_bound(key); it != index->end() && it->first.compare(0, key.size(), key) == 0; it++)
+		{
+			candidates.insert(it->second);
+		}
+
+		if (candidates.size() == 1)
+		{
+			target = *candidates.begin();
 		}
+		else if (candidates.size() > 1)
+		{
+			ostringstream stream;
+			unsigned int  listed = 0;
+
+			stream << "Which one?";
+
+			for (const string &candidate : candidates)
+			{
+				if (listed++ == MAX_CANDIDATES)
+				{
+					stream << " ...";
+					break;
+				}
+
+				stream << " unv://" << candidate;
+			}
+
+			error = stream.str();
+			return false;
+		}
+	}
+
+	// otherwise try to read an address
+	colon = target.find(':');
+	host  = target.substr(0, colon);
+	port  = (colon == string::npos) ? DEFAULT_PORT : atoi(target.c_str() + colon + 1);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port   = htons(port);
+
+	if (port <= 0 || port > 0xffff || !inet_aton(host.c_str(), &addr.sin_addr))
+	{
+		error = "Don't know a server " + server + ".";
+		return false;
 	}
 
-	this->serverStatusQuerySuccessful = ( this->numResponsive > 0 );
-	return this->serverStatusQuerySuccessful;
+	return true;
 }
 
-bool UnvQuery::parseStatusResponse(int infoNum, const char *address, const char *response, size_t responseLen)
+bool UnvQuery::queryServer(const sockaddr_in &addr, serverStatus_t &ss, vector<player_t> &players, int &ping)
 {
-	serverStatus_t *ss = &this->status[infoNum];
+	char                   response[16384], addrStr[32];
+	int                    sock, responseLen = -1;
+	timeval                timeout;
+	Histogram::timepoint_t start;
+
+	// a socket of our own keeps the answer from being taken by a sweep
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to create socket.");
+		return false;
+	}
+
+	timeout.tv_sec  = SERVER_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (SERVER_TIMEOUT_MS % 1000) * 1000;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0 ||
+	    connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		LOG(Log::LEVEL_ERROR, ERROR << "Failed to set up socket.");
+		close(sock);
+		return false;
+	}
+
+	snprintf(addrStr, sizeof(addrStr), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	LOG(Log::LEVEL_DEBUG, OUTGOING << "Querying server " << addrStr << "...");
+
+	start = Histogram::now();
+	send(sock, GETSTATUSQUERY, strlen(GETSTATUSQUERY), 0);
+
+	// read until we get a fitting response or the deadline passes
+	while (Histogram::now() - start < chrono::milliseconds(SERVER_TIMEOUT_MS))
+	{
+		responseLen = recv(sock, response, sizeof(response), 0);
+
+		if (responseLen < 0 || strncmp(response, GETSTATUSRESPONSE, strlen(GETSTATUSRESPONSE)) == 0)
+		{
+			break;
+		}
+
+		packetsDropped.inc();
+		responseLen = -1;
+	}
 
+	ping = chrono::duration_cast<chrono::milliseconds>(Histogram::now() - start).count();
+	close(sock);
+
+	if (responseLen < 0 || !this->parseStatusResponse(&ss, addrStr, response, responseLen))
+	{
+		return false;
+	}
+
+	this->analyzeClientData(&ss);
+	UnvQuery::parsePlayers(response, responseLen, players);
+
+	return true;
+}
+
+bool UnvQuery::parseStatusResponse(serverStatus_t *ss, const char *address, const char *response, size_t responseLen)
+{
 	size_t pos;
 	int    fieldLen;
 
 	if ( strncmp(response, GETSTATUSRESPONSE, strlen(GETSTATUSRESPONSE)) != 0 )
 	{
-		cout << "Quake3Query: Bad getstatus response received from address " << address << "." << endl;
+		LOG_LIMITED(Log::LEVEL_DEBUG, PARSINGSTATUS + string(address), "Quake3Query: Bad getstatus response received from address " << address << ".");
+		packetsDropped.inc();
 		return false;
 	}
 
@@ -352,10 +730,11 @@ bool UnvQuery::parseStatusResponse(int infoNum, const char *address, const char
 
 	while ( pos < responseLen && response[pos] == '\\' )
 	{
-		fieldLen = this->parseStatusResponseField(infoNum, address, response + pos, responseLen - pos);
+		fieldLen = this->parseStatusResponseField(ss, address, response + pos, responseLen - pos);
 
 		if (fieldLen <= 0)
 		{
+			parseFailures.inc();
 			return false;
 		}
 
@@ -365,7 +744,7 @@ bool UnvQuery::parseStatusResponse(int infoNum, const char *address, const char
 	return true;
 }
 
-int UnvQuery::parseStatusResponseField(int statusNum, const char *address, const char *field, size_t maxLen)
+int UnvQuery::parseStatusResponseField(serverStatus_t *ss, const char *address, const char *field, size_t maxLen)
 {
 	char   key[1024], value[1024];
 	size_t pos = 0, keyPos = 0, valuePos = 0;
@@ -373,7 +752,7 @@ int UnvQuery::parseStatusResponseField(int statusNum, const char *address, const
 	// jump over first backslash
 	if ( field[pos++] != '\\' )
 	{
-		cout << NOTICE << PARSINGSTATUS << "Field doesn't start with a backslash in status packet from address " << address << "." << endl;
+		LOG_LIMITED(Log::LEVEL_INFO, PARSINGSTATUS + string(address), NOTICE << PARSINGSTATUS << "Field doesn't start with a backslash in status packet from address " << address << ".");
 		return -1;
 	}
 
@@ -382,13 +761,13 @@ int UnvQuery::parseStatusResponseField(int statusNum, const char *address, const
 	{
 		if ( keyPos >= sizeof(key) )
 		{
-			cout << NOTICE << PARSINGSTATUS << "Key too big to parse in status packet from address " << address << "." << endl;
+			LOG_LIMITED(Log::LEVEL_INFO, PARSINGSTATUS + string(address), NOTICE << PARSINGSTATUS << "Key too big to parse in status packet from address " << address << ".");
 			return -1;
 		}
 
 		if ( pos >= maxLen )
 		{
-			cout << NOTICE << PARSINGSTATUS << "End of field while parsing key in status packet from address " << address << "." << endl;
+			LOG_LIMITED(Log::LEVEL_INFO, PARSINGSTATUS + string(address), NOTICE << PARSINGSTATUS << "End of field while parsing key in status packet from address " << address << ".");
 			return -1;
 		}
 
@@ -405,7 +784,7 @@ int UnvQuery::parseStatusResponseField(int statusNum, const char *address, const
 	// sanity check key
 	if (keyPos == 0)
 	{
-		cout << NOTICE << PARSINGSTATUS << "Found empty key in status packet from address " << address << "." << endl;
+		LOG_LIMITED(Log::LEVEL_INFO, PARSINGSTATUS + string(address), NOTICE << PARSINGSTATUS << "Found empty key in status packet from address " << address << ".");
 		return -1;
 	}
 
@@ -414,7 +793,7 @@ int UnvQuery::parseStatusResponseField(int statusNum, const char *address, const
 	{
 		if ( valuePos >= sizeof(value) )
 		{
-			cout << NOTICE << PARSINGSTATUS << "Value too big to parse in status packet from address " << address << "." << endl;
+			LOG_LIMITED(Log::LEVEL_INFO, PARSINGSTATUS + string(address), NOTICE << PARSINGSTATUS << "Value too big to parse in status packet from address " << address << ".");
 			return -1;
 		}
 
@@ -436,19 +815,17 @@ int UnvQuery::parseStatusResponseField(int statusNum, const char *address, const
 	// sanity check value
 	if (valuePos == 0)
 	{
-		cout << NOTICE << PARSINGSTATUS << "Found empty value for key " << key << " in status packet from address " << address << "." << endl;
+		LOG_LIMITED(Log::LEVEL_INFO, PARSINGSTATUS + string(address), NOTICE << PARSINGSTATUS << "Found empty value for key " << key << " in status packet from address " << address << ".");
 		return -1;
 	}
 
-	this->parseStatusResponseKeyValue(statusNum, key, value);
+	this->parseStatusResponseKeyValue(ss, key, value);
 
 	return pos;
 }
 
-void UnvQuery::parseStatusResponseKeyValue(int statusNum, const char *key, const char *value)
+void UnvQuery::parseStatusResponseKeyValue(serverStatus_t *ss, const char *key, const char *value)
 {
-	serverStatus_t *ss = &this->status[statusNum];
-
 	if (strcmp(key, "P") == 0)
 	{
 		ss->numClientSlots = MIN(strlen(value), MAX_PLAYERS);
@@ -506,12 +883,8 @@ void UnvQuery::parseStatusResponseKeyValue(int statusNum, const char *key, const
 	}
 }
 
-void UnvQuery::analyzeClientData(int statusNum)
+void UnvQuery::analyzeClientData(serverStatus_t *ss)
 {
-	serverStatus_t *ss = &this->status[statusNum];
-
-	int numActivePlayers = 0;
-
 	for (int slot = 0; slot < ss->numClientSlots; slot++)
 	{
 		team_t team = ss->clientTeam[slot];
@@ -530,36 +903,57 @@ void UnvQuery::analyzeClientData(int statusNum)
 		else
 		{
 			ss->numPlayers[team]++;
-
-			if (team != TEAM_SPEC)
-			{
-				numActivePlayers++;
-			}
 		}
 	}
+}
 
-	// save timestamp for total number of players
-	this->peekActivityData[numActivePlayers].lastSeen = time(NULL);
+void UnvQuery::parsePlayers(const char *response, size_t responseLen, vector<player_t> &players)
+{
+	const char *end  = response + responseLen;
+	const char *line = (const char *)memchr(response, '\n', responseLen);
+	const char *next;
+	char       name[128];
+	player_t   player;
+
+	// the first line holds the header and the info string, then follows one line per client
+	while (line && ++line < end)
+	{
+		next = (const char *)memchr(line, '\n', end - line);
+
+		if (sscanf(string(line, next ? next : end).c_str(), "%d %d \"%127[^\"]\"",
+		           &player.score, &player.ping, name) == 3)
+		{
+			player.name = name;
+			players.push_back(player);
+		}
+
+		line = next;
+	}
 }
 
 int UnvQuery::numberResponsiveServers()
 {
-	return this->numResponsive;
+	return this->currentStatus()->size();
 }
 
 std::string UnvQuery::printServerLine(int serverNum)
 {
-	std::ostringstream stream;
-	serverStatus_t     *s;
-	int                playing;
-	char               name[128];
+	statusList_t status = this->currentStatus();
 
-	if (serverNum < 0 || serverNum >= this->numResponsive)
+	if (serverNum < 0 || serverNum >= (int)status->size())
 	{
 		return "";
 	}
 
-	s = &this->status[serverNum];
+	return this->printServerLine(&(*status)[serverNum]);
+}
+
+std::string UnvQuery::printServerLine(const serverStatus_t *s)
+{
+	std::ostringstream stream;
+	int                playing;
+	char               name[128];
+
 	playing = s->numPlayers[TEAM_1] + s->numPlayers[TEAM_2];
 	UnvQuery::stripColors(name, s->name, sizeof(name));
 
@@ -597,40 +991,56 @@ std::string UnvQuery::printServerLine(int serverNum)
 	return stream.str();
 }
 
-std::string UnvQuery::printActiveServers()
+std::string UnvQuery::streamActiveServers(lineHandler_t handler, unsigned int maxLines)
 {
 	std::ostringstream stream;
-	serverStatus_t     *ss;
-	int                playing;
+	unsigned int       responsive = 0, active = 0;
+	bool               successful;
 
-	if (!this->refresh(PRINTACTIVESERVERS_LISTPERIOD, PRINTACTIVESERVERS_STATUSPERIOD))
+	successful = this->sweep(true, true, false, ACTIVESERVERS_LISTPERIOD, ACTIVESERVERS_STATUSPERIOD,
+	                         [&](const serverStatus_t &ss)
+	{
+		responsive++;
+
+		if (ss.numPlayers[TEAM_1] + ss.numPlayers[TEAM_2] == 0)
+		{
+			return;
+		}
+
+		if (active++ < maxLines)
+		{
+			handler(this->printServerLine(&ss));
+		}
+	});
+
+	if (!successful)
 	{
 		return "Failed to retrieve server status info.";
 	}
 
-	// build a list of all active servers
-	for (int serverNum = 0; serverNum < this->numResponsive; serverNum++)
+	if (active == 0)
 	{
-		ss = &this->status[serverNum];
-
-		playing = ss->numPlayers[TEAM_1] + ss->numPlayers[TEAM_2];
+		return "";
+	}
 
-		if (playing == 0)
-		{
-			continue;
-		}
+	stream << active << " of " << responsive << " servers " << (active == 1 ? "has" : "have") << " players";
 
-		stream << this->printServerLine(serverNum);
+	if (active > maxLines)
+	{
+		stream << ", " << (active - maxLines) << " not shown";
 	}
 
+	stream << ".";
+
 	return stream.str();
 }
 
 std::string UnvQuery::checkPeekActivity(time_t period, int minPlayers)
 {
-	int    periodMaxPlayers = 0, currentMaxPlayers = 0, serverPlayers;
-	int    currentMaxServerNum = 0;
-	time_t *lastInformed;
+	int          periodMaxPlayers = 0, currentMaxPlayers = 0, serverPlayers;
+	int          currentMaxServerNum = 0;
+	time_t       *lastInformed;
+	statusList_t status;
 
 	if (!this->refresh(CHECKPEEKACTIVITY_LISTPERIOD, CHECKPEEKACTIVITY_STATUSPERIOD))
 	{
@@ -645,10 +1055,14 @@ std::string UnvQuery::checkPeekActivity(time_t period, int minPlayers)
 		}
 	}
 
+	status = this->currentStatus();
+
+	unique_lock<mutex> guard(this->lock);
+
 	// get maximum in period
 	for (int playerCount = MAX_PLAYERS; playerCount > 0; playerCount--)
 	{
-		if (this->peekActivityData[playerCount].lastSeen + period > time(NULL))
+		if (this->peekActivityData[playerCount].lastSeen + period > this->clock->time())
 		{
 			periodMaxPlayers = playerCount;
 			break;
@@ -656,13 +1070,13 @@ std::string UnvQuery::checkPeekActivity(time_t period, int minPlayers)
 	}
 
 	// calculate number of players per server and remember maximum
-	for (int serverNum = 0; serverNum < this->numResponsive; serverNum++)
+	for (int serverNum = 0; serverNum < (int)status->size(); serverNum++)
 	{
 		serverPlayers = 0;
 
 		for (int team = TEAM_SPEC + 1; team < NUM_TEAMS; team++)
 		{
-			serverPlayers += this->status[serverNum].numPlayers[team];
+			serverPlayers += (*status)[serverNum].numPlayers[team];
 		}
 
 		if (serverPlayers > currentMaxPlayers)
@@ -677,19 +1091,87 @@ std::string UnvQuery::checkPeekActivity(time_t period, int minPlayers)
 	// if the current maximum is the maximum of the period and hasn't been advertised, do so now
 	if (currentMaxPlayers >= minPlayers &&
 	    currentMaxPlayers >= periodMaxPlayers &&
-	    *lastInformed + period < time(NULL))
+	    *lastInformed + period < this->clock->time())
 	{
-		*lastInformed = time(NULL);
+		*lastInformed = this->clock->time();
+		guard.unlock();
 
 		if (currentMaxPlayers == 0)
 		{
 			return "";
 		}
 
-		return this->printServerLine(currentMaxServerNum);
+		return this->printServerLine(&(*status)[currentMaxServerNum]);
 	}
 	else
 	{
 		return "";
 	}
 }
+
+std::string UnvQuery::printServerDetails(std::string server)
+{
+	std::ostringstream stream;
+	sockaddr_in        addr;
+	string             error;
+	serverStatus_t     ss;
+	vector<player_t>   players;
+	int                ping;
+	char               name[128];
+
+	if (!this->resolveServer(server, addr, error))
+	{
+		return error;
+	}
+
+	if (!this->queryServer(addr, ss, players, ping))
+	{
+		return "No answer from unv://" + string(inet_ntoa(addr.sin_addr)) + ":" +
+		       to_string(ntohs(addr.sin_port)) + ".";
+	}
+
+	UnvQuery::stripColors(name, ss.name, sizeof(name));
+
+	stream << B_ON << name << B_OFF << " "
+	       << "playing " << B_ON << ss.map << B_OFF << " "
+	       << "- unv://" << ss.addr << ", ping " << ping << " ms"
+	       << endl;
+
+	for (team_t team : {TEAM_1, TEAM_2, TEAM_SPEC})
+	{
+		switch (team)
+		{
+			case TEAM_1: stream << C("RED")    << "Aliens";     break;
+			case TEAM_2: stream << C("BLUE")   << "Humans";     break;
+			default:     stream << C("YELLOW") << "Spectators"; break;
+		}
+
+		stream << C_OFF << " " << ss.numPlayers[team];
+		if (ss.numBots[team] > 0)
+		stream << "+" << ss.numBots[team];
+
+		// player lines follow the order of the occupied slots
+		for (int slot = 0, player = 0, listed = 0; slot < ss.numClientSlots; slot++)
+		{
+			if (ss.clientTeam[slot] == FREE_SLOT)
+			{
+				continue;
+			}
+
+			if (ss.clientTeam[slot] == team && player < (int)players.size())
+			{
+				UnvQuery::stripColors(name, players[player].name.c_str(), sizeof(name));
+
+				stream << (listed++ ? ", " : ": ") << name;
+				if (ss.isBot[slot])
+				stream << " (bot)";
+			}
+
+			player++;
+		}
+
+		stream << endl;
+	}
+
+	return stream.str();
+}
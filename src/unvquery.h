@@ -24,8 +24,15 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <netdb.h>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <vector>
 
 #include "common.h"
+#include "clock.h"
 
 // Maximum number of servers to query
 #define MAX_SERVERS 1024
@@ -36,9 +43,18 @@ along with Mantis.  If not, see <http://www.gnu.org/licenses/>.
 // Timeout for queries in seconds
 #define TIMEOUT_S   2
 
-// Minimum query periods for printActiveServers
-#define PRINTACTIVESERVERS_LISTPERIOD   120
-#define PRINTACTIVESERVERS_STATUSPERIOD 10
+// Timeout for queries to a single server in milliseconds
+#define SERVER_TIMEOUT_MS 1000
+
+// Port of a game server if none is given
+#define DEFAULT_PORT      27960
+
+// Maximum number of servers listed when a name is ambiguous
+#define MAX_CANDIDATES    3
+
+// Minimum query periods for streamActiveServers
+#define ACTIVESERVERS_LISTPERIOD        120
+#define ACTIVESERVERS_STATUSPERIOD      10
 
 // Minimum query periods for checkPeekActivity
 #define CHECKPEEKACTIVITY_LISTPERIOD    120
@@ -58,13 +74,17 @@ class UnvQuery
 {
 public:
 
+	typedef std::function<void(const std::string &line)> lineHandler_t;
+
 	/**
 	 * @param master   Hostname or address of master server
 	 * @param port     Port of master server
 	 * @param protocol Protocol number of game servers
 	 * @param useColor Whether to use BB style codes in responses
+	 * @param clock    Clock that query periods and peek activity are measured with
 	 */
-	UnvQuery(std::string master, unsigned short port, unsigned short protocol, bool useColor);
+	UnvQuery(std::string master, unsigned short port, unsigned short protocol, bool useColor,
+	         Clock *clock = Clock::system());
 
 	/**
 	 * @param useColor Whether to use BB style codes in responses
@@ -76,8 +96,18 @@ public:
 	 */
 	bool           usesColor();
 
+	/**
+	 * @brief Points the instance to another master server, the next refresh queries it.
+	 * @return Whether the master server's address could be resolved.
+	 */
+	bool           setMaster(std::string master, unsigned short port, unsigned short protocol);
+
 	/**
 	 * @brief Refresh server list and server status for every known server.
+	 *
+	 * Calls from several threads are coalesced: A caller that finds a refresh in flight waits for
+	 * it and shares its result instead of querying again.
+	 *
 	 * @param minServersQueryPeriod Don't refresh server list more frequently than this.
 	 * @param minStatusQueryPeriod  Don't refresh server status more frequently than this.
 	 * @return
@@ -116,6 +146,12 @@ public:
 	 */
 	bool           refreshServerStatus();
 
+	/**
+	 * @brief Forgets when the server list and status were last queried, so that the next refresh
+	 *        with a minimum period queries again.
+	 */
+	void           invalidate();
+
 	/**
 	 * @return Number of responsive game servers.
 	 */
@@ -124,13 +160,31 @@ public:
 	std::string    printServerLine(int serverNum);
 
 	/**
-	 * @brief Prints a list of servers with players on a team on them.
-	 * @return The list as a newline seperated string.
+	 * @brief Lists the servers with players on a team on them. The line of every active server is
+	 *        handed to a handler as soon as the server answers instead of after the whole sweep.
+	 * @param handler  Receives one newline terminated line per active server.
+	 * @param maxLines Maximum number of lines to hand to the handler.
+	 * @return A summary line, empty if no one is playing.
 	 */
-	std::string    printActiveServers();
+	std::string    streamActiveServers(lineHandler_t handler, unsigned int maxLines);
 
 	std::string    checkPeekActivity(time_t period, int minPlayers);
 
+	/**
+	 * @brief Publishes server states as if a sweep had just returned them, so that a synthetic
+	 *        trace can be replayed without network access.
+	 * @param players Number of players per server, they are split between the teams
+	 */
+	void           simulateStatus(const std::vector<int> &players);
+
+	/**
+	 * @brief Queries a single server for its status and players, without a sweep.
+	 * @param server Address of the server, or a prefix of its name or address as seen by the last
+	 *               sweep.
+	 * @return A description of the server, or why there is none.
+	 */
+	std::string    printServerDetails(std::string server);
+
 private:
 
 	typedef enum team_e
@@ -171,8 +225,32 @@ private:
 	}
 	serverStatus_t;
 
+	typedef struct server_s
+	{
+		// address and port in NBO
+		uint32_t addr;
+		uint16_t port;
+	}
+	server_t;
+
+	typedef std::shared_ptr<const std::vector<server_t> >       serverList_t;
+	typedef std::shared_ptr<const std::vector<serverStatus_t> > statusList_t;
+	typedef std::function<void(const serverStatus_t &status)>   statusHandler_t;
+
+	// maps names without color codes in lower case as well as addresses to addresses
+	typedef std::shared_ptr<const std::map<std::string, std::string> > serverIndex_t;
+
+	typedef struct player_s
+	{
+		int         score;
+		int         ping;
+		std::string name;
+	}
+	player_t;
+
 	// parameters
 	bool           useColor;
+	Clock          *clock;
 
 	// network
 	int            masterSock;
@@ -180,17 +258,21 @@ private:
 	sockaddr_in    masterAddr;
 	char           getServersQuery[128];
 
+	// single flight, guards everything below
+	std::mutex              lock;
+	std::condition_variable sweepDone;
+	bool                    sweeping;
+
 	// rate limiting
 	time_t         lastServerListQuery;
 	time_t         lastServerStatusQuery;
 	bool           serverListQuerySuccessful;
 	bool           serverStatusQuerySuccessful;
 
-	// server info
-	int            numKnown, numResponsive;
-	uint32_t       servers[MAX_SERVERS];
-	uint16_t       ports[MAX_SERVERS];
-	serverStatus_t status[MAX_SERVERS];
+	// server info, replaced as a whole after every sweep so that readers never see a partial one
+	serverList_t   serverList;
+	statusList_t   serverStatus;
+	serverIndex_t  serverIndex;
 
 	// peek activity data
 	typedef struct  peekActivity_e
@@ -202,14 +284,31 @@ private:
 
 	peekActivity_t peekActivityData[MAX_PLAYERS + 1];
 
+	// queries
+	bool sweep(bool list, bool status, bool forced, time_t minListPeriod, time_t minStatusPeriod,
+	           const statusHandler_t &handler = statusHandler_t());
+	bool isDue(time_t last, bool successful, time_t minPeriod, time_t now);
+	void publishStatus(std::shared_ptr<std::vector<serverStatus_t> > status, bool successful, time_t now);
+	bool queryServerList(const sockaddr_in &master, const char *query, std::vector<server_t> &list);
+	bool queryServerStatus(const std::vector<server_t> &list, std::vector<serverStatus_t> &status,
+	                       const statusHandler_t &handler);
+	statusList_t currentStatus();
+	bool resolveServer(std::string server, sockaddr_in &addr, std::string &error);
+	bool queryServer(const sockaddr_in &addr, serverStatus_t &ss, std::vector<player_t> &players, int &ping);
+
 	// parsers
-	bool parseStatusResponse(int infoNum, const char *address, const char *response, size_t responseLen);
-	int  parseStatusResponseField(int infoNum, const char *address, const char *field, size_t maxLen);
-	void parseStatusResponseKeyValue(int statusNum, const char *key, const char *value);
-	void analyzeClientData(int statusNum);
+	bool parseStatusResponse(serverStatus_t *ss, const char *address, const char *response, size_t responseLen);
+	int  parseStatusResponseField(serverStatus_t *ss, const char *address, const char *field, size_t maxLen);
+	void parseStatusResponseKeyValue(serverStatus_t *ss, const char *key, const char *value);
+	void analyzeClientData(serverStatus_t *ss);
+	static void parsePlayers(const char *response, size_t responseLen, std::vector<player_t> &players);
+
+	// printers
+	std::string printServerLine(const serverStatus_t *s);
 
 	// helpers
-	static void    stripColors(char *dst, const char *src, size_t maxChars);
+	static void        stripColors(char *dst, const char *src, size_t maxChars);
+	static std::string indexKey(const char *name);
 };
 
 #endif // UNVINFO_H